@@ -1,10 +1,13 @@
 #include "pch.h"
 
 #include <unistd.h>
+#include <limits.h>
 #include <sys/uio.h>
 #include <cstdio>
 
 #include "core/buffer.h"
+#include "core/page_allocator.h"
+#include "utils/atomic.h"
 #include "utils/exception.h"
 #include "utils/logger.h"
 
@@ -12,105 +15,212 @@ using namespace tube::utils;
 
 namespace tube {
 
+const size_t Buffer::kSmallPageSize = 4096;
+
 const size_t Buffer::kPageSize = 8192;
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define ALLOC_PAGE() ((byte*) malloc(kPageSize))
-#define FREE_PAGE(page) (free(page))
+
+static BufferPage*
+alloc_buffer_page(size_t page_size)
+{
+    BufferPage* page =
+        (BufferPage*) PageAllocator::instance().alloc_page(page_size);
+    page->refs = 1;
+    page->size = page_size - sizeof(BufferPage);
+    return page;
+}
+
+static void
+release_buffer_page(BufferPage* page)
+{
+    if (atomic_sub(&page->refs, 1L) == 0) {
+        PageAllocator::instance().free_page(
+            (byte*) page, page->size + sizeof(BufferPage));
+    }
+}
+
+void
+PageRing::grow()
+{
+    size_t capacity = capacity_ ? capacity_ * 2 : 4;
+    PageSlice* slices = new PageSlice[capacity];
+    for (size_t i = 0; i < size_; i++) {
+        slices[i] = (*this)[i];
+    }
+    delete [] slices_;
+    slices_ = slices;
+    capacity_ = capacity;
+    head_ = 0;
+}
 
 Buffer::Buffer()
+    : size_(0), read_size_(kSmallPageSize)
 {
-    cow_info_ = CowInfoPtr(new Buffer::CowInfo());
-    borrowed_ = false;
-    cow_info_->pages_.push_back(ALLOC_PAGE());
-    left_offset_ = size_ = 0;
-    right_offset_ = kPageSize;
 }
 
 Buffer::Buffer(const Buffer& rhs)
-    : left_offset_(rhs.left_offset_), right_offset_(rhs.right_offset_),
-      size_(rhs.size_)
+    : size_(0), read_size_(rhs.read_size_)
 {
-    cow_info_ = rhs.cow_info_; // increase the reference
-    borrowed_ = true;
+    append(rhs);
 }
 
 Buffer&
 Buffer::operator=(const Buffer& rhs)
 {
-    left_offset_ = rhs.left_offset_;
-    right_offset_ = rhs.right_offset_;
-    size_ = rhs.size_;
-
-    cow_info_ = rhs.cow_info_;
-    borrowed_ = true;
+    if (this != &rhs) {
+        release_slices();
+        read_size_ = rhs.read_size_;
+        append(rhs);
+    }
     return *this;
 }
 
-Buffer::CowInfo::CowInfo()
+Buffer::~Buffer()
 {
-    extra_page_ = NULL;
+    release_slices();
 }
 
-Buffer::CowInfo::~CowInfo()
+byte*
+Buffer::tail_room(size_t* len_ret)
 {
-    FREE_PAGE(extra_page_);
-    for (PageList::iterator it = pages_.begin(); it != pages_.end(); ++it) {
-        FREE_PAGE(*it);
+    *len_ret = 0;
+    if (slices_.empty()) {
+        return NULL;
+    }
+    PageSlice& slice = slices_.back();
+    // shared pages are never written, whatever follows the slice may be
+    // another buffer's data
+    if (atomic_load(&slice.page->refs) != 1) {
+        return NULL;
     }
+    byte* end = slice.data + slice.length;
+    *len_ret = slice.page->data_end() - end;
+    return end;
 }
 
-void
-Buffer::copy_for_write()
+size_t
+Buffer::next_page_size(size_t sz)
 {
-    // puts("copy for write");
-    CowInfoPtr ptr = cow_info_;
-    cow_info_ = CowInfoPtr(new CowInfo());
-    borrowed_ = false;
-
-    for (PageList::const_iterator it = ptr->pages_.begin();
-         it != ptr->pages_.end(); ++it) {
-        byte* page_data = ALLOC_PAGE();
-        memcpy(page_data, *it, kPageSize);
-        cow_info_->pages_.push_back(page_data);
+    // the first page is small, later ones twice the size of the last, and
+    // any page holds sz bytes if a large one can
+    size_t page_size = kSmallPageSize;
+    if (!slices_.empty()) {
+        page_size = (slices_.back().page->size + sizeof(BufferPage)) * 2;
+    }
+    while (page_size < kLargePageSize && page_size - sizeof(BufferPage) < sz) {
+        page_size *= 2;
     }
+    return MIN(page_size, kLargePageSize);
 }
 
-bool
-Buffer::need_copy_for_write() const
+void
+Buffer::append_page(size_t page_size)
 {
-    return borrowed_ && cow_info_.use_count() > 1;
+    PageSlice slice;
+    slice.page = alloc_buffer_page(page_size);
+    slice.data = slice.page->data();
+    slice.length = 0;
+    slices_.push_back(slice);
 }
 
-Buffer::~Buffer()
+void
+Buffer::append_page(BufferPage* page, size_t length)
 {
+    PageSlice slice;
+    slice.page = page;
+    slice.data = page->data();
+    slice.length = length;
+    slices_.push_back(slice);
+    size_ += length;
 }
 
-ssize_t
-Buffer::read_from_fd(int fd)
+void
+Buffer::append_slice(const PageSlice& slice, size_t length)
 {
-    struct iovec vec[2];
-    if (need_copy_for_write())
-        copy_for_write();
+    if (length < kMinShareSize) {
+        append(slice.data, length);
+        return;
+    }
+    size_ += length;
+    if (!slices_.empty()) {
+        PageSlice& last = slices_.back();
+        if (last.page == slice.page && last.data + last.length == slice.data) {
+            last.length += length;
+            return;
+        }
+    }
+    atomic_add(&slice.page->refs, 1L);
+    PageSlice shared = slice;
+    shared.length = length;
+    slices_.push_back(shared);
+}
 
-    if (cow_info_->extra_page_ == NULL) {
-        cow_info_->extra_page_ = ALLOC_PAGE();
+void
+Buffer::release_slices()
+{
+    while (!slices_.empty()) {
+        release_buffer_page(slices_.front().page);
+        slices_.pop_front();
     }
+    size_ = 0;
+}
 
-    vec[0].iov_base = cow_info_->pages_.back() + kPageSize - right_offset_;
-    vec[0].iov_len = right_offset_;
-    vec[1].iov_base = cow_info_->extra_page_;
-    vec[1].iov_len = kPageSize;
+ssize_t
+Buffer::read_from_fd(int fd)
+{
+    static const size_t kMaxSpare = kMaxReadSize / kLargePageSize;
+    struct iovec vec[kMaxSpare + 1];
+    BufferPage* spare[kMaxSpare];
+    size_t nvec = 0;
+
+    size_t room = 0;
+    byte* tail = tail_room(&room);
+    if (room > 0) {
+        vec[nvec].iov_base = tail;
+        vec[nvec].iov_len = room;
+        nvec++;
+    }
+    // spare pages come from the thread's page cache, and unused ones go back
+    // there
+    size_t page_size = MIN(read_size_, kLargePageSize);
+    size_t nspare = read_size_ / page_size;
+    for (size_t i = 0; i < nspare; i++) {
+        spare[i] = alloc_buffer_page(page_size);
+        vec[nvec].iov_base = spare[i]->data();
+        vec[nvec].iov_len = spare[i]->size;
+        nvec++;
+    }
 
-    int nread = readv(fd, vec, 2);
+    ssize_t nread = readv(fd, vec, nvec);
+    size_t nused = 0;
+    size_t rest = nread > 0 ? nread : 0;
+    if (room > 0) {
+        size_t n = MIN(rest, room);
+        slices_.back().length += n;
+        rest -= n;
+    }
+    bool filled = rest > 0;
+    for (; rest > 0; nused++) {
+        PageSlice slice;
+        slice.page = spare[nused];
+        slice.data = slice.page->data();
+        slice.length = MIN(rest, slice.page->size);
+        slices_.push_back(slice);
+        filled = slice.length == slice.page->size;
+        rest -= slice.length;
+    }
+    for (size_t i = nused; i < nspare; i++) {
+        release_buffer_page(spare[i]);
+    }
     if (nread < 0)
         return nread;
-    if (right_offset_ <= (size_t) nread) {
-        right_offset_ = kPageSize + right_offset_ - nread;
-        cow_info_->pages_.push_back(cow_info_->extra_page_);
-        cow_info_->extra_page_ = ALLOC_PAGE();
+
+    // every page filled, the socket probably has more
+    if (nused == nspare && filled) {
+        read_size_ = MIN(read_size_ * 2, kMaxReadSize);
     } else {
-        right_offset_ -= nread;
+        read_size_ = kSmallPageSize;
     }
     size_ += nread;
     return nread;
@@ -119,114 +229,88 @@ Buffer::read_from_fd(int fd)
 bool
 Buffer::append(const byte* ptr, size_t sz)
 {
-    if (need_copy_for_write())
-        copy_for_write();
-
     size_ += sz;
-
-    byte* dest = cow_info_->pages_.back() + kPageSize - right_offset_;
-    if (sz < right_offset_) {
-        memcpy(dest, ptr, sz);
-        right_offset_ -= sz;
-        return true;
-    }
-    memcpy(dest, ptr, right_offset_);
-    ptr += right_offset_;
-    sz -= right_offset_;
-    while (true) {
-        dest = ALLOC_PAGE();
-        memcpy(dest, ptr, MIN(kPageSize, sz));
-        cow_info_->pages_.push_back(dest);
-        if (sz < kPageSize) {
-            right_offset_ = kPageSize - sz;
-            break;
+    while (sz > 0) {
+        size_t room = 0;
+        byte* dest = tail_room(&room);
+        if (room == 0) {
+            append_page(next_page_size(sz));
+            continue;
         }
-        ptr += kPageSize;
-        sz -= kPageSize;
+        size_t ncopy = MIN(room, sz);
+        memcpy(dest, ptr, ncopy);
+        slices_.back().length += ncopy;
+        ptr += ncopy;
+        sz -= ncopy;
     }
     return true; // buffer objects always accept the append operation
 }
 
 bool
-Buffer::append(Buffer& buffer)
+Buffer::append(const Buffer& buffer)
 {
-    bool fail = false;
-    for (PageIterator it = buffer.page_begin(); it != buffer.page_end(); ++it) {
-        size_t len = 0;
-        const byte* ptr = buffer.get_page_segment(*it, &len);
-        if (!append(ptr, len)) {
-            fail = true;
-        }
+    if (&buffer == this) {
+        Buffer copy(buffer);
+        return append(copy);
+    }
+    for (size_t i = 0; i < buffer.slices_.size(); i++) {
+        const PageSlice& slice = buffer.slices_[i];
+        append_slice(slice, slice.length);
     }
-    return !fail;
+    return true;
 }
 
 bool
-Buffer::copy_front(byte* ptr, size_t sz)
+Buffer::copy_front(byte* ptr, size_t sz) const
 {
     if (size_ < sz)
         return false;
 
-    PageIterator it = cow_info_->pages_.begin();
-    int ncopy = 0;
-    do {
-        if (it == cow_info_->pages_.begin()) {
-            ncopy = MIN(sz, kPageSize - left_offset_);
-            memcpy(ptr, *it + left_offset_, ncopy);
-        } else {
-            ncopy = MIN(sz, kPageSize);
-            memcpy(ptr, *it, ncopy);
-        }
+    for (size_t i = 0; sz > 0; i++) {
+        const PageSlice& slice = slices_[i];
+        size_t ncopy = MIN(sz, slice.length);
+        memcpy(ptr, slice.data, ncopy);
         ptr += ncopy;
         sz -= ncopy;
-        ++it;
-    } while (sz > 0);
+    }
     return true;
 }
 
 bool
-Buffer::copy_front(Buffer& buffer, size_t sz)
+Buffer::copy_front(Buffer& buffer, size_t sz) const
 {
     if (size_ < sz)
         return false;
+    if (&buffer == this) {
+        Buffer copy(*this);
+        return copy.copy_front(buffer, sz);
+    }
 
-    PageIterator it = cow_info_->pages_.begin();
-    int ncopy = 0;
-    do {
-        if (it == cow_info_->pages_.begin()) {
-            ncopy = MIN(sz, kPageSize - left_offset_);
-            buffer.append(*it + left_offset_, ncopy);
-        } else {
-            ncopy = MIN(sz, kPageSize);
-            buffer.append(*it, ncopy);
-        }
+    for (size_t i = 0; sz > 0; i++) {
+        const PageSlice& slice = slices_[i];
+        size_t ncopy = MIN(sz, slice.length);
+        buffer.append_slice(slice, ncopy);
         sz -= ncopy;
-        ++it;
-    } while (sz > 0);
+    }
     return true;
 }
 
 bool
 Buffer::pop(size_t pop_size)
 {
-    if (need_copy_for_write())
-        copy_for_write();
-
     if (size_ < pop_size)
         return false;
-    div_t res = div(pop_size + left_offset_, kPageSize);
-    int npage = res.quot;
-    left_offset_ = res.rem;
-    for (int i = 0; i < npage; i++) {
-        if (cow_info_->pages_.size() > 1) {
-            FREE_PAGE(cow_info_->pages_.front());
-            cow_info_->pages_.pop_front();
-        }
-    }
     size_ -= pop_size;
-    if (size_ == 0) {
-        left_offset_ = 0;
-        right_offset_ = kPageSize;
+    while (pop_size > 0) {
+        PageSlice& slice = slices_.front();
+        if (slice.length > pop_size) {
+            slice.data += pop_size;
+            slice.length -= pop_size;
+            break;
+        }
+        pop_size -= slice.length;
+        release_buffer_page(slice.page);
+        slices_.pop_front();
     }
     return true;
 }
@@ -234,7 +318,9 @@ Buffer::pop(size_t pop_size)
 int
 Buffer::pop_page()
 {
-    int buf_size = kPageSize - left_offset_;
+    if (slices_.empty())
+        return 0;
+    int buf_size = slices_.front().length;
     pop(buf_size);
     return buf_size;
 }
@@ -242,30 +328,17 @@ Buffer::pop_page()
 void
 Buffer::clear()
 {
-    pop(size_);
+    release_slices();
 }
 
 ssize_t
 Buffer::write_to_fd(int fd)
 {
-    if (need_copy_for_write())
-        copy_for_write();
-
     if (size_ == 0)
         return 0;
     int nwrite = 0;
-    struct iovec vec[2];
-    PageList::iterator it = cow_info_->pages_.begin();
-    int nvec = MIN(2, cow_info_->pages_.size());
-    for (int i = 0; i < nvec; i++, ++it) {
-        byte* ptr = *it;
-        if (i == 0)
-            ptr += left_offset_;
-        vec[i].iov_base = ptr;
-        vec[i].iov_len = kPageSize;
-    }
-    vec[0].iov_len -= left_offset_;
-    vec[nvec - 1].iov_len -= right_offset_;
+    struct iovec vec[kMaxIovecs];
+    size_t nvec = fill_iovecs(vec, kMaxIovecs);
     nwrite = writev(fd, vec, nvec);
     if (nwrite > 0) {
         pop(nwrite);
@@ -273,20 +346,35 @@ Buffer::write_to_fd(int fd)
     return nwrite;
 }
 
-byte*
-Buffer::get_page_segment(byte* page_start_ptr, size_t* len_ret)
+size_t
+Buffer::fill_iovecs(struct iovec* vec, size_t max_vec) const
 {
-    byte* ptr = page_start_ptr;
-    size_t len = kPageSize;
-    if (page_start_ptr == cow_info_->pages_.front()) {
-        ptr += left_offset_;
-        len -= left_offset_;
-    }
-    if (page_start_ptr == cow_info_->pages_.back()) {
-        len -= right_offset_;
+    size_t nvec = MIN(max_vec, slices_.size());
+    for (size_t i = 0; i < nvec; i++) {
+        vec[i].iov_base = slices_[i].data;
+        vec[i].iov_len = slices_[i].length;
     }
-    if (len_ret) *len_ret = len;
-    return ptr;
+    return nvec;
+}
+
+byte*
+Buffer::page_segment(size_t idx, size_t* len_ret) const
+{
+    const PageSlice& slice = slices_[idx];
+    if (len_ret) *len_ret = slice.length;
+    return slice.data;
+}
+
+BufferPage*
+Buffer::new_page(size_t page_size)
+{
+    return alloc_buffer_page(page_size);
+}
+
+void
+Buffer::release_page(BufferPage* page)
+{
+    release_buffer_page(page);
 }
 
 }
@@ -5,15 +5,17 @@
 
 #include <cstdlib>
 #include <stdint.h>
-#include <list>
 
+#include <limits.h>
 #include <sys/types.h>
-#include <boost/shared_ptr.hpp>
+#include <sys/uio.h>
 
 #include "utils/misc.h"
 
 namespace tube {
 
+class Buffer;
+
 /**
  * Writeable interface for objects that can be flushed and write back to the
  * clients.
@@ -48,23 +50,145 @@ public:
      * @return Success or not.
      */
     virtual bool    append(const byte* ptr, size_t size) = 0;
+    /**
+     * Get the data as iovecs, so that the stream can write several
+     * writeables in one system call.  Writeables which aren't in memory
+     * (like sendfile one) have no iovecs.
+     * @param vec The iovecs to fill.
+     * @param max_vec Maximum number of iovecs.
+     * @return Number of iovecs filled.
+     */
+    virtual size_t  fill_iovecs(struct iovec* vec, size_t max_vec) const {
+        return 0;
+    }
+    /**
+     * Erase the first bytes, which are written from the iovecs.
+     * @param size Number of bytes written.
+     */
+    virtual void    consume(size_t size) {}
+    /**
+     * @return True if the data is in memory, and can be got by fill_iovecs().
+     */
+    virtual bool    in_memory() const { return false; }
+    /**
+     * Append the data to a Buffer, sharing the pages, so that it stays valid
+     * whatever happens to this writeable.  Only for writeables in memory.
+     */
+    virtual void    copy_to(Buffer& buffer) const {}
+};
+
+/**
+ * Reference counted page of a Buffer, the data follows the header.  Pages
+ * are shared by Buffers, each of them holding slices of the page.
+ */
+struct BufferPage
+{
+    volatile long refs;
+    size_t        size; // bytes of data
+
+    byte* data() { return (byte*) (this + 1); }
+    byte* data_end() { return data() + size; }
+};
+
+/**
+ * Part of a page which belongs to a Buffer.
+ */
+struct PageSlice
+{
+    BufferPage* page;
+    byte*       data;
+    size_t      length;
+};
+
+/**
+ * Ring of page slices, indexed from the first slice in O(1).  It grows by
+ * doubling and never shrinks.
+ */
+class PageRing : public utils::Noncopyable
+{
+public:
+    PageRing() : slices_(NULL), capacity_(0), head_(0), size_(0) {}
+    ~PageRing() { delete [] slices_; }
+
+    size_t size() const { return size_; }
+    bool   empty() const { return size_ == 0; }
+
+    PageSlice& operator[](size_t idx) {
+        return slices_[(head_ + idx) & (capacity_ - 1)];
+    }
+    const PageSlice& operator[](size_t idx) const {
+        return slices_[(head_ + idx) & (capacity_ - 1)];
+    }
+    PageSlice& front() { return (*this)[0]; }
+    PageSlice& back() { return (*this)[size_ - 1]; }
+
+    void push_back(const PageSlice& slice) {
+        if (size_ == capacity_) {
+            grow();
+        }
+        slices_[(head_ + size_) & (capacity_ - 1)] = slice;
+        size_++;
+    }
+    void pop_front() {
+        head_ = (head_ + 1) & (capacity_ - 1);
+        size_--;
+    }
+private:
+    PageSlice* slices_;
+    size_t     capacity_; // power of two
+    size_t     head_;
+    size_t     size_;
+
+    void grow();
 };
 
 /**
  * High performance buffer system designed for copy, reading and writing to
  * sockets.
  * It split the data in to several pages, so append and pop operations are fast.
+ *
+ * Pages are reference counted and a Buffer holds slices of them.  Copying a
+ * Buffer, appending one Buffer to another, or copying its front to another
+ * Buffer shares the pages instead of copying the data.  Data is only written
+ * to the free space of a page not shared with any other Buffer.
+ *
+ * Pages come in the size classes of PageAllocator.  A Buffer starts with a
+ * small page, enough for most headers, and its pages double while it grows
+ * up to kLargePageSize, so bulk data takes few pages to write.
  */
 class Buffer : public Writeable
 {
 public:
     /**
-     * Page size, default 16k.
+     * Size of the first page of a buffer, default 4k.
+     */
+    static const size_t kSmallPageSize;
+    /**
+     * Page size, default 8k.
      */
     static const size_t kPageSize;
-
-    typedef std::list<byte*> PageList;
-    typedef PageList::iterator PageIterator;
+    /**
+     * Size of the largest pages, for bulk data.
+     */
+    static const size_t kLargePageSize = 64 << 10;
+    /**
+     * Maximum number of bytes read_from_fd() reads at a time.  Reads start
+     * with one small spare page and double while the pages get filled.
+     */
+    static const size_t kMaxReadSize = 128 << 10;
+    /**
+     * Slices shorter than this are copied rather than shared, so that small
+     * pieces don't pin whole pages.
+     */
+    static const size_t kMinShareSize = 512;
+    /**
+     * Maximum number of iovecs written at a time.
+     */
+#ifdef IOV_MAX
+    static const size_t kMaxIovecs = IOV_MAX;
+#else
+    static const size_t kMaxIovecs = 1024;
+#endif
 
     Buffer();
     Buffer(const Buffer& rhs);
@@ -84,7 +208,19 @@ public:
 
     virtual ssize_t write_to_fd(int fd);
     virtual bool    append(const byte* ptr, size_t sz);
-    virtual bool    append(Buffer& buffer);
+    virtual size_t  fill_iovecs(struct iovec* vec, size_t max_vec) const;
+    virtual void    consume(size_t size) { pop(size); }
+    virtual bool    in_memory() const { return true; }
+    virtual void    copy_to(Buffer& buffer) const { buffer.append(*this); }
+    /**
+     * Append the data of another buffer, sharing its pages.
+     */
+    virtual bool    append(const Buffer& buffer);
+    /**
+     * Append the first bytes of a page, taking over a reference of it, e.g.
+     * a page the kernel has received data into.
+     */
+    void            append_page(BufferPage* page, size_t length);
 
     /**
      * Copy the first several bytes to pointer ptr.
@@ -92,8 +228,11 @@ public:
      * @param size Size of data to be copied.
      * @return True if the operation succeeded.
      */
-    bool copy_front(byte* ptr, size_t size);
-    bool copy_front(Buffer& buffer, size_t size);
+    bool copy_front(byte* ptr, size_t size) const;
+    /**
+     * Append the first several bytes to another buffer, sharing the pages.
+     */
+    bool copy_front(Buffer& buffer, size_t size) const;
 
     /**
      * Erase the first @param pop_size bytes.
@@ -112,59 +251,36 @@ public:
     void clear();
 
     /**
-     * Iterator for the first page.
-     * @return The page iterator.
+     * Number of pages, or slices of pages.
      */
-    PageIterator page_begin() const { return cow_info_->pages_.begin(); }
+    size_t page_count() const { return slices_.size(); }
     /**
-     * Iterator for the last page.
-     * @return The page iterator.
+     * Get the data of a page by its index.
+     * @param idx Index of the page, less than page_count().
+     * @param len_ret The pointer to store the length of the data.
+     * @return The pointer that points to the data.
      */
-    PageIterator page_end() const { return cow_info_->pages_.end(); }
-    /**
-     * Get pointer of the first page.  To get the boundary of this pointer,
-     * use get_page_segment().
-     * @return The pointer that points to the raw data
-     */
-    byte* first_page() const { return cow_info_->pages_.front(); }
+    byte* page_segment(size_t idx, size_t* len_ret) const;
+
     /**
-     * Get pointer of the last page.  To get the boundary of this pointer,
-     * use get_page_segment()
-     * @return The pointer that points to the raw data
+     * Allocate a page of a size class, with one reference.
      */
-    byte* last_page() const { return cow_info_->pages_.back(); }
+    static BufferPage* new_page(size_t page_size);
     /**
-     * Get the boundary and correct the offset of the pointer returned from
-     * first_page() or last_page().
-     * @param page_start_ptr The pointer that points to page address, mostly
-     * is the return value from first_page() or last_page()
-     * @param len_ret The pointer is store the return value, which is the
-     * boundry of the returning pointer.
-     * @return The refined pointer that points to the correct data.
+     * Drop a reference of the page, the last one frees it.
      */
-    byte* get_page_segment(byte* page_start_ptr, size_t* len_ret);
+    static void        release_page(BufferPage* page);
 
 private:
-    void copy_for_write();
-    bool need_copy_for_write() const;
-    void new_cow_info();
-
-private:
-    struct CowInfo {
-        CowInfo();
-        ~CowInfo();
-
-        byte*    extra_page_;
-        PageList pages_;
-    };
-
-    typedef boost::shared_ptr<CowInfo> CowInfoPtr;
-
-    CowInfoPtr cow_info_;
-    bool       borrowed_;
-
-    size_t   left_offset_, right_offset_;
+    PageRing slices_;
     size_t   size_;
+    size_t   read_size_; // spare bytes for the next read_from_fd()
+
+    byte*  tail_room(size_t* len_ret);
+    size_t next_page_size(size_t sz);
+    void   append_page(size_t page_size);
+    void   append_slice(const PageSlice& slice, size_t length);
+    void   release_slices();
 };
 
 }
@@ -4,14 +4,56 @@
 #include "core/controller.h"
 #include "core/pipeline.h"
 #include "core/stages.h"
+#include "utils/atomic.h"
 #include "utils/logger.h"
 
 namespace tube {
 
+int
+Controller::kMaxThreadIdle = 500;
+
+int
+Controller::kCheckInterval = 300;
+
+long
+Controller::kDefaultTargetLatency = 20000;
+
+size_t
+Controller::kDefaultMaxThreads = 128;
+
+// latency has to be above target by this percentage to grow, and below by
+// this percentage to shrink
+static const long
+kHysteresis = 20;
+
+// number of consecutive checks needed before a decision
+static const int
+kGrowStreak = 2;
+
+static const int
+kShrinkStreak = 5;
+
+// number of checks skipped after a decision, for it to take effect
+static const int
+kCooldown = 2;
+
+// shrink only when threads are busy less than this percentage of time
+static const long
+kShrinkUtilization = 50;
+
 Controller::Controller()
-    : reserve_(0), stage_(NULL), current_load_(0), current_speed_(0),
-      best_speed_(0), best_threads_size_(0)
+    : stage_(NULL), target_latency_(kDefaultTargetLatency),
+      max_threads_(kDefaultMaxThreads), ntasks_(0), service_time_(0),
+      last_check_time_(0), grow_streak_(0), shrink_streak_(0), cooldown_(0),
+      nretiring_(0), nr_grows_(0), nr_shrinks_(0), last_latency_(0),
+      last_queue_delay_(0), last_service_time_(0)
 {
+}
+
+void
+Controller::start()
+{
+    last_check_time_ = utils::monotonic_usec();
     utils::create_thread(boost::bind(&Controller::check_thread, this));
 }
 
@@ -36,6 +78,10 @@ Controller::exit_auto_thread(utils::ThreadId id)
 {
     utils::Lock lk(mutex_);
     auto_threads_.erase(id);
+    // threads exited by idle timeout don't need to be retired any more
+    if (nretiring_ > (long) auto_threads_.size()) {
+        utils::atomic_store(&nretiring_, (long) auto_threads_.size());
+    }
 }
 
 void
@@ -44,105 +90,119 @@ Controller::exit_auto_thread()
     exit_auto_thread(utils::thread_id());
 }
 
-void
-Controller::increase_load(long inc)
+size_t
+Controller::nr_auto_threads()
 {
     utils::Lock lk(mutex_);
-    current_load_ += inc;
+    return auto_threads_.size();
 }
 
 void
-Controller::decrease_load(long dec)
+Controller::record_task(long usec)
 {
-    utils::Lock lk(mutex_);
-    current_load_ -= dec;
-    current_speed_ += dec;
+    utils::atomic_add(&ntasks_, 1L);
+    utils::atomic_add(&service_time_, usec);
 }
 
-int
-Controller::kMaxThreadIdle = 500;
-
-int
-Controller::kCheckAutoCreate = 300;
-
-static const size_t
-kMaxFeedback = 16;
-
-static const size_t
-kMinFeedback = 8;
-
-static const long
-kMinLoad = 15;
-
-static const size_t
-kMaxThread = 128;
-
-static const size_t
-kDecisionHistoryNumber = 16;
-
 bool
-Controller::check_auto_create()
+Controller::should_retire()
 {
+    if (utils::atomic_load(&nretiring_) == 0) {
+        return false;
+    }
     utils::Lock lk(mutex_);
-    if (load_history_.size() == kMaxFeedback) {
-        load_history_.erase(load_history_.begin());
+    if (nretiring_ == 0
+        || auto_threads_.find(utils::thread_id()) == auto_threads_.end()) {
+        return false;
     }
-    load_history_.push_back(current_load_);
-
-    size_t at_size = auto_threads_.size();
-    size_t lh_size = load_history_.size();
+    auto_threads_.erase(utils::thread_id());
+    utils::atomic_sub(&nretiring_, 1L);
+    return true;
+}
 
-    if (best_speed_ < current_speed_) {
-        best_speed_ = current_speed_;
-        best_threads_size_ = at_size;
+int
+Controller::check_latency()
+{
+    u64 now = utils::monotonic_usec();
+    long interval = now - last_check_time_;
+    last_check_time_ = now;
+    if (interval <= 0) {
+        return 0;
     }
-    current_speed_ = 0;
 
-    if (reserve_ > 0) {
-        reserve_--;
-        return false;
-    }
+    long ntasks = utils::atomic_swap(&ntasks_, 0L);
+    long service = utils::atomic_swap(&service_time_, 0L);
+    long queue = stage_->scheduler()->size_nolock();
 
-    if (at_size > kMaxThread) {
-        return false;
+    utils::Lock lk(mutex_);
+    size_t nauto = auto_threads_.size();
+    size_t nthreads = stage_->thread_pool_size()
+        * Pipeline::instance().shard_count() + nauto;
+
+    last_service_time_ = ntasks > 0 ? service / ntasks : 0;
+    if (ntasks > 0) {
+        // Little's law: waiting time = queue length / throughput
+        last_queue_delay_ = (long) ((double) queue * interval / ntasks);
+    } else {
+        // nothing is done, queued tasks waited for the whole interval
+        last_queue_delay_ = queue > 0 ? interval : 0;
     }
+    last_latency_ = last_queue_delay_ + last_service_time_;
+    long utilization = service * 100 / (interval * (long) nthreads);
 
-    if (lh_size < kMinFeedback) {
-        return false;
-    }
+    LOG(DEBUG, "%s stage: latency %ldus (queue %ldus service %ldus) "
+        "target %ldus queue length %ld utilization %ld%% threads %lu",
+        stage_->name().c_str(), last_latency_, last_queue_delay_,
+        last_service_time_, target_latency_, queue, utilization, nthreads);
 
-    if (best_threads_size_ < at_size) {
-        return false;
+    if (cooldown_ > 0) {
+        cooldown_--;
+        return 0;
     }
-
-    long sum_last = 0;
-    long sum_now = 0;
-    for (size_t i = 0; i < lh_size; i++) {
-        long load = load_history_[i];
-        if (i < lh_size / 2) {
-            sum_last += load;
-        } else if (i >= (lh_size + 1) / 2) {
-            if (load < kMinLoad) {
-                return false;
-            }
-            sum_now += load;
+    if (last_latency_ * 100 > target_latency_ * (100 + kHysteresis)
+        && queue > 0) {
+        shrink_streak_ = 0;
+        if (++grow_streak_ < kGrowStreak || nauto >= max_threads_) {
+            return 0;
         }
+        grow_streak_ = 0;
+        cooldown_ = kCooldown;
+        return 1;
     }
-    if (sum_last > sum_now) {
-        return false;
+    if (last_latency_ * 100 < target_latency_ * (100 - kHysteresis)
+        && utilization < kShrinkUtilization
+        && nauto > (size_t) nretiring_) {
+        grow_streak_ = 0;
+        if (++shrink_streak_ < kShrinkStreak) {
+            return 0;
+        }
+        shrink_streak_ = 0;
+        cooldown_ = kCooldown;
+        return -1;
     }
-    reserve_ = kMaxFeedback;
-    return true;
+    grow_streak_ = shrink_streak_ = 0;
+    return 0;
 }
 
 void
 Controller::check_thread()
 {
     while (true) {
-        usleep(kCheckAutoCreate * 1000);
-        if (check_auto_create()) {
-            LOG(INFO, "server loads high, auto-create a new thread.");
+        usleep(kCheckInterval * 1000);
+        int decision = check_latency();
+        if (decision > 0) {
+            nr_grows_++;
+            LOG(INFO, "%s stage latency %ldus above target %ldus, "
+                "auto-create a new thread.", stage_->name().c_str(),
+                last_latency_, target_latency_);
+            utils::Lock lk(mutex_);
             auto_threads_.insert(stage_->start_thread());
+        } else if (decision < 0) {
+            nr_shrinks_++;
+            LOG(INFO, "%s stage latency %ldus below target %ldus, "
+                "retire an auto-created thread.", stage_->name().c_str(),
+                last_latency_, target_latency_);
+            utils::atomic_add(&nretiring_, 1L);
         }
     }
 }
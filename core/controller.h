@@ -14,40 +14,110 @@ class Stage;
 
 /**
  * Controller is to control the thread pool size adaptively according to the
- * current stage load.
+ * current stage latency.  It can be attached to any stage which picks tasks
+ * from a scheduler with its own thread pool.
+ *
+ * Every check interval, it estimates the latency of the stage as queueing
+ * delay plus service time.  Service time is measured around process_task(),
+ * queueing delay is derived from the queue length and the throughput
+ * (Little's law).  Threads are added when the latency stays above the
+ * target, and auto-created threads are retired when the latency stays below
+ * the target while threads are mostly idle.  Retiring threads only exit
+ * between two tasks.
  */
 class Controller
 {
     utils::Mutex              mutex_;
     std::set<utils::ThreadId> auto_threads_;
 
-    std::vector<long> load_history_;
-    size_t            reserve_;
     Stage*            stage_;
-    long              current_load_;
-    long              current_speed_;
-    long              best_speed_;
-    size_t            best_threads_size_;
+    long              target_latency_;
+    size_t            max_threads_;
+
+    // measurement of current check interval
+    volatile long     ntasks_;
+    volatile long     service_time_;
+    u64               last_check_time_;
+
+    // decision state
+    int               grow_streak_;
+    int               shrink_streak_;
+    int               cooldown_;
+    volatile long     nretiring_;
+
+    // counters
+    long              nr_grows_;
+    long              nr_shrinks_;
+    long              last_latency_;
+    long              last_queue_delay_;
+    long              last_service_time_;
 public:
-    static int kMaxThreadIdle;
-    static int kCheckAutoCreate;
+    /**
+     * Auto-created threads exit after being idle for this time (in
+     * milliseconds).
+     */
+    static int    kMaxThreadIdle;
+    /**
+     * Interval of latency checks in milliseconds.
+     */
+    static int    kCheckInterval;
+    /**
+     * Default latency target in microseconds.
+     */
+    static long   kDefaultTargetLatency;
+    /**
+     * Default maximum number of auto-created threads.
+     */
+    static size_t kDefaultMaxThreads;
 
     Controller();
     virtual ~Controller() {}
 
     void set_stage(Stage* stage) { stage_ = stage; }
+    /**
+     * @param usec Latency target of the stage in microseconds.
+     */
+    void set_target_latency(long usec) { target_latency_ = usec; }
+    void set_max_threads(size_t max_threads) { max_threads_ = max_threads; }
+    long target_latency() const { return target_latency_; }
+
+    /**
+     * Start the checking thread.
+     */
+    void start();
 
     bool is_auto_created(utils::ThreadId id);
     bool is_auto_created();
     void exit_auto_thread(utils::ThreadId id);
     void exit_auto_thread();
 
-    void increase_load(long inc);
-    void decrease_load(long dec);
+    /**
+     * Record a processed task.  Called by Stage::execute_task().
+     * @param usec Service time in microseconds.
+     */
+    void record_task(long usec);
+    /**
+     * Called by stage threads between tasks.
+     * @return True if current thread is chosen to be retired, and it should
+     * exit.
+     */
+    bool should_retire();
+
+    /// counters
+    long   nr_grows() const { return nr_grows_; }
+    long   nr_shrinks() const { return nr_shrinks_; }
+    size_t nr_auto_threads();
+    /**
+     * Latency, queueing delay and service time of last check interval, in
+     * microseconds.
+     */
+    long   latency() const { return last_latency_; }
+    long   queue_delay() const { return last_queue_delay_; }
+    long   service_time() const { return last_service_time_; }
 
 private:
     void check_thread();
-    bool check_auto_create();
+    int  check_latency();
 };
 
 }
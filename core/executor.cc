@@ -0,0 +1,301 @@
+#include "pch.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "core/executor.h"
+#include "core/stages.h"
+#include "utils/logger.h"
+#include "utils/misc.h"
+#include "utils/epoch.h"
+
+namespace tube {
+
+static __thread long current_worker_ = -1;
+
+size_t Executor::kDefaultThreadPoolSize = 0;
+
+Executor::Executor()
+    : started_(false), next_worker_(0), npending_(0), nsleepers_(0),
+      nr_steals_(0)
+{
+}
+
+Executor::~Executor()
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        delete workers_[i];
+    }
+}
+
+void
+Executor::start()
+{
+    if (started_) {
+        return;
+    }
+    size_t nthreads = kDefaultThreadPoolSize;
+    if (nthreads == 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if ((long) nthreads <= 0) {
+            nthreads = 1;
+        }
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        workers_.push_back(new Worker());
+    }
+    started_ = true;
+    for (size_t i = 0; i < nthreads; i++) {
+        utils::create_thread(boost::bind(&Executor::worker_loop, this, i));
+    }
+    LOG(INFO, "executor started with %lu threads", nthreads);
+}
+
+void
+Executor::submit(const Task& task)
+{
+    assert(started_);
+    long idx = current_worker_;
+    if (idx < 0) {
+        idx = (utils::atomic_add(&next_worker_, 1L) - 1) % workers_.size();
+    }
+    Worker* worker = workers_[idx];
+    {
+        utils::Lock lk(worker->mutex);
+        worker->tasks.push_back(task);
+    }
+    utils::atomic_add(&npending_, 1L);
+    notify_workers(1);
+}
+
+void
+Executor::submit_batch(const std::vector<Task>& tasks)
+{
+    assert(started_);
+    if (tasks.empty()) {
+        return;
+    }
+    size_t nworkers = workers_.size();
+    size_t nchunks = current_worker_ < 0 ? nworkers : 1;
+    size_t chunk = (tasks.size() + nchunks - 1) / nchunks;
+    for (size_t begin = 0; begin < tasks.size(); begin += chunk) {
+        long idx = current_worker_;
+        if (idx < 0) {
+            idx = (utils::atomic_add(&next_worker_, 1L) - 1) % nworkers;
+        }
+        size_t end = std::min(begin + chunk, tasks.size());
+        Worker* worker = workers_[idx];
+        utils::Lock lk(worker->mutex);
+        worker->tasks.insert(worker->tasks.end(), tasks.begin() + begin,
+                             tasks.begin() + end);
+    }
+    utils::atomic_add(&npending_, (long) tasks.size());
+    notify_workers(tasks.size());
+}
+
+void
+Executor::notify_workers(size_t ntasks)
+{
+    long nsleepers = utils::atomic_load(&nsleepers_);
+    if (nsleepers > 0) {
+        utils::Lock lk(mutex_);
+        if (ntasks >= (size_t) nsleepers) {
+            cond_.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < ntasks; i++) {
+            cond_.notify_one();
+        }
+    }
+}
+
+bool
+Executor::pop_task(size_t idx, Task& task)
+{
+    Worker* worker = workers_[idx];
+    utils::Lock lk(worker->mutex);
+    if (worker->tasks.empty()) {
+        return false;
+    }
+    // owner takes the oldest task to keep requests in order
+    task = worker->tasks.front();
+    worker->tasks.pop_front();
+    return true;
+}
+
+bool
+Executor::steal_task(size_t idx, Task& task)
+{
+    size_t nworkers = workers_.size();
+    for (size_t i = 1; i < nworkers; i++) {
+        Worker* victim = workers_[(idx + i) % nworkers];
+        if (!victim->mutex.try_lock()) {
+            continue; // busy, try the next one
+        }
+        bool found = !victim->tasks.empty();
+        if (found) {
+            // thieves take the newest task, away from the owner
+            task = victim->tasks.back();
+            victim->tasks.pop_back();
+        }
+        victim->mutex.unlock();
+        if (found) {
+            utils::atomic_add(&nr_steals_, 1L);
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+Executor::wait_for_task()
+{
+    utils::Lock lk(mutex_);
+    utils::atomic_add(&nsleepers_, 1L);
+    if (utils::atomic_load(&npending_) == 0) {
+        utils::EpochManager::instance().offline();
+        cond_.wait(lk);
+        utils::EpochManager::instance().online();
+    }
+    utils::atomic_sub(&nsleepers_, 1L);
+}
+
+void
+Executor::worker_loop(size_t idx)
+{
+    utils::EpochThread epoch_thread;
+    current_worker_ = idx;
+    while (true) {
+        Task task;
+        if (pop_task(idx, task) || steal_task(idx, task)) {
+            utils::atomic_sub(&npending_, 1L);
+            task.sched->run_task(task);
+            utils::EpochManager::instance().quiescent();
+            continue;
+        }
+        wait_for_task();
+    }
+}
+
+static const u32 kStateQueued = 0x01;
+static const u32 kStateGenShift = 1;
+
+ExecutorScheduler::ExecutorScheduler(const std::string& stage,
+                                     bool suppress_connection_lock)
+    : Scheduler(), name_(stage), executor_(Executor::instance()),
+      states_(utils::get_fdmap_max_size(), 0), size_(0),
+      suppress_connection_lock_(suppress_connection_lock)
+{
+    // stage registers itself on pipeline before creating the scheduler
+    stage_ = Pipeline::instance().find_stage(stage);
+    assert(stage_ != NULL);
+}
+
+bool
+ExecutorScheduler::mark_queued(Connection* conn, Executor::Task& task)
+{
+    u32& state = states_[conn->fd()];
+    if (state & kStateQueued) {
+        return false; // already queued
+    }
+    state |= kStateQueued;
+    size_++;
+    task.sched = this;
+    task.conn = conn;
+    task.fd = conn->fd();
+    task.gen = state >> kStateGenShift;
+    return true;
+}
+
+void
+ExecutorScheduler::add_task(Connection* conn)
+{
+    Executor::Task task;
+    {
+        utils::Lock lk(mutex_);
+        if (!mark_queued(conn, task)) {
+            return;
+        }
+    }
+    executor_.submit(task);
+}
+
+void
+ExecutorScheduler::add_task_batch(const ConnectionList& conns)
+{
+    std::vector<Executor::Task> tasks;
+    tasks.reserve(conns.size());
+    {
+        utils::Lock lk(mutex_);
+        for (size_t i = 0; i < conns.size(); i++) {
+            Executor::Task task;
+            if (mark_queued(conns[i], task)) {
+                tasks.push_back(task);
+            }
+        }
+    }
+    executor_.submit_batch(tasks);
+}
+
+void
+ExecutorScheduler::remove_task(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    u32& state = states_[conn->fd()];
+    if (state & kStateQueued) {
+        // bump the generation, so the submitted task becomes stale
+        state = ((state >> kStateGenShift) + 1) << kStateGenShift;
+        size_--;
+    }
+}
+
+Connection*
+ExecutorScheduler::claim(const Executor::Task& task)
+{
+    utils::Lock lk(mutex_);
+    u32& state = states_[task.fd];
+    if (state != ((task.gen << kStateGenShift) | kStateQueued)) {
+        return NULL; // removed
+    }
+    if (!suppress_connection_lock_ && !task.conn->try_lock()) {
+        // owned by others, run it after the owner unlocks it and wakes us up
+        deferred_.push_back(task);
+        wait_for_unlock(task.conn);
+        if (!task.conn->try_lock()) {
+            return NULL;
+        }
+        // unlocked in between, the deferred task becomes stale
+    }
+    state = (task.gen + 1) << kStateGenShift;
+    size_--;
+    return task.conn;
+}
+
+void
+ExecutorScheduler::run_task(const Executor::Task& task)
+{
+    Connection* conn = claim(task);
+    // a task which does nothing is a futile wakeup of the worker
+    count_wakeup(conn == NULL);
+    if (conn) {
+        stage_->execute_task(conn);
+    }
+}
+
+void
+ExecutorScheduler::reschedule()
+{
+    std::vector<Executor::Task> tasks;
+    {
+        utils::Lock lk(mutex_);
+        if (deferred_.empty()) {
+            return;
+        }
+        tasks.swap(deferred_);
+    }
+    for (size_t i = 0; i < tasks.size(); i++) {
+        executor_.submit(tasks[i]);
+    }
+}
+
+}
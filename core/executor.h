@@ -0,0 +1,155 @@
+// -*- mode: c++ -*-
+
+#ifndef _EXECUTOR_H_
+#define _EXECUTOR_H_
+
+#include <deque>
+#include <vector>
+#include <string>
+
+#include "core/pipeline.h"
+#include "utils/lock.h"
+#include "utils/atomic.h"
+
+namespace tube {
+
+class Stage;
+class ExecutorScheduler;
+
+/**
+ * Executor is a thread pool shared by several stages.  Every worker thread
+ * owns a task deque, and steals tasks from other workers when its own deque
+ * is empty.  Therefore busy stages automatically borrow idle threads from
+ * other stages, without tuning thread pool size of each stage.
+ *
+ * The deques are std::deque protected by a mutex per worker, not lock-free
+ * deques.  A task blocking in a handler holds its worker away from every
+ * stage sharing the executor.
+ *
+ * Stages use the executor through ExecutorScheduler.
+ */
+class Executor : utils::Noncopyable
+{
+public:
+    struct Task {
+        ExecutorScheduler* sched;
+        Connection*        conn;
+        int                fd;
+        u32                gen;
+    };
+
+    static Executor& instance() {
+        // never destroyed, worker threads are still waiting on it at exit
+        static Executor* ins = new Executor();
+        return *ins;
+    }
+
+    /**
+     * Number of worker threads. 0 means number of CPU cores.
+     */
+    static size_t kDefaultThreadPoolSize;
+
+    /**
+     * Start worker threads.  Called by Pipeline::start_stages() if any stage
+     * is using the executor.
+     */
+    void   start();
+    bool   is_started() const { return started_; }
+    size_t thread_pool_size() const { return workers_.size(); }
+
+    /**
+     * Submit a task.  If called from a worker thread, the task goes to that
+     * worker's deque, otherwise the deques are chosen in round-robin manner.
+     */
+    void   submit(const Task& task);
+    /**
+     * Submit several tasks.  If called from a worker thread, they all go to
+     * that worker's deque, otherwise they are split into one chunk per
+     * worker.  Sleeping workers are woken up once for the whole batch.
+     */
+    void   submit_batch(const std::vector<Task>& tasks);
+    /**
+     * Number of tasks stolen from other workers since start.
+     */
+    long   nr_steals() const { return nr_steals_; }
+
+private:
+    struct Worker {
+        utils::Mutex     mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<Worker*> workers_;
+    bool                 started_;
+    volatile long        next_worker_;
+    volatile long        npending_;
+    volatile long        nsleepers_;
+    volatile long        nr_steals_;
+
+    utils::Mutex     mutex_;
+    utils::Condition cond_;
+
+    Executor();
+    ~Executor();
+
+    void worker_loop(size_t idx);
+    bool pop_task(size_t idx, Task& task);
+    bool steal_task(size_t idx, Task& task);
+    void wait_for_task();
+    void notify_workers(size_t ntasks);
+};
+
+/**
+ * Scheduler which submits connections to the shared Executor rather than
+ * keeping them for the stage's own thread pool.  It only keeps track of which
+ * connections are logically queued on the stage, so that remove_task() and
+ * size_nolock() behave like other schedulers.
+ *
+ * Stages using this scheduler don't start their own thread pools.
+ */
+class ExecutorScheduler : public Scheduler
+{
+    std::string   name_;
+    Stage*        stage_;
+    Executor&     executor_;
+
+    // per-fd state word: bit 0 is queued, the rest is the generation.
+    std::vector<u32> states_;
+    size_t           size_;
+
+    std::vector<Executor::Task> deferred_;
+
+    utils::Mutex mutex_;
+    bool         suppress_connection_lock_;
+public:
+    /**
+     * @param stage Name of the stage using this scheduler.
+     * @param suppress_connection_lock Don't lock the connection before
+     * running the task.
+     */
+    ExecutorScheduler(const std::string& stage,
+                      bool suppress_connection_lock = false);
+
+    virtual void        add_task(Connection* conn);
+    virtual void        add_task_batch(const ConnectionList& conns);
+    /**
+     * Executor scheduler doesn't have tasks to pick, always returns NULL.
+     */
+    virtual Connection* pick_task() { return NULL; }
+    virtual void        remove_task(Connection* conn);
+    virtual void        reschedule();
+    virtual size_t      size_nolock() { return size_; }
+    virtual bool        need_thread_pool() const { return false; }
+
+    /**
+     * Run a task on current worker thread.  Called by Executor.
+     */
+    void run_task(const Executor::Task& task);
+private:
+    bool        mark_queued(Connection* conn, Executor::Task& task);
+    Connection* claim(const Executor::Task& task);
+};
+
+}
+
+#endif /* _EXECUTOR_H_ */
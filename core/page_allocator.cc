@@ -0,0 +1,205 @@
+#include "pch.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include <sys/mman.h>
+
+#include "core/page_allocator.h"
+#include "utils/atomic.h"
+#include "utils/logger.h"
+
+namespace tube {
+
+size_t PageAllocator::kThreadCacheBytes = 256 << 10;
+
+size_t PageAllocator::kDepotBytes = 16 << 20;
+
+bool PageAllocator::kUseHugePages = false;
+
+static __thread void* page_cache_ = NULL;
+
+PageAllocator::PageAllocator()
+    : arena_ptr_(NULL), arena_left_(0), nr_system_allocs_(0),
+      nr_system_frees_(0), nr_depot_refills_(0), arena_bytes_(0),
+      huge_arena_bytes_(0)
+{
+    pthread_key_create(&key_, release_thread_cache);
+}
+
+int
+PageAllocator::size_class(size_t size)
+{
+    int cls = 0;
+    for (size_t sz = kMinPageSize; sz <= kMaxPageSize; sz <<= 1, cls++) {
+        if (sz == size) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+PageAllocator::ThreadCache*
+PageAllocator::thread_cache()
+{
+    ThreadCache* cache = (ThreadCache*) page_cache_;
+    if (cache == NULL) {
+        cache = new ThreadCache();
+        page_cache_ = cache;
+        // the key only releases the cache at thread exit, e.g. of threads
+        // retired by a Controller
+        pthread_setspecific(key_, cache);
+    }
+    return cache;
+}
+
+void
+PageAllocator::release_thread_cache(void* ptr)
+{
+    ThreadCache* cache = (ThreadCache*) ptr;
+    PageAllocator& allocator = instance();
+    for (int cls = 0; cls < kNumSizeClasses; cls++) {
+        PageList& pages = cache->pages[cls];
+        allocator.spill_pages(cls, pages, pages.size());
+    }
+    delete cache;
+    // pages freed later by this thread start a new cache
+    page_cache_ = NULL;
+}
+
+void
+PageAllocator::spill_pages(int cls, PageList& pages, size_t n)
+{
+    // the first n pages go to the depot, those beyond its limit are freed
+    size_t size = kMinPageSize << cls;
+    size_t nmoved = n;
+    {
+        Depot& depot = depots_[cls];
+        utils::Lock lk(depot.mutex);
+        size_t max_pages = kDepotBytes / size;
+        if (!kUseHugePages) {
+            nmoved = depot.pages.size() < max_pages
+                ? std::min(n, max_pages - depot.pages.size()) : 0;
+        }
+        depot.pages.insert(depot.pages.end(), pages.begin(),
+                           pages.begin() + nmoved);
+    }
+    for (size_t i = nmoved; i < n; i++) {
+        system_free(pages[i]);
+    }
+    pages.erase(pages.begin(), pages.begin() + n);
+}
+
+byte*
+PageAllocator::alloc_page(size_t size)
+{
+    int cls = size_class(size);
+    if (cls < 0) {
+        return (byte*) malloc(size);
+    }
+    PageList& pages = thread_cache()->pages[cls];
+    if (pages.empty()) {
+        Depot& depot = depots_[cls];
+        size_t limit = std::max(kThreadCacheBytes / size, (size_t) 2);
+        utils::Lock lk(depot.mutex);
+        size_t n = std::min(depot.pages.size(), limit / 2);
+        pages.insert(pages.end(), depot.pages.end() - n, depot.pages.end());
+        depot.pages.resize(depot.pages.size() - n);
+        if (n > 0) {
+            utils::atomic_add(&nr_depot_refills_, (long) n);
+        }
+    }
+    if (!pages.empty()) {
+        byte* page = pages.back();
+        pages.pop_back();
+        return page;
+    }
+    return system_alloc(size);
+}
+
+void
+PageAllocator::free_page(byte* page, size_t size)
+{
+    if (page == NULL) {
+        return;
+    }
+    int cls = size_class(size);
+    if (cls < 0) {
+        free(page);
+        return;
+    }
+    PageList& pages = thread_cache()->pages[cls];
+    size_t limit = std::max(kThreadCacheBytes / size, (size_t) 2);
+    if (pages.size() >= limit) {
+        // the older half
+        spill_pages(cls, pages, limit / 2);
+    }
+    pages.push_back(page);
+}
+
+size_t
+PageAllocator::nr_depot_pages(size_t size)
+{
+    int cls = size_class(size);
+    if (cls < 0) {
+        return 0;
+    }
+    utils::Lock lk(depots_[cls].mutex);
+    return depots_[cls].pages.size();
+}
+
+byte*
+PageAllocator::system_alloc(size_t size)
+{
+    utils::atomic_add(&nr_system_allocs_, 1L);
+    if (kUseHugePages) {
+        byte* page = arena_alloc(size);
+        if (page) {
+            return page;
+        }
+    }
+    return (byte*) malloc(size);
+}
+
+void
+PageAllocator::system_free(byte* page)
+{
+    // arena pages never get here, the depot keeps all of them
+    utils::atomic_add(&nr_system_frees_, 1L);
+    free(page);
+}
+
+byte*
+PageAllocator::arena_alloc(size_t size)
+{
+    utils::Lock lk(arena_mutex_);
+    if (arena_left_ < size) {
+        // the rest of the old arena is wasted, less than a page
+        void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        ptr = mmap(NULL, kArenaSize, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+#endif
+        if (ptr != MAP_FAILED) {
+            huge_arena_bytes_ += kArenaSize;
+        } else {
+            ptr = mmap(NULL, kArenaSize, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (ptr == MAP_FAILED) {
+                LOG(WARNING, "cannot map page arena, using malloc()");
+                return NULL;
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(ptr, kArenaSize, MADV_HUGEPAGE);
+#endif
+        }
+        arena_bytes_ += kArenaSize;
+        arena_ptr_ = (byte*) ptr;
+        arena_left_ = kArenaSize;
+    }
+    byte* page = arena_ptr_;
+    arena_ptr_ += size;
+    arena_left_ -= size;
+    return page;
+}
+
+}
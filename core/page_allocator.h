@@ -0,0 +1,132 @@
+// -*- mode: c++ -*-
+
+#ifndef _PAGE_ALLOCATOR_H_
+#define _PAGE_ALLOCATOR_H_
+
+#include <vector>
+#include <pthread.h>
+
+#include "utils/misc.h"
+#include "utils/lock.h"
+
+namespace tube {
+
+/**
+ * Allocator of Buffer pages.
+ *
+ * Pages come in size classes of powers of two from kMinPageSize to
+ * kMaxPageSize, e.g. small pages for headers and large ones for bulk bodies.
+ * Other sizes are passed to malloc() directly.
+ *
+ * Every thread keeps a cache of free pages of each class.  When it's full,
+ * half of it moves to a global depot of the class, and threads with empty
+ * caches refill from the depot, so pages allocated by one stage and freed by
+ * another travel in batches.  Only when the depot is empty or full pages are
+ * allocated from or returned to the system.  The cache of a thread goes to
+ * the depots when the thread exits.
+ *
+ * With huge pages enabled, pages are carved from arenas backed by huge pages
+ * if the system has them, transparent huge pages otherwise.  Arena pages are
+ * never returned to the system.
+ */
+class PageAllocator : utils::Noncopyable
+{
+public:
+    static const size_t kMinPageSize = 4 << 10;
+    static const size_t kMaxPageSize = 64 << 10;
+    static const int    kNumSizeClasses = 5;
+
+    /**
+     * Bytes of free pages cached by each thread for each class.
+     */
+    static size_t kThreadCacheBytes;
+    /**
+     * Bytes of free pages kept in the depot of each class.
+     */
+    static size_t kDepotBytes;
+    /**
+     * Whether pages are carved from huge page arenas.  Must be set before
+     * the first allocation.
+     */
+    static bool   kUseHugePages;
+    /**
+     * Size of each arena.
+     */
+    static const size_t kArenaSize = 2 << 20;
+
+    static PageAllocator& instance() {
+        // never destroyed, pages are still freed by threads at exit
+        static PageAllocator* ins = new PageAllocator();
+        return *ins;
+    }
+
+    byte* alloc_page(size_t size);
+    void  free_page(byte* page, size_t size);
+
+    /**
+     * Number of pages allocated from the system, by malloc() or carved from
+     * arenas.
+     */
+    long   nr_system_allocs() const { return nr_system_allocs_; }
+    /**
+     * Number of pages returned to the system.
+     */
+    long   nr_system_frees() const { return nr_system_frees_; }
+    /**
+     * Number of pages refilled from depots into thread caches.
+     */
+    long   nr_depot_refills() const { return nr_depot_refills_; }
+    /**
+     * Number of free pages in the depot of a size class.
+     */
+    size_t nr_depot_pages(size_t size);
+    /**
+     * Bytes of arenas mapped, and how many of them are backed by huge pages.
+     */
+    size_t arena_bytes() const { return arena_bytes_; }
+    size_t huge_arena_bytes() const { return huge_arena_bytes_; }
+
+    /**
+     * @return Index of the size class, or -1 if size isn't one.
+     */
+    static int size_class(size_t size);
+private:
+    typedef std::vector<byte*> PageList;
+
+    struct ThreadCache {
+        PageList pages[kNumSizeClasses];
+    };
+
+    struct Depot {
+        utils::Mutex mutex;
+        PageList     pages;
+    };
+
+    Depot         depots_[kNumSizeClasses];
+    pthread_key_t key_;
+
+    // arena pages are carved under arena_mutex_
+    utils::Mutex arena_mutex_;
+    byte*        arena_ptr_;
+    size_t       arena_left_;
+
+    volatile long nr_system_allocs_;
+    volatile long nr_system_frees_;
+    volatile long nr_depot_refills_;
+    size_t        arena_bytes_;
+    size_t        huge_arena_bytes_;
+
+    PageAllocator();
+
+    ThreadCache* thread_cache();
+    void  spill_pages(int cls, PageList& pages, size_t n);
+    byte* system_alloc(size_t size);
+    void  system_free(byte* page);
+    byte* arena_alloc(size_t size);
+
+    static void release_thread_cache(void* ptr);
+};
+
+}
+
+#endif /* _PAGE_ALLOCATOR_H_ */
@@ -2,19 +2,46 @@
 
 #include <ctime>
 #include <cassert>
+#include <algorithm>
 #include <unistd.h>
 #include <netinet/tcp.h>
 
 #include "core/pipeline.h"
 #include "core/stages.h"
+#include "core/executor.h"
 #include "utils/logger.h"
 #include "utils/misc.h"
+#include "utils/epoch.h"
 
 namespace tube {
 
 Connection::Connection(int sock)
-    : fd_(sock), timeout_(0), in_stream_(sock), out_stream_(sock),
-      last_active_(0), continuation_data_(NULL)
+    : fd_(sock), timeout_(0), shard_(0), priority_(kPriorityNormal),
+      in_stream_(sock), out_stream_(sock),
+      waiters_(0), last_active_(0), slow_until_(0), continuation_data_(NULL)
+{
+    timer_node_.ctx = this;
+    init_socket();
+}
+
+void
+Connection::reset(int sock)
+{
+    fd_ = sock;
+    timeout_ = 0;
+    shard_ = 0;
+    priority_ = kPriorityNormal;
+    in_stream_.reset(sock);
+    out_stream_.reset(sock);
+    waiters_ = 0;
+    last_active_ = 0;
+    slow_until_ = 0;
+    continuation_data_ = NULL;
+    init_socket();
+}
+
+void
+Connection::init_socket()
 {
     update_last_active();
     flags_ = kFlagCorkEnabled | kFlagActive;
@@ -23,12 +50,6 @@ Connection::Connection(int sock)
     setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &state, sizeof(state));
 }
 
-Timer::Unit
-Connection::timer_sched_time() const
-{
-    return last_active_ + Timer::timer_unit_from_time(timeout_);
-}
-
 bool
 Connection::update_last_active()
 {
@@ -50,24 +71,27 @@ Connection::active_close()
 void
 Connection::set_cork()
 {
-    if (!is_cork_enabled()) return;
+    if (!is_cork_enabled() || is_corked() || out_stream_.in_memory()) return;
 #ifdef __linux__
     int state = 1;
     if (setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &state, sizeof(state)) < 0) {
         LOG(WARNING, "Cannot set TCP_CORK on fd %d", fd_);
+        return;
     }
+    flags_ |= kFlagCorked;
 #endif
 }
 
 void
 Connection::clear_cork()
 {
-    if (!is_cork_enabled()) return;
+    if (!is_corked()) return;
 #ifdef __linux__
     int state = 0;
     if (setsockopt(fd_, IPPROTO_TCP, TCP_CORK, &state, sizeof(state)) < 0) {
         LOG(WARNING, "Cannot clear TCP_CORK on fd %d", fd_);
     }
+    flags_ &= ~kFlagCorked;
     // ::fsync(fd_);
 #endif
 }
@@ -117,6 +141,21 @@ Connection::unlock()
     owner_ = -1;
 #endif
     mutex_.unlock();
+    // pairs with the barrier in add_waiter(), either we see the waiter or
+    // the waiter sees the lock released
+    utils::memory_barrier();
+    if (waiters_ != 0) {
+        u32 waiters = utils::atomic_swap(&waiters_, 0U);
+        if (waiters != 0) {
+            SchedulerFactory::instance().wakeup_waiters(waiters, this);
+        }
+    }
+}
+
+void
+Connection::add_waiter(int id)
+{
+    utils::atomic_or(&waiters_, 1U << id);
 }
 
 std::string
@@ -126,7 +165,8 @@ Connection::address_string() const
 }
 
 Scheduler::Scheduler()
-    : controller_(NULL)
+    : controller_(NULL), waiter_id_(kBroadcastWaiterId), nr_wakeups_(0),
+      nr_futile_wakeups_(0)
 {
 }
 
@@ -134,19 +174,55 @@ Scheduler::~Scheduler()
 {
 }
 
+void
+Scheduler::add_task_batch(const ConnectionList& conns)
+{
+    for (size_t i = 0; i < conns.size(); i++) {
+        add_task(conns[i]);
+    }
+}
+
+void
+Scheduler::add_locked_task_batch(const ConnectionList& conns)
+{
+    add_task_batch(conns);
+    for (size_t i = 0; i < conns.size(); i++) {
+        conns[i]->unlock();
+    }
+}
+
+bool
+Scheduler::lock_or_wait(Connection* conn)
+{
+    if (conn->try_lock()) {
+        return true;
+    }
+    wait_for_unlock(conn);
+    // the owner might have unlocked it before seeing us
+    return conn->try_lock();
+}
+
+void
+Scheduler::count_wakeup(bool futile)
+{
+    utils::atomic_add(&nr_wakeups_, 1L);
+    if (futile) {
+        utils::atomic_add(&nr_futile_wakeups_, 1L);
+    }
+}
+
 size_t
-QueueScheduler::kMemoryPoolSize = 320 << 10;
+QueueScheduler::kMemoryPoolSize = 64 << 10;
 
 QueueScheduler::QueueScheduler(bool suppress_connection_lock)
-    : Scheduler(), pool_(kMemoryPoolSize), list_(pool_),
+    : Scheduler(), pool_(kMemoryPoolSize), list_(pool_), nwaiting_(0),
       suppress_connection_lock_(suppress_connection_lock)
 {
 }
 
-void
-QueueScheduler::add_task(Connection* conn)
+bool
+QueueScheduler::add_task_nolock(Connection* conn)
 {
-    utils::Lock lk(mutex_);
     NodeMap::iterator it = nodes_.find(conn->fd());
     if (it != nodes_.end()) {
         // already in the scheduler, put it on the top
@@ -154,12 +230,80 @@ QueueScheduler::add_task(Connection* conn)
         list_.push_front(conn);
         nodes_.erase(conn->fd());
         nodes_.insert(conn->fd(), list_.begin());
-        return;
+        return false;
+    }
+    if (conn->is_urgent()) {
+        nodes_.insert(conn->fd(), list_.push_front(conn));
+    } else {
+        nodes_.insert(conn->fd(), list_.push_back(conn));
     }
-    bool need_notify = (list_.size() == 0);
-    nodes_.insert(conn->fd(), list_.push_back(conn));
-    if (need_notify) {
+    return true;
+}
+
+void
+QueueScheduler::notify_nolock(size_t ntasks)
+{
+    // wake up one thread per new connection, at most all waiting threads
+    if (ntasks >= nwaiting_) {
         cond_.notify_all();
+        return;
+    }
+    for (size_t i = 0; i < ntasks; i++) {
+        cond_.notify_one();
+    }
+}
+
+void
+QueueScheduler::add_task(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    // one new connection needs only one thread
+    if (add_task_nolock(conn)) {
+        cond_.notify_one();
+    }
+}
+
+void
+QueueScheduler::add_task_batch(const ConnectionList& conns)
+{
+    size_t ntasks = 0;
+    utils::Lock lk(mutex_);
+    for (size_t i = 0; i < conns.size(); i++) {
+        if (add_task_nolock(conns[i])) {
+            ntasks++;
+        }
+    }
+    if (ntasks > 0) {
+        notify_nolock(ntasks);
+    }
+}
+
+void
+QueueScheduler::add_locked_task_batch(const ConnectionList& conns)
+{
+    if (suppress_connection_lock_) {
+        Scheduler::add_locked_task_batch(conns);
+        return;
+    }
+    ConnectionList queued;
+    {
+        size_t ntasks = 0;
+        utils::Lock lk(mutex_);
+        for (size_t i = 0; i < conns.size(); i++) {
+            if (add_task_nolock(conns[i])) {
+                handed_.insert(conns[i]->fd(), true);
+                ntasks++;
+            } else {
+                queued.push_back(conns[i]);
+            }
+        }
+        if (ntasks > 0) {
+            notify_nolock(ntasks);
+        }
+    }
+    // unlock() wakes up the waiting consumers, which takes mutex_
+    for (size_t i = 0; i < queued.size(); i++) {
+        queued[i]->unlock();
     }
 }
 
@@ -172,17 +316,30 @@ QueueScheduler::reschedule()
     }
 }
 
+void
+QueueScheduler::wakeup(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    cond_.notify_one();
+}
+
 bool
 QueueScheduler::auto_wait(utils::Lock& lk)
 {
+    utils::EpochManager& epoch = utils::EpochManager::instance();
+    nwaiting_++;
+    epoch.offline();
     if (controller_ && controller_->is_auto_created()) {
         if (!cond_.timed_wait(lk, Controller::kMaxThreadIdle)) {
+            nwaiting_--;
             controller_->exit_auto_thread();
             return false;
         }
     } else {
         cond_.wait(lk);
     }
+    epoch.online();
+    nwaiting_--;
     return true;
 }
 
@@ -190,10 +347,18 @@ Connection*
 QueueScheduler::pick_task_nolock_connection()
 {
     utils::Lock lk(mutex_);
+    bool woken = false;
     while (list_.empty()) {
+        if (woken) {
+            count_wakeup(true);
+        }
         if (!auto_wait(lk)) {
             return NULL;
         }
+        woken = true;
+    }
+    if (woken) {
+        count_wakeup(false);
     }
     Connection* conn = list_.front();
     list_.pop_front();
@@ -205,25 +370,28 @@ Connection*
 QueueScheduler::pick_task_lock_connection()
 {
     utils::Lock lk(mutex_);
-    while (list_.empty()) {
-        if (!auto_wait(lk)) {
-            return NULL;
-        }
-    }
+    bool woken = false;
 
 reschedule:
     Connection* conn = NULL;
     for (NodeList::iterator it = list_.begin(); it != list_.end(); ++it) {
         conn = *it;
-        if (conn->try_lock()) {
+        if (handed_.erase(conn->fd()) || lock_or_wait(conn)) {
             list_.erase(it);
             nodes_.erase(conn->fd());
+            if (woken) {
+                count_wakeup(false);
+            }
             return conn;
         }
     }
+    if (woken) {
+        count_wakeup(true);
+    }
     if (!auto_wait(lk)) {
         return NULL;
     }
+    woken = true;
     goto reschedule;
 }
 
@@ -247,6 +415,7 @@ QueueScheduler::remove_task(Connection* conn)
     }
     list_.erase(*it);
     nodes_.erase(conn->fd());
+    handed_.erase(conn->fd());
 }
 
 QueueScheduler::~QueueScheduler()
@@ -255,94 +424,1087 @@ QueueScheduler::~QueueScheduler()
     list_.clear();
 }
 
-Connection*
-ConnectionFactory::create_connection(int fd)
+size_t
+LockFreeScheduler::kRingSize = 64 << 10;
+
+static size_t
+round_up_power_of_two(size_t x)
 {
-    return new Connection(fd);
+    size_t res = 1;
+    while (res < x) {
+        res <<= 1;
+    }
+    return res;
+}
+
+LockFreeScheduler::LockFreeScheduler(bool suppress_connection_lock)
+    : Scheduler(), head_(0), tail_(0), waiters_(0), ndeferred_(0),
+      noverflow_(0), suppress_connection_lock_(suppress_connection_lock)
+{
+    size_t ring_size = round_up_power_of_two(kRingSize);
+    mask_ = ring_size - 1;
+    ring_ = new Slot[ring_size];
+    for (size_t i = 0; i < ring_size; i++) {
+        ring_[i].seq = i;
+    }
+    max_fd_ = utils::get_fdmap_max_size();
+    states_ = new u32[max_fd_];
+    memset((void*) states_, 0, sizeof(u32) * max_fd_);
+}
+
+LockFreeScheduler::~LockFreeScheduler()
+{
+    delete [] ring_;
+    delete [] states_;
+}
+
+bool
+LockFreeScheduler::enqueue(const Entry& entry)
+{
+    size_t pos = utils::atomic_load(&tail_);
+    Slot* slot = NULL;
+    while (true) {
+        slot = &ring_[pos & mask_];
+        long diff = (long) utils::atomic_load(&slot->seq) - (long) pos;
+        if (diff == 0) {
+            if (utils::atomic_cas(&tail_, pos, pos + 1))
+                break;
+            pos = utils::atomic_load(&tail_);
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = utils::atomic_load(&tail_);
+        }
+    }
+    slot->entry = entry;
+    utils::atomic_store(&slot->seq, pos + 1);
+    return true;
+}
+
+bool
+LockFreeScheduler::dequeue(Entry& entry)
+{
+    size_t pos = utils::atomic_load(&head_);
+    Slot* slot = NULL;
+    while (true) {
+        slot = &ring_[pos & mask_];
+        long diff = (long) utils::atomic_load(&slot->seq) - (long) (pos + 1);
+        if (diff == 0) {
+            if (utils::atomic_cas(&head_, pos, pos + 1))
+                break;
+            pos = utils::atomic_load(&head_);
+        } else if (diff < 0) {
+            return false; // empty
+        } else {
+            pos = utils::atomic_load(&head_);
+        }
+    }
+    entry = slot->entry;
+    utils::atomic_store(&slot->seq, pos + mask_ + 1);
+    return true;
 }
 
 void
-ConnectionFactory::destroy_connection(Connection* conn)
+LockFreeScheduler::notify_waiters(size_t ntasks)
 {
-    delete conn;
+    long nwaiting = utils::atomic_load(&waiters_);
+    if (nwaiting > 0) {
+        utils::Lock lk(mutex_);
+        if (ntasks >= (size_t) nwaiting) {
+            cond_.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < ntasks; i++) {
+            cond_.notify_one();
+        }
+    }
 }
 
-Pipeline::Pipeline()
+void
+LockFreeScheduler::push_entry(const Entry& entry, bool notify)
 {
-    factory_ = new ConnectionFactory();
+    if (!enqueue(entry)) {
+        // ring is full, keep it aside until a consumer drains it
+        utils::Lock lk(deferred_mutex_);
+        overflow_.push_back(entry);
+        utils::atomic_add(&noverflow_, 1L);
+    }
+    if (notify) {
+        notify_waiters();
+    }
 }
 
-Pipeline::~Pipeline()
+void
+LockFreeScheduler::drain_overflow()
 {
-    delete factory_;
+    EntryList entries;
+    {
+        utils::Lock lk(deferred_mutex_);
+        entries.swap(overflow_);
+        utils::atomic_store(&noverflow_, 0L);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        push_entry(entries[i]);
+    }
+}
+
+bool
+LockFreeScheduler::mark_queued(Connection* conn, Entry& entry)
+{
+    int fd = conn->fd();
+    assert((size_t) fd < max_fd_);
+    while (true) {
+        u32 state = utils::atomic_load(&states_[fd]);
+        if (state & kStateQueued) {
+            return false; // already in the scheduler
+        }
+        if (utils::atomic_cas(&states_[fd], state, state | kStateQueued)) {
+            entry.conn = conn;
+            entry.fd = fd;
+            entry.gen = state >> kStateGenShift;
+            entry.locked = false;
+            return true;
+        }
+    }
 }
 
 void
-Pipeline::set_connection_factory(ConnectionFactory* fac)
+LockFreeScheduler::add_task(Connection* conn)
 {
-    delete factory_;
-    factory_ = fac;
+    Entry entry;
+    if (mark_queued(conn, entry)) {
+        push_entry(entry);
+    }
 }
 
-Stage*
-Pipeline::find_stage(const std::string& name) const
+void
+LockFreeScheduler::add_task_batch(const ConnectionList& conns)
 {
-    StageMap::const_iterator it = map_.find(name);
-    if (it == map_.end()) {
-        return NULL;
-    } else {
-        return it->second;
+    size_t ntasks = 0;
+    for (size_t i = 0; i < conns.size(); i++) {
+        Entry entry;
+        if (mark_queued(conns[i], entry)) {
+            push_entry(entry, false);
+            ntasks++;
+        }
+    }
+    if (ntasks > 0) {
+        notify_waiters(ntasks);
     }
 }
 
 void
-Pipeline::initialize_stages()
+LockFreeScheduler::add_locked_task_batch(const ConnectionList& conns)
 {
-    for (StageMap::iterator it = map_.begin(); it != map_.end(); ++it) {
-        Stage* stage = it->second;
-        stage->initialize();
+    if (suppress_connection_lock_) {
+        Scheduler::add_locked_task_batch(conns);
+        return;
+    }
+    size_t ntasks = 0;
+    for (size_t i = 0; i < conns.size(); i++) {
+        Entry entry;
+        if (mark_queued(conns[i], entry)) {
+            entry.locked = true;
+            push_entry(entry, false);
+            ntasks++;
+        } else {
+            conns[i]->unlock(); // the queued entry locks it
+        }
+    }
+    if (ntasks > 0) {
+        notify_waiters(ntasks);
     }
 }
 
 void
-Pipeline::start_stages()
+LockFreeScheduler::remove_task(Connection* conn)
 {
-    for (StageMap::iterator it = map_.begin(); it != map_.end(); ++it) {
-        Stage* stage = it->second;
-        stage->start_thread_pool();
+    int fd = conn->fd();
+    assert((size_t) fd < max_fd_);
+    while (true) {
+        u32 state = utils::atomic_load(&states_[fd]);
+        if (state & kStateClaiming) {
+            // a consumer is trying to lock the connection, it'll be done
+            // shortly
+            utils::cpu_relax();
+            continue;
+        }
+        if (!(state & kStateQueued)) {
+            return;
+        }
+        // bump the generation so the entry in the ring becomes stale
+        u32 next = ((state >> kStateGenShift) + 1) << kStateGenShift;
+        if (utils::atomic_cas(&states_[fd], state, next)) {
+            return;
+        }
     }
 }
 
 Connection*
-Pipeline::create_connection(int fd)
+LockFreeScheduler::claim(const Entry& entry)
 {
-    return factory_->create_connection(fd);
+    volatile u32* state_ptr = &states_[entry.fd];
+    u32 live = (entry.gen << kStateGenShift) | kStateQueued;
+    u32 next = (entry.gen + 1) << kStateGenShift;
+
+    if (suppress_connection_lock_) {
+        if (utils::atomic_cas(state_ptr, live, next)) {
+            return entry.conn;
+        }
+        return NULL; // stale
+    }
+    if (entry.locked) {
+        // nobody else could remove it while the lock is ours
+        if (utils::atomic_cas(state_ptr, live, next)) {
+            return entry.conn;
+        }
+        entry.conn->unlock();
+        return NULL;
+    }
+
+    // mark it claiming so that remove_task() cannot dispose the connection
+    // while we are touching it
+    if (!utils::atomic_cas(state_ptr, live, live | kStateClaiming)) {
+        return NULL; // stale
+    }
+    if (entry.conn->try_lock()) {
+        utils::atomic_store(state_ptr, next);
+        return entry.conn;
+    }
+    // owned by others, defer it until the owner unlocks it and wakes us up.
+    // It's queued again before reschedule() can see the entry, which only
+    // takes entries exactly in that state.
+    wait_for_unlock(entry.conn);
+    utils::atomic_store(state_ptr, live);
+    {
+        utils::Lock lk(deferred_mutex_);
+        deferred_.push_back(entry);
+        utils::atomic_add(&ndeferred_, 1L);
+    }
+    // the owner might have unlocked it before the entry was deferred
+    if (entry.conn->try_lock()) {
+        if (utils::atomic_cas(state_ptr, live, next)) {
+            return entry.conn; // the deferred entry becomes stale
+        }
+        entry.conn->unlock();
+    }
+    return NULL;
 }
 
 bool
-Pipeline::dispose_connection(Connection* conn)
+LockFreeScheduler::wait_for_task(bool& woken)
+{
+    utils::Lock lk(mutex_);
+    bool res = true;
+    utils::atomic_add(&waiters_, 1L);
+    if (utils::atomic_load(&head_) == utils::atomic_load(&tail_)
+        && utils::atomic_load(&noverflow_) == 0) {
+        utils::EpochManager& epoch = utils::EpochManager::instance();
+        woken = true;
+        epoch.offline();
+        if (controller_ && controller_->is_auto_created()) {
+            if (!cond_.timed_wait(lk, Controller::kMaxThreadIdle)) {
+                controller_->exit_auto_thread();
+                res = false;
+            }
+        } else {
+            cond_.wait(lk);
+        }
+        epoch.online();
+    }
+    utils::atomic_sub(&waiters_, 1L);
+    return res;
+}
+
+Connection*
+LockFreeScheduler::pick_task()
 {
-    LOG(DEBUG, "disposing connection %d %p", conn->fd(), conn);
-    StageMap::iterator it = map_.begin();
-    Stage* stage = NULL;
+    bool woken = false;
+    while (true) {
+        Entry entry;
+        while (dequeue(entry)) {
+            Connection* conn = claim(entry);
+            if (conn) {
+                if (woken) {
+                    count_wakeup(false);
+                }
+                return conn;
+            }
+        }
+        if (utils::atomic_load(&noverflow_) > 0) {
+            drain_overflow();
+            continue;
+        }
+        if (woken) {
+            count_wakeup(true);
+            woken = false;
+        }
+        if (!wait_for_task(woken)) {
+            return NULL;
+        }
+    }
+}
 
-    if (!conn->try_lock()) {
-        return false;
+void
+LockFreeScheduler::reschedule()
+{
+    if (suppress_connection_lock_ || utils::atomic_load(&ndeferred_) == 0) {
+        return;
     }
-    while (it != map_.end()) {
-        stage = it->second;
-        if (stage && stage != poll_in_stage_) {
-            stage->sched_remove(conn);
+    EntryList entries;
+    {
+        utils::Lock lk(deferred_mutex_);
+        entries.swap(deferred_);
+        utils::atomic_store(&ndeferred_, 0L);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        const Entry& entry = entries[i];
+        u32 live = (entry.gen << kStateGenShift) | kStateQueued;
+        if (utils::atomic_load(&states_[entry.fd]) == live) {
+            push_entry(entry);
         }
-        ++it;
     }
-    ::close(conn->fd());
-    conn->unlock();
-    factory_->destroy_connection(conn);
-    LOG(DEBUG, "disposed");
+}
+
+size_t
+LockFreeScheduler::size_nolock()
+{
+    return (tail_ - head_) + ndeferred_ + noverflow_;
+}
+
+size_t
+PriorityScheduler::kMaxAge = 64;
+
+PriorityScheduler::PriorityScheduler(bool suppress_connection_lock)
+    : Scheduler(), picks_(0), size_(0), nwaiting_(0),
+      suppress_connection_lock_(suppress_connection_lock)
+{
+    for (int i = 0; i < Connection::kNumPriorities; i++) {
+        pools_[i] = new MemoryPool(QueueScheduler::kMemoryPoolSize);
+        lists_[i] = new NodeList(*pools_[i]);
+    }
+}
+
+PriorityScheduler::~PriorityScheduler()
+{
+    for (int i = 0; i < Connection::kNumPriorities; i++) {
+        delete lists_[i];
+        delete pools_[i];
+    }
+}
+
+void
+PriorityScheduler::erase_nolock(int fd)
+{
+    NodeMap::iterator it = nodes_.find(fd);
+    if (it == nodes_.end()) {
+        return;
+    }
+    lists_[it->level]->erase(it->it);
+    nodes_.erase(fd);
+    size_--;
+}
+
+bool
+PriorityScheduler::add_task_nolock(Connection* conn)
+{
+    int level = conn->priority();
+    if (level < 0 || level >= Connection::kNumPriorities) {
+        level = Connection::kPriorityNormal;
+    }
+    NodeMap::iterator it = nodes_.find(conn->fd());
+    if (it != nodes_.end()) {
+        if (it->level == level) {
+            return false; // already in the scheduler
+        }
+        // priority changed, keep its age but move it
+        Entry entry = *(it->it);
+        lists_[it->level]->erase(it->it);
+        nodes_.erase(conn->fd());
+        nodes_.insert(conn->fd(), Position(level,
+                                           lists_[level]->push_back(entry)));
+        return false;
+    }
+    Entry entry;
+    entry.conn = conn;
+    entry.seq = picks_;
+    nodes_.insert(conn->fd(), Position(level, lists_[level]->push_back(entry)));
+    size_++;
     return true;
 }
 
+void
+PriorityScheduler::notify_nolock(size_t ntasks)
+{
+    if (ntasks >= nwaiting_) {
+        cond_.notify_all();
+        return;
+    }
+    for (size_t i = 0; i < ntasks; i++) {
+        cond_.notify_one();
+    }
+}
+
+void
+PriorityScheduler::add_task(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    if (add_task_nolock(conn)) {
+        cond_.notify_one();
+    }
+}
+
+void
+PriorityScheduler::add_task_batch(const ConnectionList& conns)
+{
+    size_t ntasks = 0;
+    utils::Lock lk(mutex_);
+    for (size_t i = 0; i < conns.size(); i++) {
+        if (add_task_nolock(conns[i])) {
+            ntasks++;
+        }
+    }
+    if (ntasks > 0) {
+        notify_nolock(ntasks);
+    }
+}
+
+void
+PriorityScheduler::remove_task(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    erase_nolock(conn->fd());
+}
+
+void
+PriorityScheduler::reschedule()
+{
+    if (!suppress_connection_lock_) {
+        utils::Lock lk(mutex_);
+        cond_.notify_all();
+    }
+}
+
+void
+PriorityScheduler::wakeup(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    cond_.notify_one();
+}
+
+bool
+PriorityScheduler::auto_wait(utils::Lock& lk)
+{
+    utils::EpochManager& epoch = utils::EpochManager::instance();
+    nwaiting_++;
+    epoch.offline();
+    if (controller_ && controller_->is_auto_created()) {
+        if (!cond_.timed_wait(lk, Controller::kMaxThreadIdle)) {
+            nwaiting_--;
+            controller_->exit_auto_thread();
+            return false;
+        }
+    } else {
+        cond_.wait(lk);
+    }
+    epoch.online();
+    nwaiting_--;
+    return true;
+}
+
+bool
+PriorityScheduler::is_aged(int level)
+{
+    NodeList* list = lists_[level];
+    return !list->empty() && picks_ - list->front().seq >= kMaxAge;
+}
+
+Connection*
+PriorityScheduler::pick_from_level(int level)
+{
+    NodeList* list = lists_[level];
+    for (NodeList::iterator it = list->begin(); it != list->end(); ++it) {
+        Connection* conn = (*it).conn;
+        if (suppress_connection_lock_ || lock_or_wait(conn)) {
+            list->erase(it);
+            nodes_.erase(conn->fd());
+            size_--;
+            picks_++;
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+Connection*
+PriorityScheduler::pick_nolock()
+{
+    Connection* conn = NULL;
+    // aged connections first, the lowest level is the most likely starving
+    for (int i = Connection::kNumPriorities - 1; i > 0; i--) {
+        if (is_aged(i) && (conn = pick_from_level(i))) {
+            return conn;
+        }
+    }
+    for (int i = 0; i < Connection::kNumPriorities; i++) {
+        if ((conn = pick_from_level(i))) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+Connection*
+PriorityScheduler::pick_task()
+{
+    utils::Lock lk(mutex_);
+    bool woken = false;
+    while (true) {
+        Connection* conn = pick_nolock();
+        if (woken) {
+            count_wakeup(conn == NULL);
+        }
+        if (conn) {
+            return conn;
+        }
+        if (!auto_wait(lk)) {
+            return NULL;
+        }
+        woken = true;
+    }
+}
+
+ShardedScheduler::ShardedScheduler(const std::string& stage, size_t nshards,
+                                   bool suppress_connection_lock)
+    : Scheduler()
+{
+    SchedulerFactory& factory = SchedulerFactory::instance();
+    for (size_t i = 0; i < nshards; i++) {
+        scheds_.push_back(factory.create_shard_scheduler(
+                              stage, suppress_connection_lock));
+    }
+}
+
+ShardedScheduler::~ShardedScheduler()
+{
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        delete scheds_[i];
+    }
+}
+
+Scheduler*
+ShardedScheduler::shard_scheduler(int shard) const
+{
+    if (shard < 0 || (size_t) shard >= scheds_.size()) {
+        return scheds_[0];
+    }
+    return scheds_[shard];
+}
+
+void
+ShardedScheduler::add_task(Connection* conn)
+{
+    shard_scheduler(conn->shard())->add_task(conn);
+}
+
+void
+ShardedScheduler::split_batch(const ConnectionList& conns,
+                              std::vector<ConnectionList>& batches) const
+{
+    batches.resize(scheds_.size());
+    for (size_t i = 0; i < conns.size(); i++) {
+        int shard = conns[i]->shard();
+        if (shard < 0 || (size_t) shard >= scheds_.size()) {
+            shard = 0;
+        }
+        batches[shard].push_back(conns[i]);
+    }
+}
+
+void
+ShardedScheduler::add_task_batch(const ConnectionList& conns)
+{
+    std::vector<ConnectionList> batches;
+    split_batch(conns, batches);
+    for (size_t i = 0; i < batches.size(); i++) {
+        if (!batches[i].empty()) {
+            scheds_[i]->add_task_batch(batches[i]);
+        }
+    }
+}
+
+void
+ShardedScheduler::add_locked_task_batch(const ConnectionList& conns)
+{
+    std::vector<ConnectionList> batches;
+    split_batch(conns, batches);
+    for (size_t i = 0; i < batches.size(); i++) {
+        if (!batches[i].empty()) {
+            scheds_[i]->add_locked_task_batch(batches[i]);
+        }
+    }
+}
+
+Connection*
+ShardedScheduler::pick_task()
+{
+    return shard_scheduler(Pipeline::current_shard())->pick_task();
+}
+
+void
+ShardedScheduler::remove_task(Connection* conn)
+{
+    shard_scheduler(conn->shard())->remove_task(conn);
+}
+
+void
+ShardedScheduler::reschedule()
+{
+    int shard = Pipeline::current_shard();
+    if (shard >= 0) {
+        // connections never cross shards, only our shard could be waiting
+        shard_scheduler(shard)->reschedule();
+        return;
+    }
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        scheds_[i]->reschedule();
+    }
+}
+
+size_t
+ShardedScheduler::size_nolock()
+{
+    size_t size = 0;
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        size += scheds_[i]->size_nolock();
+    }
+    return size;
+}
+
+void
+ShardedScheduler::set_controller(Controller* controller)
+{
+    Scheduler::set_controller(controller);
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        scheds_[i]->set_controller(controller);
+    }
+}
+
+void
+ShardedScheduler::wakeup(Connection* conn)
+{
+    shard_scheduler(conn->shard())->wakeup(conn);
+}
+
+void
+ShardedScheduler::set_waiter_id(int id)
+{
+    // a connection is only waited by the scheduler of its own shard, so the
+    // shards can share one waiter id
+    Scheduler::set_waiter_id(id);
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        scheds_[i]->set_waiter_id(id);
+    }
+}
+
+long
+ShardedScheduler::nr_wakeups() const
+{
+    long res = 0;
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        res += scheds_[i]->nr_wakeups();
+    }
+    return res;
+}
+
+long
+ShardedScheduler::nr_futile_wakeups() const
+{
+    long res = 0;
+    for (size_t i = 0; i < scheds_.size(); i++) {
+        res += scheds_[i]->nr_futile_wakeups();
+    }
+    return res;
+}
+
+bool
+SchedulerFactory::is_valid_type(const std::string& type)
+{
+    return type == "queue" || type == "lockfree" || type == "priority"
+        || type == "executor";
+}
+
+bool
+SchedulerFactory::set_stage_scheduler(const std::string& stage,
+                                      const std::string& type)
+{
+    if (!is_valid_type(type)) {
+        return false;
+    }
+    types_[stage] = type;
+    return true;
+}
+
+std::string
+SchedulerFactory::stage_scheduler(const std::string& stage) const
+{
+    TypeMap::const_iterator it = types_.find(stage);
+    if (it == types_.end()) {
+        return "queue";
+    }
+    return it->second;
+}
+
+Scheduler*
+SchedulerFactory::create_scheduler(const std::string& stage,
+                                   bool suppress_connection_lock)
+{
+    size_t nshards = Pipeline::instance().shard_count();
+    Scheduler* sched = NULL;
+    if (nshards > 1 && stage_scheduler(stage) != "executor") {
+        sched = new ShardedScheduler(stage, nshards, suppress_connection_lock);
+    } else {
+        sched = create_shard_scheduler(stage, suppress_connection_lock);
+    }
+    register_waiter(sched);
+    return sched;
+}
+
+Scheduler*
+SchedulerFactory::create_shard_scheduler(const std::string& stage,
+                                         bool suppress_connection_lock)
+{
+    std::string type = stage_scheduler(stage);
+    LOG(DEBUG, "using %s scheduler for %s stage", type.c_str(), stage.c_str());
+    if (type == "lockfree") {
+        return new LockFreeScheduler(suppress_connection_lock);
+    } else if (type == "priority") {
+        return new PriorityScheduler(suppress_connection_lock);
+    } else if (type == "executor") {
+        return new ExecutorScheduler(stage, suppress_connection_lock);
+    }
+    return new QueueScheduler(suppress_connection_lock);
+}
+
+void
+SchedulerFactory::register_waiter(Scheduler* sched)
+{
+    if (waiters_.size() > (size_t) Scheduler::kMaxWaiterId) {
+        LOG(WARNING, "too many schedulers, fallback to wake up all stages");
+        sched->set_waiter_id(Scheduler::kBroadcastWaiterId);
+        return;
+    }
+    sched->set_waiter_id(waiters_.size());
+    waiters_.push_back(sched);
+}
+
+void
+SchedulerFactory::wakeup_waiters(u32 waiters, Connection* conn)
+{
+    if (waiters & (1U << Scheduler::kBroadcastWaiterId)) {
+        Pipeline::instance().reschedule_all();
+        waiters &= ~(1U << Scheduler::kBroadcastWaiterId);
+    }
+    for (int id = 0; waiters != 0; id++, waiters >>= 1) {
+        if (waiters & 1) {
+            waiters_[id]->wakeup(conn);
+        }
+    }
+}
+
+Connection*
+ConnectionFactory::create_connection(int fd)
+{
+    return new Connection(fd);
+}
+
+void
+ConnectionFactory::destroy_connection(Connection* conn)
+{
+    delete conn;
+}
+
+size_t
+PooledConnectionFactory::kDefaultPoolSize = 1024;
+
+size_t
+PooledConnectionFactory::kThreadCacheSize = 32;
+
+static __thread void* connection_cache_ = NULL;
+
+PooledConnectionFactory::PooledConnectionFactory()
+    : pool_size_(kDefaultPoolSize), nr_hits_(0), nr_misses_(0)
+{
+}
+
+PooledConnectionFactory::~PooledConnectionFactory()
+{
+    // thread caches are leaked, their threads might still be running
+    for (size_t i = 0; i < free_list_.size(); i++) {
+        delete free_list_[i];
+    }
+}
+
+PooledConnectionFactory::ThreadCache*
+PooledConnectionFactory::thread_cache()
+{
+    ThreadCache* cache = (ThreadCache*) connection_cache_;
+    if (cache == NULL) {
+        cache = new ThreadCache();
+        cache->owner = this;
+        cache->conns.reserve(kThreadCacheSize);
+        connection_cache_ = cache;
+    }
+    // only one factory caches connections on each thread
+    return cache->owner == this ? cache : NULL;
+}
+
+Connection*
+PooledConnectionFactory::create_connection(int fd)
+{
+    ThreadCache* cache = pool_size_ > 0 ? thread_cache() : NULL;
+    if (cache && cache->conns.empty()) {
+        utils::Lock lk(mutex_);
+        size_t n = std::min(free_list_.size(), kThreadCacheSize / 2 + 1);
+        cache->conns.insert(cache->conns.end(), free_list_.end() - n,
+                            free_list_.end());
+        free_list_.resize(free_list_.size() - n);
+    }
+    if (cache && !cache->conns.empty()) {
+        Connection* conn = cache->conns.back();
+        cache->conns.pop_back();
+        conn->reset(fd);
+        utils::atomic_add(&nr_hits_, 1L);
+        return conn;
+    }
+    utils::atomic_add(&nr_misses_, 1L);
+    return allocate_connection(fd);
+}
+
+void
+PooledConnectionFactory::destroy_connection(Connection* conn)
+{
+    ThreadCache* cache = pool_size_ > 0 ? thread_cache() : NULL;
+    if (cache == NULL) {
+        delete conn;
+        return;
+    }
+    if (cache->conns.size() >= kThreadCacheSize) {
+        // move the older half to the global list, the rest is freed
+        size_t n = std::min(cache->conns.size(), kThreadCacheSize / 2 + 1);
+        size_t nmoved = 0;
+        {
+            utils::Lock lk(mutex_);
+            size_t room = free_list_.size() < pool_size_
+                ? pool_size_ - free_list_.size() : 0;
+            nmoved = std::min(n, room);
+            free_list_.insert(free_list_.end(), cache->conns.begin(),
+                              cache->conns.begin() + nmoved);
+        }
+        for (size_t i = nmoved; i < n; i++) {
+            delete cache->conns[i];
+        }
+        cache->conns.erase(cache->conns.begin(), cache->conns.begin() + n);
+    }
+    cache->conns.push_back(conn);
+}
+
+static __thread int current_shard_ = -1;
+
+int
+Pipeline::kReclaimInterval = 10;
+
+Pipeline::Pipeline()
+    : shard_count_(1), nreclaiming_(0), reclaimer_started_(false)
+{
+    factory_ = new ConnectionFactory();
+}
+
+Pipeline::~Pipeline()
+{
+    delete factory_;
+}
+
+void
+Pipeline::set_connection_factory(ConnectionFactory* fac)
+{
+    delete factory_;
+    factory_ = fac;
+}
+
+void
+Pipeline::set_shard_count(size_t count)
+{
+    if (count == 0) {
+        count = 1;
+    }
+    shard_count_ = count;
+}
+
+int
+Pipeline::current_shard()
+{
+    return current_shard_;
+}
+
+void
+Pipeline::set_current_shard(int shard)
+{
+    current_shard_ = shard;
+}
+
+Stage*
+Pipeline::find_stage(const std::string& name) const
+{
+    StageMap::const_iterator it = map_.find(name);
+    if (it == map_.end()) {
+        return NULL;
+    } else {
+        return it->second;
+    }
+}
+
+void
+Pipeline::initialize_stages()
+{
+    for (StageMap::iterator it = map_.begin(); it != map_.end(); ++it) {
+        Stage* stage = it->second;
+        stage->initialize();
+    }
+}
+
+void
+Pipeline::start_stages()
+{
+    for (StageMap::iterator it = map_.begin(); it != map_.end(); ++it) {
+        Stage* stage = it->second;
+        stage->start_thread_pool();
+    }
+    if (is_executor_used()) {
+        Executor::instance().start();
+    }
+    start_reclaimer();
+}
+
+bool
+Pipeline::is_executor_used() const
+{
+    for (StageMap::const_iterator it = map_.begin(); it != map_.end(); ++it) {
+        Scheduler* sched = it->second->scheduler();
+        if (sched && !sched->need_thread_pool()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Connection*
+Pipeline::create_connection(int fd)
+{
+    return factory_->create_connection(fd);
+}
+
+void
+Pipeline::retire_connections(std::list<Connection*>& conns)
+{
+    utils::Lock lk(retire_mutex_);
+    retiring_.insert(retiring_.end(), conns.begin(), conns.end());
+    conns.clear();
+}
+
+size_t
+Pipeline::nr_retired_connections()
+{
+    utils::Lock lk(retire_mutex_);
+    return retiring_.size() + nreclaiming_;
+}
+
+void
+Pipeline::start_reclaimer()
+{
+    if (reclaimer_started_) {
+        return;
+    }
+    reclaimer_started_ = true;
+    utils::create_thread(boost::bind(&Pipeline::reclaim_loop, this));
+}
+
+void
+Pipeline::reclaim_loop()
+{
+    while (true) {
+        usleep(kReclaimInterval * 1000);
+        reclaim_connections();
+    }
+}
+
+bool
+Pipeline::unlink_connection(Connection* conn)
+{
+    // locked means some stage is still processing it, or it's handed over
+    // to the write back stage
+    if (!conn->try_lock()) {
+        return false;
+    }
+    for (StageMap::iterator it = map_.begin(); it != map_.end(); ++it) {
+        Stage* stage = it->second;
+        if (stage && stage != poll_in_stage_) {
+            stage->sched_remove(conn);
+        }
+    }
+    conn->unlock();
+    return true;
+}
+
+void
+Pipeline::reclaim_connections()
+{
+    utils::EpochManager& epoch = utils::EpochManager::instance();
+    std::vector<Connection*> pending;
+    {
+        utils::Lock lk(retire_mutex_);
+        pending.swap(retiring_);
+    }
+    pending.insert(pending.end(), unlinking_.begin(), unlinking_.end());
+    unlinking_.clear();
+
+    // step 1: remove them from every stage
+    std::vector<Connection*> unlinked;
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (unlink_connection(pending[i])) {
+            unlinked.push_back(pending[i]);
+        } else {
+            unlinking_.push_back(pending[i]);
+        }
+    }
+    if (!unlinked.empty()) {
+        u64 retire_epoch = epoch.retire_epoch();
+        for (size_t i = 0; i < unlinked.size(); i++) {
+            RetiredConnection retired;
+            retired.conn = unlinked[i];
+            retired.epoch = retire_epoch;
+            limbo_.push_back(retired);
+        }
+    }
+
+    // step 2: destroy those no stage thread can be touching any more
+    u64 safe_epoch = epoch.safe_epoch();
+    size_t ndestroyed = 0;
+    while (ndestroyed < limbo_.size()
+           && limbo_[ndestroyed].epoch < safe_epoch) {
+        Connection* conn = limbo_[ndestroyed].conn;
+        LOG(DEBUG, "disposing connection %d %p", conn->fd(), conn);
+        // the file descriptor is only reused after nobody writes to it
+        ::close(conn->fd());
+        factory_->destroy_connection(conn);
+        ndestroyed++;
+    }
+    limbo_.erase(limbo_.begin(), limbo_.begin() + ndestroyed);
+
+    utils::Lock lk(retire_mutex_);
+    nreclaiming_ = unlinking_.size() + limbo_.size();
+}
+
 void
 Pipeline::add_stage(const std::string& name, Stage* stage)
 {
@@ -357,7 +1519,7 @@ Pipeline::add_stage(const std::string& name, Stage* stage)
 void
 Pipeline::disable_poll(Connection* conn)
 {
-    poll_in_stage_->sched_remove(conn);
+    poll_in_stage_->disable_poll(conn);
     // utils::set_socket_blocking(conn->fd(), true);
 }
 
@@ -366,7 +1528,7 @@ Pipeline::enable_poll(Connection* conn)
 {
     // utils::set_socket_blocking(conn->fd(), false);
     if (conn->is_active()) {
-        poll_in_stage_->sched_add(conn);
+        poll_in_stage_->enable_poll(conn);
     }
 }
 
@@ -10,11 +10,13 @@
 #include <list>
 #include <set>
 #include <map>
+#include <vector>
 
 #include "utils/fdmap.h"
 #include "utils/misc.h"
 #include "utils/lock.h"
 #include "utils/list.h"
+#include "utils/atomic.h"
 #include "core/stream.h"
 #include "core/inet_address.h"
 #include "core/timer.h"
@@ -46,6 +48,18 @@ public:
         kFlagActive           = 0x02,
         kFlagCloseAfterFinish = 0x04,
         kFlagUrgent           = 0x08,
+        kFlagCorked           = 0x10,
+        kFlagDraining         = 0x20,
+    };
+
+    /**
+     * Priority levels used by PriorityScheduler, smaller is more urgent.
+     */
+    enum Priority {
+        kPriorityUrgent = 0,
+        kPriorityNormal = 1,
+        kPriorityBulk   = 2,
+        kNumPriorities  = 3,
     };
 
     /**
@@ -54,6 +68,14 @@ public:
     Connection(int sock);
     virtual ~Connection() {}
 
+    /**
+     * Reinitialize a disposed connection for a new client socket, as if it's
+     * newly constructed.  Used by PooledConnectionFactory.  Subclasses
+     * should reset their own state and call this.
+     * @param sock The client socket.
+     */
+    virtual void reset(int sock);
+
     PollerSpecData poller_spec() const { return poller_spec_; }
 
     /**
@@ -68,6 +90,10 @@ public:
      * @return True if client enabled tcp cork control
      */
     bool is_cork_enabled() const { return (flags_ & kFlagCorkEnabled) != 0; }
+    /**
+     * @return True if TCP_CORK is set on the socket.
+     */
+    bool is_corked() const { return (flags_ & kFlagCorked) != 0; }
     /**
      * @return True if client is not closed
      * @see set_cork(), clear_cok()
@@ -86,18 +112,44 @@ public:
     bool is_urgent() const {
         return (flags_ & kFlagUrgent) != 0;
     }
+    /**
+     * @return True if the handler is suspended until the output stream
+     * drains.
+     * @see Response::suspend_until_drained()
+     */
+    bool is_draining() const {
+        return (flags_ & kFlagDraining) != 0;
+    }
+    /**
+     * @return Priority level of the connection.  Urgent connections are
+     * always on kPriorityUrgent.
+     */
+    int priority() const {
+        return is_urgent() ? (int) kPriorityUrgent : priority_;
+    }
+    /**
+     * @return The pipeline shard this connection belongs to.
+     */
+    int shard() const { return shard_; }
 
     /**
      * Set an internet address.  Usually performed after a accept()
      * @param addr The internet address object
      */
     void set_address(const InternetAddress& addr) { address_ = addr; }
+    /**
+     * Bind the connection to a pipeline shard.  Under sharded mode, the
+     * connection will only be processed by threads of this shard.
+     * @param shard The shard index.
+     */
+    void set_shard(int shard) { shard_ = shard; }
     /**
      * Connection will be closed after being idle for a long time.  Usually
      * for 10-30 seconds.
      * @param sec Maximum idle timeout
      */
     void set_idle_timeout(int sec) { timeout_ = sec; }
+    int  idle_timeout() const { return timeout_; }
     /**
      * The maximum blocking time when doing blocking operating like write()
      * is being called.
@@ -146,6 +198,26 @@ public:
             flags_ &= ~kFlagUrgent;
         }
     }
+    /**
+     * @param val If true, the write back stage resumes the continuation once
+     * the output stream drains, rather than when it's done.
+     */
+    void set_draining(bool val) {
+        if (val) {
+            flags_ |= kFlagDraining;
+        } else {
+            flags_ &= ~kFlagDraining;
+        }
+    }
+    /**
+     * Set the priority level, which takes effect next time the connection is
+     * added to a scheduler.
+     * @param level One of the Priority levels.
+     */
+    void set_priority(int level) {
+        priority_ = level;
+        set_urgent(level == kPriorityUrgent);
+    }
 
     // timer related
     /**
@@ -153,16 +225,22 @@ public:
      */
     Timer::Unit last_active_time() const { return last_active_; }
     /**
-     * @return Timestamp for which timer routine (e.g. close the idle
-     * connection) will be executed.
+     * Timer node for the idle timeout, scheduled on the timer of the poller
+     * currently watching the connection.
      */
-    Timer::Unit timer_sched_time() const;
+    TimerNode&  timer_node() { return timer_node_; }
     /**
      * Update the last active time timestamp.
      * @return True if overwrite original timestamp, false means the original
      * timestamp is later or equal the current time.
      */
     bool        update_last_active();
+    /**
+     * Time in milliseconds until which the client is considered slow in
+     * receiving data, see Timer::current_msec().
+     */
+    u64         slow_until() const { return slow_until_; }
+    void        set_slow_until(u64 msec) { slow_until_ = msec; }
 
     // lock related
     /**
@@ -175,20 +253,31 @@ public:
      */
     void lock();
     /**
-     * Unlock the connection lock.
+     * Unlock the connection lock.  Schedulers waiting for this connection are
+     * woken up.
      */
     void unlock();
+    /**
+     * Register a scheduler as waiting for this connection to be unlocked.
+     * @param id Waiter id of the scheduler.
+     * @see Scheduler::lock_or_wait()
+     */
+    void add_waiter(int id);
 
     /**
      * Set TCP Cork, all data that write() to client socket will be buffer until
      * exceeds a complete network frame.
      *
      * This is used for reducing the fragment packets and increasing the TCP
-     * thoughputs.
+     * thoughputs.  Only needed when the output stream has a file to send,
+     * data in memory is written in gathered writes anyway, with MSG_MORE in
+     * front of a file.  So it does nothing unless the stream has a file, or
+     * if the socket is corked already.
      */
     void set_cork();
     /**
      * Clear TCP Cork and flush all data that previously has buffered by OS.
+     * Does nothing if the socket isn't corked.
      * @see set_cork()
      */
     void clear_cork();
@@ -229,6 +318,8 @@ protected:
 
     int       fd_;
     int       timeout_;
+    int       shard_;
+    int       priority_;
 
     InternetAddress address_;
 
@@ -239,11 +330,17 @@ protected:
     // locks
     utils::Mutex mutex_;
     long         owner_;
+    // bitmap of waiter id of schedulers waiting for the lock
+    volatile u32 waiters_;
 
     int         flags_;
     Timer::Unit last_active_;
+    TimerNode   timer_node_;
+    u64         slow_until_;
 
     void*       continuation_data_;
+private:
+    void init_socket();
 };
 
 class Controller;
@@ -262,8 +359,20 @@ class Controller;
 class Scheduler : utils::Noncopyable
 {
 protected:
-    Controller* controller_;
+    Controller*   controller_;
+    int           waiter_id_;
+    volatile long nr_wakeups_;
+    volatile long nr_futile_wakeups_;
 public:
+    /**
+     * Largest waiter id.  Schedulers beyond this share a waiter id which
+     * wakes every stage up.
+     */
+    static const int kMaxWaiterId = 30;
+    static const int kBroadcastWaiterId = 31;
+
+    typedef std::vector<Connection*> ConnectionList;
+
     Scheduler();
     virtual ~Scheduler();
 
@@ -271,6 +380,19 @@ public:
      * Add a connection to the scheduler for scheduling.
      */
     virtual void add_task(Connection* conn)     = 0;
+    /**
+     * Add several connections at once.  Implementations take their lock once
+     * and wake up threads once for the whole batch.  Default implementation
+     * calls add_task() for each connection.
+     */
+    virtual void add_task_batch(const ConnectionList& conns);
+    /**
+     * Add several connections locked by the caller, their locks are handed
+     * over to the threads picking them.  Connections already in the
+     * scheduler are unlocked.  Default implementation calls add_task_batch()
+     * then unlocks all of them.
+     */
+    virtual void add_locked_task_batch(const ConnectionList& conns);
     /**
      * Pick a connection and remove it from schduler.
      */
@@ -289,9 +411,48 @@ public:
      * This method is not thread-safe
      */
     virtual size_t size_nolock()                = 0;
+    /**
+     * @return True if the stage needs its own thread pool to pick tasks from
+     * this scheduler.
+     */
+    virtual bool need_thread_pool() const { return true; }
 
-    void set_controller(Controller* controller) { controller_ = controller; }
+    /**
+     * Called when a connection this scheduler is waiting for is unlocked.
+     * Default implementation calls reschedule().
+     */
+    virtual void wakeup(Connection* conn) { reschedule(); }
+
+    virtual void set_controller(Controller* controller) {
+        controller_ = controller;
+    }
     Controller* controller() const { return controller_; }
+
+    virtual void set_waiter_id(int id) { waiter_id_ = id; }
+    int          waiter_id() const { return waiter_id_; }
+
+    /**
+     * Number of times threads of this scheduler are woken up.
+     */
+    virtual long nr_wakeups() const { return nr_wakeups_; }
+    /**
+     * Number of wakeups which found nothing to pick.
+     */
+    virtual long nr_futile_wakeups() const { return nr_futile_wakeups_; }
+protected:
+    /**
+     * Try lock the connection.  If it's owned by others, register this
+     * scheduler on the connection, so that wakeup() is called once the owner
+     * unlocks it.
+     * @return True if the connection is locked.
+     */
+    bool lock_or_wait(Connection* conn);
+    /**
+     * Register this scheduler on the connection, so that wakeup() is called
+     * once the connection is unlocked.
+     */
+    void wait_for_unlock(Connection* conn) { conn->add_waiter(waiter_id_); }
+    void count_wakeup(bool futile);
 };
 
 /**
@@ -314,14 +475,16 @@ protected:
     MemoryPool pool_;
     NodeList  list_;
     NodeMap   nodes_;
+    utils::FDMap<bool> handed_; // locked by add_locked_task_batch()
 
     utils::Mutex      mutex_;
     utils::Condition  cond_;
+    size_t            nwaiting_;
 
     bool      suppress_connection_lock_;
 public:
     /**
-     * Default memory pool size for link list
+     * Chunk size of the memory pool for link list, it grows by chunks.
      */
     static size_t kMemoryPoolSize;
 
@@ -334,6 +497,8 @@ public:
     ~QueueScheduler();
 
     virtual void        add_task(Connection* conn);
+    virtual void        add_task_batch(const ConnectionList& conns);
+    virtual void        add_locked_task_batch(const ConnectionList& conns);
     /**
      * Pick a connection and remove it from scheduler.  When
      * suppress_connection_lock is set this routine will not lock the
@@ -345,13 +510,288 @@ public:
     virtual void        remove_task(Connection* conn);
     virtual void        reschedule();
     virtual size_t      size_nolock() { return list_.size(); }
+    /**
+     * Wake up only one thread, which rescans the whole list.
+     */
+    virtual void        wakeup(Connection* conn);
 private:
+    bool        add_task_nolock(Connection* conn);
+    void        notify_nolock(size_t ntasks);
     Connection* pick_task_nolock_connection();
     Connection* pick_task_lock_connection();
 
     bool auto_wait(utils::Lock& lk);
 };
 
+/**
+ * A scheduler implementation using a bounded lock-free multi-producer
+ * multi-consumer ring.  Adding and picking a connection never takes the
+ * scheduler-wide mutex, the mutex is only used for sleeping when the ring is
+ * empty.
+ *
+ * Connections that cannot be locked during pick_task() (already owned by
+ * other stages) are moved into a deferred list instead of being rescanned, and
+ * put back into the ring once the owner unlocks them.  Therefore pick_task()
+ * uses constant time even under contention.
+ *
+ * Unlike QueueScheduler, adding a connection which is already in the scheduler
+ * will not move it to the front.
+ */
+class LockFreeScheduler : public Scheduler
+{
+    struct Entry {
+        Connection* conn;
+        int         fd;
+        u32         gen;
+        bool        locked; // the lock is handed over with the entry
+    };
+
+    struct Slot {
+        volatile size_t seq;
+        Entry           entry;
+    };
+
+    typedef std::vector<Entry> EntryList;
+
+    // per-fd state word: bit 0 is queued, bit 1 is claiming, the rest is the
+    // generation which invalidates stale ring entries.
+    static const u32 kStateQueued = 0x01;
+    static const u32 kStateClaiming = 0x02;
+    static const u32 kStateGenShift = 2;
+
+    Slot*         ring_;
+    size_t        mask_;
+    volatile u32* states_;
+    size_t        max_fd_;
+
+    char            pad0_[CACHE_LINE_SIZE];
+    volatile size_t head_;
+    char            pad1_[CACHE_LINE_SIZE];
+    volatile size_t tail_;
+    char            pad2_[CACHE_LINE_SIZE];
+
+    volatile long waiters_;
+    volatile long ndeferred_;
+    volatile long noverflow_;
+
+    utils::Mutex     deferred_mutex_;
+    EntryList        deferred_;
+    EntryList        overflow_;
+
+    utils::Mutex     mutex_;
+    utils::Condition cond_;
+
+    bool suppress_connection_lock_;
+public:
+    /**
+     * Default number of slots in the ring.  Rounded up to power of two.
+     */
+    static size_t kRingSize;
+
+    /**
+     * @param suppress_connection_lock Option to tell scheduler don't lock
+     * the connection when pick_task().
+     */
+    LockFreeScheduler(bool suppress_connection_lock = false);
+    ~LockFreeScheduler();
+
+    virtual void        add_task(Connection* conn);
+    virtual void        add_task_batch(const ConnectionList& conns);
+    virtual void        add_locked_task_batch(const ConnectionList& conns);
+    virtual Connection* pick_task();
+    virtual void        remove_task(Connection* conn);
+    virtual void        reschedule();
+    virtual size_t      size_nolock();
+private:
+    bool enqueue(const Entry& entry);
+    bool dequeue(Entry& entry);
+    bool mark_queued(Connection* conn, Entry& entry);
+    void push_entry(const Entry& entry, bool notify = true);
+    void notify_waiters(size_t ntasks = 1);
+    void drain_overflow();
+
+    Connection* claim(const Entry& entry);
+    bool wait_for_task(bool& woken);
+};
+
+/**
+ * A scheduler with one queue per priority level.  Connections are picked from
+ * the most urgent non-empty level, so urgent requests (e.g. health checks)
+ * don't wait behind bulk transfers.
+ *
+ * To protect lower levels from starvation, a connection which has waited for
+ * more than kMaxAge picks is aged: it is picked before any other level.
+ */
+class PriorityScheduler : public Scheduler
+{
+    typedef utils::MemoryPool<utils::NoThreadSafePool> MemoryPool;
+
+    struct Entry {
+        Connection* conn;
+        u64         seq; // value of picks_ when added
+    };
+
+    typedef utils::List<Entry> NodeList;
+
+    struct Position {
+        int                level;
+        NodeList::iterator it;
+
+        Position(int l, NodeList::iterator i) : level(l), it(i) {}
+    };
+
+    typedef utils::FDMap<Position> NodeMap;
+
+    MemoryPool* pools_[Connection::kNumPriorities];
+    NodeList*   lists_[Connection::kNumPriorities];
+    NodeMap     nodes_;
+    u64         picks_;
+    size_t      size_;
+
+    utils::Mutex      mutex_;
+    utils::Condition  cond_;
+    size_t            nwaiting_;
+
+    bool      suppress_connection_lock_;
+public:
+    /**
+     * Number of picks after which a waiting connection is aged.
+     */
+    static size_t kMaxAge;
+
+    /**
+     * @param suppress_connection_lock Option to tell scheduler don't lock
+     * the connection when pick_task().
+     */
+    PriorityScheduler(bool suppress_connection_lock = false);
+    ~PriorityScheduler();
+
+    /**
+     * Add the connection to the level of Connection::priority().  If it's
+     * already in the scheduler on another level, it's moved.
+     */
+    virtual void        add_task(Connection* conn);
+    virtual void        add_task_batch(const ConnectionList& conns);
+    virtual Connection* pick_task();
+    virtual void        remove_task(Connection* conn);
+    virtual void        reschedule();
+    virtual size_t      size_nolock() { return size_; }
+    virtual void        wakeup(Connection* conn);
+private:
+    bool        is_aged(int level);
+    Connection* pick_from_level(int level);
+    Connection* pick_nolock();
+    void        erase_nolock(int fd);
+    bool        add_task_nolock(Connection* conn);
+    void        notify_nolock(size_t ntasks);
+    bool        auto_wait(utils::Lock& lk);
+};
+
+/**
+ * Creates the scheduler of each stage.  Stages ask the factory for their
+ * scheduler at construction time, so the scheduler type of a stage must be
+ * set before the stage is constructed, usually when loading the static
+ * configuration.
+ *
+ * Supported types are "queue" (QueueScheduler, the default), "lockfree"
+ * (LockFreeScheduler), "priority" (PriorityScheduler) and "executor"
+ * (ExecutorScheduler).
+ */
+class ShardedScheduler;
+
+class SchedulerFactory : utils::Noncopyable
+{
+    typedef std::map<std::string, std::string> TypeMap;
+    TypeMap types_;
+
+    std::vector<Scheduler*> waiters_;
+
+    SchedulerFactory() {}
+    ~SchedulerFactory() {}
+public:
+    static SchedulerFactory& instance() {
+        static SchedulerFactory fac;
+        return fac;
+    }
+
+    static bool is_valid_type(const std::string& type);
+
+    /**
+     * Set the scheduler type of a stage.
+     * @return False if the type is not supported.
+     */
+    bool        set_stage_scheduler(const std::string& stage,
+                                    const std::string& type);
+    std::string stage_scheduler(const std::string& stage) const;
+
+    /**
+     * Create the scheduler for a stage according to its configured type.
+     * Under sharded mode, a ShardedScheduler is created, except for the
+     * "executor" type, which is shared by all shards.
+     */
+    Scheduler*  create_scheduler(const std::string& stage,
+                                 bool suppress_connection_lock = false);
+    /**
+     * Create the scheduler for a single shard of a stage.
+     */
+    Scheduler*  create_shard_scheduler(const std::string& stage,
+                                       bool suppress_connection_lock = false);
+
+    /**
+     * Assign a waiter id to the scheduler, so it can wait for a connection
+     * lock.  Schedulers created by create_scheduler() are registered
+     * automatically.
+     */
+    void        register_waiter(Scheduler* sched);
+    /**
+     * Wake up the schedulers in the waiter bitmap.
+     */
+    void        wakeup_waiters(u32 waiters, Connection* conn);
+};
+
+/**
+ * Scheduler used under sharded mode.  It holds an independent scheduler for
+ * every shard.  Connections are added to the scheduler of their own shard, and
+ * threads only pick connections from the scheduler of the shard they are
+ * bound to, so a connection never migrates across shards.
+ */
+class ShardedScheduler : public Scheduler
+{
+    std::vector<Scheduler*> scheds_;
+public:
+    /**
+     * @param stage Name of the stage, used for creating the scheduler of each
+     * shard.
+     * @param nshards Number of shards.
+     */
+    ShardedScheduler(const std::string& stage, size_t nshards,
+                     bool suppress_connection_lock = false);
+    ~ShardedScheduler();
+
+    virtual void        add_task(Connection* conn);
+    /**
+     * Split the batch by shard, each shard scheduler gets one batch.
+     */
+    virtual void        add_task_batch(const ConnectionList& conns);
+    virtual void        add_locked_task_batch(const ConnectionList& conns);
+    virtual Connection* pick_task();
+    virtual void        remove_task(Connection* conn);
+    virtual void        reschedule();
+    virtual size_t      size_nolock();
+    virtual void        set_controller(Controller* controller);
+    /**
+     * Only wakes up the scheduler of the connection's shard.
+     */
+    virtual void        wakeup(Connection* conn);
+    virtual void        set_waiter_id(int id);
+    virtual long        nr_wakeups() const;
+    virtual long        nr_futile_wakeups() const;
+private:
+    Scheduler* shard_scheduler(int shard) const;
+    void split_batch(const ConnectionList& conns,
+                     std::vector<ConnectionList>& batches) const;
+};
+
 class Stage;
 class PollInStage;
 
@@ -367,16 +807,89 @@ class PollInStage;
 class ConnectionFactory
 {
 public:
+    virtual ~ConnectionFactory() {}
+
     virtual Connection* create_connection(int fd);
     virtual void        destroy_connection(Connection* conn);
 };
 
+/**
+ * Connection factory which recycles disposed connection objects rather than
+ * freeing them, so accepting and closing connections doesn't reach malloc.
+ * Recycled connections are reinitialized by Connection::reset(), which keeps
+ * the pages of their buffers.
+ *
+ * Every thread keeps a small cache of free connections.  When it's full,
+ * half of it moves to a global list shared by all threads, and threads with
+ * empty caches refill from the global list.  Connections are disposed by
+ * the pipeline's reclaiming thread but created by accepting threads, so they
+ * travel through the global list in batches.
+ */
+class PooledConnectionFactory : public ConnectionFactory
+{
+    typedef std::vector<Connection*> ConnectionList;
+
+    struct ThreadCache {
+        PooledConnectionFactory* owner;
+        ConnectionList           conns;
+    };
+
+    utils::Mutex   mutex_;
+    ConnectionList free_list_;
+    size_t         pool_size_;
+
+    volatile long  nr_hits_;
+    volatile long  nr_misses_;
+public:
+    /**
+     * Default maximum number of free connections in the global list.  0
+     * disables pooling.
+     */
+    static size_t kDefaultPoolSize;
+    /**
+     * Maximum number of free connections cached by each thread.
+     */
+    static size_t kThreadCacheSize;
+
+    PooledConnectionFactory();
+    virtual ~PooledConnectionFactory();
+
+    virtual Connection* create_connection(int fd);
+    virtual void        destroy_connection(Connection* conn);
+
+    void   set_pool_size(size_t size) { pool_size_ = size; }
+    size_t pool_size() const { return pool_size_; }
+
+    /**
+     * Number of connections created from recycled objects.
+     */
+    long   nr_hits() const { return nr_hits_; }
+    /**
+     * Number of connections newly allocated.
+     */
+    long   nr_misses() const { return nr_misses_; }
+protected:
+    /**
+     * Allocate a new connection object when the pool is empty.
+     */
+    virtual Connection* allocate_connection(int fd) {
+        return new Connection(fd);
+    }
+private:
+    ThreadCache* thread_cache();
+};
+
 /**
  * Global pipeline control object.
  *
  * It is designed as a singleton object that create, controls, configure the
- * connection objects and stages.  It has as read-write lock which can be used
- * for implementing resource recycle.
+ * connection objects and stages.
+ *
+ * Closed connections are reclaimed by a background thread in two steps.
+ * First they are removed from every stage, once nobody holds their lock.
+ * Then they are destroyed after every stage thread has passed a quiescent
+ * point (see utils::EpochManager), so that threads still touching them,
+ * e.g. right after unlocking them, never see freed memory.
  */
 class Pipeline : utils::Noncopyable
 {
@@ -386,11 +899,29 @@ class Pipeline : utils::Noncopyable
     PollInStage*       poll_in_stage_;
     Stage*             write_back_stage_;
     ConnectionFactory* factory_;
+    size_t             shard_count_;
+
+    struct RetiredConnection {
+        Connection* conn;
+        u64         epoch;
+    };
+
+    utils::Mutex                   retire_mutex_;
+    std::vector<Connection*>       retiring_;
+    std::vector<Connection*>       unlinking_;
+    std::vector<RetiredConnection> limbo_;
+    size_t                         nreclaiming_; // unlinking_ + limbo_
+    bool                           reclaimer_started_;
 
     Pipeline();
     ~Pipeline();
 
 public:
+    /**
+     * Interval of the reclaiming thread in milliseconds.
+     */
+    static int kReclaimInterval;
+
     /**
      * Get the singleton instance.
      */
@@ -407,6 +938,26 @@ public:
     PollInStage*    poll_in_stage() const { return poll_in_stage_; }
     Stage*          write_back_stage() const { return write_back_stage_; }
 
+    /**
+     * Number of pipeline shards.  One means the pipeline is not sharded.
+     */
+    size_t          shard_count() const { return shard_count_; }
+    bool            is_sharded() const { return shard_count_ > 1; }
+    /**
+     * Set the number of shards.  Should be called before any stage is
+     * constructed.
+     */
+    void            set_shard_count(size_t count);
+    /**
+     * @return The shard current thread is bound to.  -1 if current thread
+     * doesn't belong to any shard.
+     */
+    static int      current_shard();
+    /**
+     * Bind current thread to a shard.
+     */
+    static void     set_current_shard(int shard);
+
     /**
      * Register a stage.  This routine is automaticall called when Stage
      * is contructed.
@@ -430,6 +981,10 @@ public:
      * server initialization.
      */
     void            start_stages();
+    /**
+     * @return True if any stage submits its tasks to the shared Executor.
+     */
+    bool            is_executor_used() const;
 
     /**
      * Create the connection.
@@ -437,9 +992,14 @@ public:
      */
     Connection* create_connection(int fd);
     /**
-     * Dispose the connection and recycle the resouces.
+     * Hand closed connections over to the reclaiming thread, which disposes
+     * them and recycles the resources.  The list is cleared.
      */
-    bool        dispose_connection(Connection* conn);
+    void        retire_connections(std::list<Connection*>& conns);
+    /**
+     * Number of connections retired but not destroyed yet.
+     */
+    size_t      nr_retired_connections();
 
     /**
      * Disable IO poll for a specific connection on PollInStage.
@@ -451,11 +1011,16 @@ public:
     void enable_poll(Connection* conn);
 
     /**
-     * Notify every stage to reschedule.  This method is called sometimes when
-     * some connection is unlocked, so that the starving scheduler is able to
-     * continue scheduling.
+     * Notify every stage to reschedule.  Connection::unlock() only wakes up
+     * the schedulers waiting for it, this is the fallback for schedulers
+     * without their own waiter id.
      */
     void reschedule_all();
+private:
+    void start_reclaimer();
+    void reclaim_loop();
+    void reclaim_connections();
+    bool unlink_connection(Connection* conn);
 };
 
 }
@@ -1,10 +1,17 @@
 #include "pch.h"
 
 #include "config.h"
+#include "utils/atomic.h"
+#include "utils/exception.h"
+#include "utils/logger.h"
 #include "core/poller.h"
+#include "core/stream.h"
 
 namespace tube {
 
+volatile long
+Poller::nr_control_calls_ = 0;
+
 Poller::Poller()
 {
 }
@@ -38,10 +45,23 @@ Poller::remove_fd_set(int fd)
     return fds_.erase(fd);
 }
 
+ssize_t
+Poller::read_input(int fd, InputStream& in)
+{
+    return in.read_into_buffer();
+}
+
+ssize_t
+Poller::write_output(int fd, OutputStream& out)
+{
+    return out.write_into_output();
+}
+
 bool
 Poller::add_fd(int fd, Connection* conn, PollerEvent evt)
 {
     if (add_fd_set(fd, conn)) {
+        utils::atomic_add(&nr_control_calls_, 1L);
         if (!poll_add_fd(fd, conn, evt)) {
             remove_fd_set(fd);
             goto failed;
@@ -56,6 +76,7 @@ bool
 Poller::change_fd(int fd, Connection* conn, PollerEvent evt)
 {
     if (has_fd(fd)) {
+        utils::atomic_add(&nr_control_calls_, 1L);
         if (!poll_change_fd(fd, conn, evt)) {
             remove_fd_set(fd);
             goto failed;
@@ -71,6 +92,7 @@ Poller::remove_fd(int fd)
 {
     Connection* conn = find_connection(fd);
     if (conn) {
+        utils::atomic_add(&nr_control_calls_, 1L);
         remove_fd_set(fd);
         if (!poll_remove_fd(fd)) {
             add_fd_set(fd, conn);
@@ -88,14 +110,35 @@ PollerFactory::register_poller(const char* name, CreateFunc create_func)
     poller_map_.insert(std::make_pair(std::string(name), create_func));
 }
 
+bool
+PollerFactory::has_poller(const std::string& name) const
+{
+    return poller_map_.find(name) != poller_map_.end();
+}
+
 Poller*
 PollerFactory::create_poller(const std::string& name)
 {
+    std::string default_name = default_poller_name();
     PollerMap::iterator it = poller_map_.find(name);
     if (it == poller_map_.end() || !(it->second)) {
-        return NULL;
+        if (name == default_name) {
+            return NULL;
+        }
+        LOG(WARNING, "unknown poller %s, use %s instead", name.c_str(),
+            default_name.c_str());
+        return create_poller(default_name);
+    }
+    if (name == default_name) {
+        return it->second();
+    }
+    try {
+        return it->second();
+    } catch (const utils::SyscallException& ex) {
+        LOG(WARNING, "%s poller is not supported (%s), use %s instead",
+            name.c_str(), ex.what(), default_name.c_str());
+        return create_poller(default_name);
     }
-    return it->second();
 }
 
 void
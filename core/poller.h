@@ -14,6 +14,8 @@
 namespace tube {
 
 class Connection;
+class InputStream;
+class OutputStream;
 
 typedef unsigned short PollerEvent;
 
@@ -21,6 +23,11 @@ static const PollerEvent kPollerEventRead  = 1;
 static const PollerEvent kPollerEventWrite = 2;
 static const PollerEvent kPollerEventError = 4;
 static const PollerEvent kPollerEventHup   = 8;
+/**
+ * Registration flag rather than an event.  The fd is disarmed after one event
+ * is reported, and re-armed with change_fd(), while staying registered.
+ */
+static const PollerEvent kPollerEventOneShot = 16;
 
 class Poller : public utils::Noncopyable
 {
@@ -55,6 +62,32 @@ public:
     bool change_fd(int fd, Connection* conn, PollerEvent evt);
     bool remove_fd(int fd);
 
+    /**
+     * Read what the fd has received into the stream, on the poller's thread.
+     * By default it's InputStream::read_into_buffer().  Pollers doing the IO
+     * themselves hand over the data they have received.
+     * @return Number of bytes read, 0 on EOF, -1 on error or EAGAIN.
+     */
+    virtual ssize_t read_input(int fd, InputStream& in);
+    /**
+     * Write the stream to the fd, on the poller's thread.  By default it's
+     * OutputStream::write_into_output().  Pollers doing the IO themselves
+     * submit the write and fail with EAGAIN, then report a write event
+     * once it's done, and the next call returns how much was written.
+     */
+    virtual ssize_t write_output(int fd, OutputStream& out);
+    /**
+     * @return True if a write submitted by write_output() is in flight, the
+     * stream mustn't be written by anyone else meanwhile.
+     */
+    virtual bool    is_writing(int fd) { return false; }
+
+    /**
+     * Number of add_fd(), change_fd() and remove_fd() calls on all pollers,
+     * i.e. control system calls such as epoll_ctl().
+     */
+    static long nr_control_calls() { return nr_control_calls_; }
+
     Timer& timer() { return timer_; }
     ExpiredConnectionList& expired_connections() { return expired_conns_; }
 protected:
@@ -66,6 +99,8 @@ protected:
 private:
     Timer          timer_;
     FDMap          fds_;
+
+    static volatile long nr_control_calls_;
 protected:
     bool add_fd_set(int fd, Connection* conn);
     bool remove_fd_set(int fd);
@@ -85,7 +120,12 @@ public:
 
     std::string default_poller_name() const;
     void        register_poller(const char* name, CreateFunc create_func);
+    bool        has_poller(const std::string& name) const;
 
+    /**
+     * Create a poller.  Falls back to the default poller if the named one
+     * isn't available, e.g. not supported by the running kernel.
+     */
     Poller* create_poller(const std::string& name);
     void    destroy_poller(Poller* poller);
 private:
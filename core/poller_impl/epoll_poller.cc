@@ -12,6 +12,7 @@
 
 #include "utils/exception.h"
 #include "utils/logger.h"
+#include "utils/epoch.h"
 #include "core/poller.h"
 
 namespace tube {
@@ -54,6 +55,7 @@ build_epoll_event(PollerEvent evt)
     if (evt & kPollerEventWrite) res |= EPOLLOUT;
     if (evt & kPollerEventError) res |= EPOLLERR;
     if (evt & kPollerEventHup) res |= EPOLLHUP;
+    if (evt & kPollerEventOneShot) res |= EPOLLONESHOT;
     return res;
 }
 
@@ -121,12 +123,16 @@ EpollPoller::handle_event(int timeout)
     struct epoll_event* epoll_evt = (struct epoll_event*)
         malloc(sizeof(struct epoll_event) * MAX_EVENT_PER_POLL);
     Connection* conn = NULL;
+    utils::EpochManager& epoch = utils::EpochManager::instance();
     if (timeout > 0) {
         timeout *= 1000;
     }
     while (true) {
+        // no connection is held while waiting, reclaiming needn't wait
+        epoch.offline();
         int nfds = epoll_wait(epoll_fd_, epoll_evt, MAX_EVENT_PER_POLL,
                               timeout);
+        epoch.online();
         if (nfds < 0) {
             if (errno == EINTR) {
                 continue;
@@ -0,0 +1,1039 @@
+#include "pch.h"
+
+#include "config.h"
+
+#ifndef USE_IO_URING
+#error "io_uring is not supported"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "utils/exception.h"
+#include "utils/logger.h"
+#include "utils/lock.h"
+#include "utils/epoch.h"
+#include "core/poller.h"
+#include "core/stream.h"
+
+namespace tube {
+
+/**
+ * io_uring based poller.  Readiness is polled with IORING_OP_POLL_ADD, which
+ * is one-shot, so every reported fd is re-armed after its event is handled.
+ * That keeps the level-triggered behavior of the epoll poller, while the
+ * re-arms of a whole poll round are submitted with the same io_uring_enter()
+ * which waits for the next events.
+ *
+ * In completion mode ("io_uring_completion") the poller does the socket IO
+ * of the stages too:
+ *
+ * - An fd polled for reading gets a multishot recv, which receives into
+ *   Buffer pages provided to the kernel through a buffer ring.  The pages
+ *   are queued on the fd, a read event is reported, and read_input() hands
+ *   them over to the input stream without copying.  A parked fd (polled
+ *   without reading) keeps receiving, up to a few pages, and what was
+ *   received is reported when it's polled for reading again.
+ * - write_output() writes what the socket takes right away.  The rest of
+ *   the data in memory at the front of the output stream is shared and
+ *   submitted in one sendmsg, with MSG_MORE if a file follows, and waits in
+ *   the kernel for room.  Its completion is reported as a write event.  An
+ *   fd polled for writing is reported writable right away, unless the
+ *   stage's last write was of a file which blocked: files are still written
+ *   by the stage, after a readiness poll.
+ *
+ * The submissions of a whole poll round go with one io_uring_enter().  Data
+ * left queued, e.g. when the stage couldn't lock the connection, is reported
+ * again in the next round, like a level-triggered poll.  If the kernel has
+ * no buffer rings or multishot recv, the poller falls back to readiness.
+ *
+ * Registrations made by other threads are submitted immediately, outside the
+ * lock, and if the kernel can't take them right away the event loop submits
+ * them with its next wait.  Stale completions, of polls which are removed or
+ * changed, are told apart by a generation number in user_data, and those of
+ * recvs and writes by the serial number of the registration, which changes
+ * when the fd is removed.
+ */
+class IoUringPoller : public Poller
+{
+    typedef std::vector<std::pair<BufferPage*, size_t> > PageQueue;
+
+    // multishot recv, alive until its last completion
+    struct RecvOp {
+        int  fd;
+        u32  serial;
+        bool cancelled;
+    };
+
+    // write in flight, its data keeps the pages until it completes
+    struct WriteOp {
+        int                       fd;
+        u32                       serial;
+        bool                      done;
+        int                       res;
+        Buffer                    data;
+        std::vector<struct iovec> vec;
+        struct msghdr             msg;
+    };
+
+    struct Registration {
+        Connection* conn;
+        u32         mask;
+        u32         gen;
+        u32         serial;
+        bool        armed;
+        bool        oneshot;
+        bool        waiting;   // completion mode, wants the next event
+        bool        receiving; // completion mode, reads come from recvs
+        bool        blocked;   // completion mode, the last file write blocked
+        int         recv_end;  // errno ending the recv, or kRecvEof
+        RecvOp*     recv;
+        WriteOp*    write;
+        PageQueue*  received;
+        u32         round;     // poll round it was last reported in
+        size_t      event;     // index of that report
+    };
+
+    struct Ring {
+        u32* head;
+        u32* tail;
+        u32* mask;
+        u32* array; // submission ring only
+        void*  ptr;
+        size_t size;
+    };
+
+    struct Event {
+        int         fd;
+        PollerEvent evt;
+        Connection* conn;
+        u32         gen;
+    };
+
+    int                       ring_fd_;
+    Ring                      sq_;
+    Ring                      cq_;
+    struct io_uring_sqe*      sqes_;
+    size_t                    sqes_size_;
+    struct io_uring_cqe*      cqes_;
+    u32                       sq_tail_; // local tail, published on flush
+
+    // buffer ring of completion mode, its pages indexed by buffer id
+    bool                      completion_;
+    struct io_uring_buf*      bufs_;
+    size_t                    bufs_size_;
+    u16                       buf_tail_;
+    std::vector<BufferPage*>  buf_pages_;
+
+    utils::Mutex              mutex_;
+    std::vector<Registration> regs_; // indexed by fd
+    // fds the event loop couldn't re-arm, with their generations
+    std::vector<std::pair<int, u32> > unarmed_;
+    // fds with events to report in the next round, without waiting
+    std::vector<int>          pending_;
+    std::vector<Event>        events_;
+    u32                       round_;
+public:
+    IoUringPoller(bool completion = false);
+    virtual ~IoUringPoller();
+
+    virtual void handle_event(int timeout);
+    virtual bool poll_add_fd(int fd, Connection* conn, PollerEvent evt);
+    virtual bool poll_change_fd(int fd, Connection* conn, PollerEvent evt);
+    virtual bool poll_remove_fd(int fd);
+
+    virtual ssize_t read_input(int fd, InputStream& in);
+    virtual ssize_t write_output(int fd, OutputStream& out);
+    virtual bool    is_writing(int fd);
+private:
+    struct io_uring_sqe* get_sqe();
+    bool arm(int fd);
+    void rearm(int fd, u32 gen);
+    void disarm(int fd);
+    bool submit();
+    int  enter(u32 to_submit, u32 min_complete, int timeout);
+    void unmap_rings();
+
+    bool setup_buffer_ring();
+    void provide_buffer(u16 bid);
+    bool submit_recv(int fd);
+    void cancel(u64 user_data);
+    void cancel_recv(int fd);
+    void reset_io(int fd);
+    void wake();
+    void report(int fd, PollerEvent evt);
+    void report_pending();
+    void complete_poll(struct io_uring_cqe* cqe);
+    void complete_recv(RecvOp* op, struct io_uring_cqe* cqe);
+    void complete_write(WriteOp* op, struct io_uring_cqe* cqe);
+
+    bool wants_read(const Registration& reg) const {
+        return reg.conn && (reg.mask & POLLIN) && completion_;
+    }
+    static bool has_input(const Registration& reg) {
+        return (reg.received && !reg.received->empty()) || reg.recv_end;
+    }
+};
+
+/**
+ * The completion mode of IoUringPoller.
+ */
+class IoUringCompletionPoller : public IoUringPoller
+{
+public:
+    IoUringCompletionPoller() : IoUringPoller(true) {}
+};
+
+static const u32 kRingEntries = 4096;
+
+// pages the kernel receives into, per poller
+static const u32 kBufRingEntries = 256;
+static const u16 kBufGroup = 0;
+
+// pages a parked fd may queue before its recv is cancelled, the socket
+// buffer holds the rest
+static const size_t kMaxParkedPages = 16;
+
+// recv_end of a recv which has received the end of file
+static const int kRecvEof = -1;
+
+// user_data of removals, cancellations and wake-ups, their completions are
+// ignored
+static const u64 kIgnoreUserData = ~0ULL;
+
+// the low bits of user_data tell polls from recvs and writes, whose
+// user_data is the pointer of their op
+static const u64 kTagMask = 3;
+static const u64 kTagPoll = 0;
+static const u64 kTagRecv = 1;
+static const u64 kTagWrite = 2;
+
+// poller running its event loop on the current thread, if any
+static __thread void* looping_poller_ = NULL;
+
+// ring indexes are shared with the kernel, ordered the way liburing does:
+// acquire the indexes the kernel moves, release the ones we move
+static inline u32
+load_acquire(const u32* ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+store_release(u32* ptr, u32 val)
+{
+    __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+static inline u64
+make_user_data(int fd, u32 gen)
+{
+    return ((u64) gen << 32) | ((u64) (u32) fd << 2) | kTagPoll;
+}
+
+static inline u64
+make_user_data(void* op, u64 tag)
+{
+    return (u64) (unsigned long) op | tag;
+}
+
+static int
+build_poll_mask(PollerEvent evt)
+{
+    int res = 0;
+    if (evt & kPollerEventRead) res |= POLLIN;
+    if (evt & kPollerEventWrite) res |= POLLOUT;
+    if (evt & kPollerEventError) res |= POLLERR;
+    if (evt & kPollerEventHup) res |= POLLHUP;
+    return res;
+}
+
+static PollerEvent
+build_poller_event(int events)
+{
+    PollerEvent evt = 0;
+    if (events & POLLIN) evt |= kPollerEventRead;
+    if (events & POLLOUT) evt |= kPollerEventWrite;
+    if (events & POLLERR) evt |= kPollerEventError;
+    if (events & POLLHUP) evt |= kPollerEventHup;
+    return evt;
+}
+
+IoUringPoller::IoUringPoller(bool completion)
+    : Poller(), sqes_(NULL), sqes_size_(0), cqes_(NULL), sq_tail_(0),
+      completion_(false), bufs_(NULL), bufs_size_(0), buf_tail_(0),
+      regs_(utils::get_fdmap_max_size()), round_(0)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(&sq_, 0, sizeof(sq_));
+    memset(&cq_, 0, sizeof(cq_));
+    ring_fd_ = ::syscall(__NR_io_uring_setup, kRingEntries, &params);
+    if (ring_fd_ < 0) {
+        throw utils::SyscallException();
+    }
+    // waiting with a timeout needs EXT_ARG, and no completion may be lost
+    if (!(params.features & IORING_FEAT_EXT_ARG)
+        || !(params.features & IORING_FEAT_NODROP)) {
+        ::close(ring_fd_);
+        errno = ENOSYS;
+        throw utils::SyscallException();
+    }
+
+    sq_.size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    cq_.size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_.size = cq_.size = std::max(sq_.size, cq_.size);
+    }
+    sq_.ptr = ::mmap(NULL, sq_.size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_.ptr == MAP_FAILED) {
+        sq_.ptr = NULL;
+        unmap_rings();
+        throw utils::SyscallException();
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_.ptr = sq_.ptr;
+    } else {
+        cq_.ptr = ::mmap(NULL, cq_.size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd_,
+                         IORING_OFF_CQ_RING);
+        if (cq_.ptr == MAP_FAILED) {
+            cq_.ptr = NULL;
+            unmap_rings();
+            throw utils::SyscallException();
+        }
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe*) ::mmap(NULL, sqes_size_,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE,
+                                          ring_fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        sqes_ = NULL;
+        unmap_rings();
+        throw utils::SyscallException();
+    }
+
+    byte* sq = (byte*) sq_.ptr;
+    sq_.head = (u32*) (sq + params.sq_off.head);
+    sq_.tail = (u32*) (sq + params.sq_off.tail);
+    sq_.mask = (u32*) (sq + params.sq_off.ring_mask);
+    sq_.array = (u32*) (sq + params.sq_off.array);
+    byte* cq = (byte*) cq_.ptr;
+    cq_.head = (u32*) (cq + params.cq_off.head);
+    cq_.tail = (u32*) (cq + params.cq_off.tail);
+    cq_.mask = (u32*) (cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    sq_tail_ = *sq_.tail;
+
+    for (size_t i = 0; i < regs_.size(); i++) {
+        memset(&regs_[i], 0, sizeof(Registration));
+    }
+
+    if (completion && !setup_buffer_ring()) {
+        LOG(WARNING, "io_uring completion mode isn't supported, polling "
+            "readiness only");
+    }
+}
+
+IoUringPoller::~IoUringPoller()
+{
+    unmap_rings();
+    // the ring is gone, the kernel doesn't use the pages anymore
+    for (size_t i = 0; i < buf_pages_.size(); i++) {
+        Buffer::release_page(buf_pages_[i]);
+    }
+    if (bufs_) {
+        ::munmap(bufs_, bufs_size_);
+    }
+    // ops in flight are left, the kernel might still be finishing them
+    for (size_t i = 0; i < regs_.size(); i++) {
+        Registration& reg = regs_[i];
+        if (reg.write && reg.write->done) {
+            delete reg.write;
+        }
+        if (reg.received) {
+            for (size_t j = 0; j < reg.received->size(); j++) {
+                Buffer::release_page((*reg.received)[j].first);
+            }
+            delete reg.received;
+        }
+    }
+}
+
+void
+IoUringPoller::unmap_rings()
+{
+    if (sqes_) {
+        ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_.ptr && cq_.ptr != sq_.ptr) {
+        ::munmap(cq_.ptr, cq_.size);
+    }
+    if (sq_.ptr) {
+        ::munmap(sq_.ptr, sq_.size);
+    }
+    ::close(ring_fd_);
+}
+
+bool
+IoUringPoller::setup_buffer_ring()
+{
+#ifdef IORING_RECV_MULTISHOT
+    bufs_size_ = kBufRingEntries * sizeof(struct io_uring_buf);
+    void* ptr = ::mmap(NULL, bufs_size_, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u64) (unsigned long) ptr;
+    reg.ring_entries = kBufRingEntries;
+    reg.bgid = kBufGroup;
+    // 5.19 or later
+    if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING,
+                  &reg, 1) < 0) {
+        ::munmap(ptr, bufs_size_);
+        return false;
+    }
+    bufs_ = (struct io_uring_buf*) ptr;
+    buf_pages_.resize(kBufRingEntries);
+    for (u32 i = 0; i < kBufRingEntries; i++) {
+        provide_buffer(i);
+    }
+    completion_ = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void
+IoUringPoller::provide_buffer(u16 bid)
+{
+    // only the event loop moves the tail of the buffer ring, which overlays
+    // the reserved field of its first entry
+    BufferPage* page = Buffer::new_page(Buffer::kPageSize);
+    buf_pages_[bid] = page;
+    struct io_uring_buf* buf = &bufs_[buf_tail_ & (kBufRingEntries - 1)];
+    buf->addr = (u64) (unsigned long) page->data();
+    buf->len = page->size;
+    buf->bid = bid;
+    buf_tail_++;
+    __atomic_store_n(&bufs_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+}
+
+int
+IoUringPoller::enter(u32 to_submit, u32 min_complete, int timeout)
+{
+    u32 flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout;
+            ts.tv_nsec = 0;
+            arg.ts = (u64) (unsigned long) &ts;
+        }
+    }
+    return ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete,
+                     flags, min_complete > 0 ? &arg : NULL,
+                     min_complete > 0 ? sizeof(arg) : 0);
+}
+
+bool
+IoUringPoller::submit()
+{
+    // mutex_ must not be held, the event loop takes it between its waits
+    u32 pending;
+    {
+        utils::Lock lk(mutex_);
+        // publish the local tail, the entries are visible to the kernel first
+        store_release(sq_.tail, sq_tail_);
+        pending = sq_tail_ - load_acquire(sq_.head);
+    }
+    // the event loop might be submitting some of them at the same time, the
+    // kernel takes what's left.  On EBUSY or EAGAIN the rest is submitted
+    // with the next wait, the pending completions wake the event loop up
+    int ret = 0;
+    while (pending > 0 && (ret = enter(pending, 0, -1)) < 0 && errno == EINTR)
+        ;
+    if (pending > 0 && ret < 0 && errno != EAGAIN && errno != EBUSY) {
+        LOG(WARNING, "io_uring submission failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+struct io_uring_sqe*
+IoUringPoller::get_sqe()
+{
+    // mutex_ must be held
+    if (sq_tail_ - load_acquire(sq_.head) > *sq_.mask) {
+        // ring is full, try once rather than waiting under the lock
+        store_release(sq_.tail, sq_tail_);
+        enter(sq_tail_ - load_acquire(sq_.head), 0, -1);
+        if (sq_tail_ - load_acquire(sq_.head) > *sq_.mask) {
+            return NULL;
+        }
+    }
+    u32 idx = sq_tail_ & *sq_.mask;
+    struct io_uring_sqe* sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sq_.array[idx] = idx;
+    sq_tail_++;
+    return sqe;
+}
+
+bool
+IoUringPoller::arm(int fd)
+{
+    // mutex_ must be held
+    Registration& reg = regs_[fd];
+    if (wants_read(reg)) {
+        // the recv reports data, the end of file and errors
+        reg.waiting = true;
+        if (has_input(reg)) {
+            pending_.push_back(fd);
+        }
+        if (reg.recv || reg.recv_end) {
+            return true; // a cancelled recv is re-submitted when it ends
+        }
+        if (submit_recv(fd)) {
+            return true;
+        }
+        if (reg.receiving) {
+            return false;
+        }
+        // the recv is never tried without a buffer ring, and not after
+        // it's found unsupported
+    } else if ((reg.mask & POLLOUT) && completion_
+               && (reg.write || !reg.blocked)) {
+        // the write reports when it's done.  Without one, the next is
+        // submitted right away, it waits in the kernel for room
+        reg.waiting = true;
+        if (!reg.write || reg.write->done) {
+            pending_.push_back(fd);
+        }
+        return true;
+    }
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = reg.mask;
+    sqe->user_data = make_user_data(fd, reg.gen);
+    reg.armed = true;
+    return true;
+}
+
+void
+IoUringPoller::rearm(int fd, u32 gen)
+{
+    // mutex_ must be held
+    Registration& reg = regs_[fd];
+    if (reg.gen == gen && !reg.armed && !reg.oneshot && !arm(fd)) {
+        unarmed_.push_back(std::make_pair(fd, gen));
+    }
+}
+
+void
+IoUringPoller::disarm(int fd)
+{
+    Registration& reg = regs_[fd];
+    if (reg.armed) {
+        // without room for the removal, the poll fires once more, stale
+        struct io_uring_sqe* sqe = get_sqe();
+        if (sqe) {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = make_user_data(fd, reg.gen);
+            sqe->user_data = kIgnoreUserData;
+        }
+        reg.armed = false;
+    }
+    reg.waiting = false;
+    reg.gen++; // completions of the old poll become stale
+}
+
+bool
+IoUringPoller::submit_recv(int fd)
+{
+#ifdef IORING_RECV_MULTISHOT
+    Registration& reg = regs_[fd];
+    if (!completion_) {
+        return false;
+    }
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe == NULL) {
+        return false;
+    }
+    RecvOp* op = new RecvOp();
+    op->fd = fd;
+    op->serial = reg.serial;
+    op->cancelled = false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufGroup;
+    sqe->user_data = make_user_data(op, kTagRecv);
+    reg.recv = op;
+    reg.receiving = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void
+IoUringPoller::cancel(u64 user_data)
+{
+    // without room, the request ends by itself when the socket is shut down
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = user_data;
+        sqe->user_data = kIgnoreUserData;
+    }
+}
+
+void
+IoUringPoller::cancel_recv(int fd)
+{
+    // what has been received stays queued
+    RecvOp* op = regs_[fd].recv;
+    if (op && !op->cancelled) {
+        cancel(make_user_data(op, kTagRecv));
+        op->cancelled = true;
+    }
+}
+
+void
+IoUringPoller::reset_io(int fd)
+{
+    // the fd goes to another connection, completions of the old recv and
+    // write become stale
+    Registration& reg = regs_[fd];
+    cancel_recv(fd);
+    reg.recv = NULL;
+    if (reg.write) {
+        if (reg.write->done) {
+            delete reg.write;
+        } else {
+            cancel(make_user_data(reg.write, kTagWrite));
+        }
+        reg.write = NULL;
+    }
+    if (reg.received) {
+        for (size_t i = 0; i < reg.received->size(); i++) {
+            Buffer::release_page((*reg.received)[i].first);
+        }
+        delete reg.received;
+        reg.received = NULL;
+    }
+    reg.recv_end = 0;
+    reg.receiving = false;
+    reg.blocked = false;
+    reg.serial++;
+}
+
+void
+IoUringPoller::wake()
+{
+    // the completion of a no-op wakes the event loop up
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe) {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data = kIgnoreUserData;
+    }
+}
+
+bool
+IoUringPoller::poll_add_fd(int fd, Connection* conn, PollerEvent evt)
+{
+    {
+        utils::Lock lk(mutex_);
+        Registration& reg = regs_[fd];
+        disarm(fd);
+        if (reg.conn != conn) {
+            reset_io(fd);
+        }
+        reg.conn = conn;
+        reg.mask = build_poll_mask(evt);
+        reg.oneshot = (evt & kPollerEventOneShot) != 0;
+        size_t npending = pending_.size();
+        if (!arm(fd)) {
+            return false;
+        }
+        if (looping_poller_ != this && pending_.size() > npending) {
+            wake();
+        }
+    }
+    // the event loop submits with its next wait
+    return looping_poller_ == this || submit();
+}
+
+bool
+IoUringPoller::poll_change_fd(int fd, Connection* conn, PollerEvent evt)
+{
+    return poll_add_fd(fd, conn, evt);
+}
+
+bool
+IoUringPoller::poll_remove_fd(int fd)
+{
+    {
+        utils::Lock lk(mutex_);
+        disarm(fd);
+        reset_io(fd);
+        regs_[fd].conn = NULL;
+    }
+    return looping_poller_ == this || submit();
+}
+
+ssize_t
+IoUringPoller::read_input(int fd, InputStream& in)
+{
+    {
+        utils::Lock lk(mutex_);
+        Registration& reg = regs_[fd];
+        if (reg.received && !reg.received->empty()) {
+            ssize_t nread = 0;
+            for (size_t i = 0; i < reg.received->size(); i++) {
+                in.buffer().append_page((*reg.received)[i].first,
+                                        (*reg.received)[i].second);
+                nread += (*reg.received)[i].second;
+            }
+            reg.received->clear();
+            return nread;
+        }
+        if (reg.recv_end == kRecvEof) {
+            return 0;
+        } else if (reg.recv_end) {
+            errno = reg.recv_end;
+            return -1;
+        } else if (reg.receiving) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    return Poller::read_input(fd, in);
+}
+
+ssize_t
+IoUringPoller::write_output(int fd, OutputStream& out)
+{
+    if (!completion_) {
+        return Poller::write_output(fd, out);
+    }
+    {
+        utils::Lock lk(mutex_);
+        Registration& reg = regs_[fd];
+        WriteOp* op = reg.write;
+        if (op && !op->done) {
+            errno = EAGAIN;
+            return -1;
+        } else if (op) {
+            reg.write = NULL;
+            ssize_t res = op->res;
+            delete op;
+            if (res < 0) {
+                errno = -res;
+                return -1;
+            }
+            out.consume(res);
+            return res;
+        }
+    }
+
+    // what the socket takes is written right away, the rest waits in the
+    // kernel for room
+    ssize_t res = Poller::write_output(fd, out);
+    if (res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return res;
+    }
+    utils::Lock lk(mutex_);
+    Registration& reg = regs_[fd];
+    WriteOp* op = new WriteOp();
+    bool more = out.share_front(op->data, Buffer::kMaxIovecs);
+    struct io_uring_sqe* sqe = NULL;
+    if (op->data.size() > 0) {
+        sqe = get_sqe();
+    }
+    if (sqe == NULL) {
+        // a file, or no room to submit, the stage polls for writing
+        delete op;
+        reg.blocked = true;
+        errno = EAGAIN;
+        return -1;
+    }
+    // the iovecs and the header are read when it's submitted
+    op->fd = fd;
+    op->serial = reg.serial;
+    op->done = false;
+    op->res = 0;
+    op->vec.resize(std::min(op->data.page_count(), Buffer::kMaxIovecs));
+    size_t nvec = op->data.fill_iovecs(&op->vec[0], op->vec.size());
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = &op->vec[0];
+    op->msg.msg_iovlen = nvec;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (u64) (unsigned long) &op->msg;
+    sqe->len = 1;
+#ifdef MSG_MORE
+    // hold the tail in the socket until the file is written
+    sqe->msg_flags = more ? MSG_MORE : 0;
+#endif
+    sqe->user_data = make_user_data(op, kTagWrite);
+    reg.write = op;
+    errno = EAGAIN;
+    return -1;
+}
+
+bool
+IoUringPoller::is_writing(int fd)
+{
+    utils::Lock lk(mutex_);
+    return regs_[fd].write != NULL;
+}
+
+void
+IoUringPoller::report(int fd, PollerEvent evt)
+{
+    // mutex_ must be held, an fd is reported once a round
+    Registration& reg = regs_[fd];
+    if (reg.round == round_) {
+        events_[reg.event].evt |= evt;
+        return;
+    }
+    Event event;
+    event.fd = fd;
+    event.evt = evt;
+    event.conn = reg.conn;
+    event.gen = reg.gen;
+    reg.round = round_;
+    reg.event = events_.size();
+    events_.push_back(event);
+}
+
+void
+IoUringPoller::report_pending()
+{
+    // mutex_ must be held
+    std::vector<int> pending;
+    pending.swap(pending_);
+    for (size_t i = 0; i < pending.size(); i++) {
+        Registration& reg = regs_[pending[i]];
+        if (!reg.waiting) {
+            continue; // changed or removed meanwhile
+        }
+        if (wants_read(reg) && has_input(reg)) {
+            report(pending[i], kPollerEventRead);
+        } else if ((reg.mask & POLLOUT) && (!reg.write || reg.write->done)) {
+            report(pending[i], kPollerEventWrite);
+            reg.waiting = !reg.oneshot;
+        }
+    }
+}
+
+void
+IoUringPoller::complete_poll(struct io_uring_cqe* cqe)
+{
+    int fd = (int) ((u32) cqe->user_data >> 2);
+    Registration& reg = regs_[fd];
+    if (reg.gen != (u32) (cqe->user_data >> 32)) {
+        return; // removed or changed
+    }
+    reg.armed = false;
+    reg.blocked = false; // the stage tells if it blocks again
+    report(fd, cqe->res >= 0 ? build_poller_event(cqe->res)
+           : kPollerEventError);
+}
+
+void
+IoUringPoller::complete_recv(RecvOp* op, struct io_uring_cqe* cqe)
+{
+    int fd = op->fd;
+    Registration& reg = regs_[fd];
+    bool current = op->serial == reg.serial;
+    bool last = !(cqe->flags & IORING_CQE_F_MORE);
+    BufferPage* page = NULL;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        u16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        page = buf_pages_[bid];
+        provide_buffer(bid);
+    }
+    if (last) {
+        if (current && reg.recv == op) {
+            reg.recv = NULL;
+        }
+        delete op;
+    }
+    if (!current) {
+        if (page) {
+            Buffer::release_page(page);
+        }
+        return;
+    }
+
+    if (cqe->res > 0 && page) {
+        if (reg.received == NULL) {
+            reg.received = new PageQueue();
+        }
+        reg.received->push_back(std::make_pair(page, (size_t) cqe->res));
+        page = NULL;
+        if (!(reg.mask & POLLIN)
+            && reg.received->size() >= kMaxParkedPages) {
+            cancel_recv(fd);
+        }
+    } else if (cqe->res == 0) {
+        reg.recv_end = kRecvEof;
+    } else if (cqe->res == -EINVAL && !has_input(reg)) {
+        // no multishot recv, this fd and the later ones are polled
+        LOG(WARNING, "io_uring multishot recv isn't supported, polling "
+            "readiness only");
+        completion_ = false;
+        reg.receiving = false;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED
+               && cqe->res != -ENOBUFS) {
+        reg.recv_end = -cqe->res;
+    }
+    if (page) {
+        Buffer::release_page(page);
+    }
+
+    if (reg.waiting && has_input(reg) && wants_read(reg)) {
+        report(fd, kPollerEventRead);
+    }
+    // ended by a cancellation or running out of pages, but still wanted
+    if (last && reg.conn && !reg.recv && !reg.recv_end
+        && (reg.mask & POLLIN) && !arm(fd)) {
+        unarmed_.push_back(std::make_pair(fd, reg.gen));
+    }
+}
+
+void
+IoUringPoller::complete_write(WriteOp* op, struct io_uring_cqe* cqe)
+{
+    Registration& reg = regs_[op->fd];
+    if (op->serial != reg.serial || reg.write != op) {
+        delete op; // removed, the connection is gone
+        return;
+    }
+    op->done = true;
+    op->res = cqe->res;
+    op->data.clear();
+    if (reg.waiting) {
+        report(op->fd, kPollerEventWrite);
+        reg.waiting = !reg.oneshot;
+    }
+}
+
+void
+IoUringPoller::handle_event(int timeout)
+{
+    utils::EpochManager& epoch = utils::EpochManager::instance();
+    looping_poller_ = this;
+
+    while (true) {
+        u32 to_submit;
+        u32 min_complete;
+        {
+            utils::Lock lk(mutex_);
+            store_release(sq_.tail, sq_tail_);
+            to_submit = sq_tail_ - load_acquire(sq_.head);
+            // reports left from the last round don't wait
+            min_complete = pending_.empty() ? 1 : 0;
+        }
+        // other threads might submit our entries meanwhile, which is fine.
+        // no connection is held while waiting, reclaiming needn't wait.
+        // Without waiting it still enters, reports left from a busy
+        // connection are repeated at the rate of a readiness poll
+        epoch.offline();
+        int ret = enter(to_submit, min_complete, timeout);
+        epoch.online();
+        if (ret < 0 && errno != EINTR && errno != ETIME
+            && errno != EBUSY && errno != EAGAIN) {
+            throw utils::SyscallException();
+        }
+
+        {
+            utils::Lock lk(mutex_);
+            events_.clear();
+            round_++;
+            u32 head = *cq_.head; // only moved by us
+            u32 tail = load_acquire(cq_.tail);
+            for (; head != tail; head++) {
+                struct io_uring_cqe* cqe = &cqes_[head & *cq_.mask];
+                u64 user_data = cqe->user_data;
+                if (user_data == kIgnoreUserData) {
+                    continue;
+                }
+                void* op = (void*) (unsigned long) (user_data & ~kTagMask);
+                switch (user_data & kTagMask) {
+                case kTagRecv:
+                    complete_recv((RecvOp*) op, cqe);
+                    break;
+                case kTagWrite:
+                    complete_write((WriteOp*) op, cqe);
+                    break;
+                default:
+                    complete_poll(cqe);
+                    break;
+                }
+            }
+            // the entries are read before the kernel may reuse them
+            store_release(cq_.head, head);
+            report_pending();
+            // the wait has submitted entries, there might be room for the
+            // fds which couldn't be re-armed
+            std::vector<std::pair<int, u32> > unarmed;
+            unarmed.swap(unarmed_);
+            for (size_t i = 0; i < unarmed.size(); i++) {
+                rearm(unarmed[i].first, unarmed[i].second);
+            }
+        }
+
+        if (!pre_handler_.empty())
+            pre_handler_();
+        if (!handler_.empty()) {
+            for (size_t i = 0; i < events_.size(); i++) {
+                handler_(events_[i].conn, events_[i].evt);
+            }
+        }
+        {
+            // re-arm like a level-triggered poll, unless the handler has
+            // changed or removed it.  In completion mode that reports the
+            // data left received again
+            utils::Lock lk(mutex_);
+            for (size_t i = 0; i < events_.size(); i++) {
+                rearm(events_[i].fd, events_[i].gen);
+            }
+        }
+        if (!post_handler_.empty())
+            post_handler_();
+    }
+    looping_poller_ = NULL;
+}
+
+EXPORT_POLLER_IMPL(io_uring, IoUringPoller);
+
+EXPORT_POLLER_IMPL(io_uring_completion, IoUringCompletionPoller);
+
+}
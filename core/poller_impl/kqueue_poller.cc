@@ -14,6 +14,7 @@
 
 #include "utils/exception.h"
 #include "utils/logger.h"
+#include "utils/epoch.h"
 #include "core/poller.h"
 
 namespace tube {
@@ -103,12 +104,16 @@ KqueuePoller::handle_event(int timeout) throw ()
     struct kevent* kevents = (struct kevent*)
         malloc(sizeof(struct kevent) * MAX_EVENT_PER_KEVENT);
     Connection* conn = NULL;
+    utils::EpochManager& epoch = utils::EpochManager::instance();
     struct timespec tspec;
     tspec.tv_sec = timeout;
     tspec.tv_nsec = 0;
     while (true) {
+        // no connection is held while waiting, reclaiming needn't wait
+        epoch.offline();
         int nfds = ::kevent(kqueue_, NULL, 0, kevents, MAX_EVENT_PER_KEVENT,
                             &tspec);
+        epoch.online();
         if (nfds < 0) {
             if (errno == EINTR) {
                 continue;
@@ -13,6 +13,7 @@
 #include "utils/exception.h"
 #include "utils/logger.h"
 #include "utils/misc.h"
+#include "utils/epoch.h"
 #include "core/poller.h"
 #include "core/pipeline.h"
 
@@ -116,13 +117,18 @@ PortPoller::handle_event(int timeout)
     tspec.tv_sec = timeout;
     tspec.tv_nsec = 0;
     Connection* conn = NULL;
+    utils::EpochManager& epoch = utils::EpochManager::instance();
     while (true) {
         uint_t nfds = 0;
         // weird handling.
         // 1. getn seems return immediately when no fd is associated
         // 2. get/getn will return error on timeout
-        if (::port_getn(port_, port_evt, MAX_EVENT_PER_GET, &nfds, &tspec)
-            == -1) {
+        // no connection is held while waiting, reclaiming needn't wait
+        epoch.offline();
+        int ret = ::port_getn(port_, port_evt, MAX_EVENT_PER_GET, &nfds,
+                              &tspec);
+        epoch.online();
+        if (ret == -1) {
             if (errno == EINTR) {
                 continue;
             } else if (errno == ETIME) {
@@ -135,7 +141,10 @@ PortPoller::handle_event(int timeout)
             }
         }
         if (nfds == 0) {
-            if (::port_get(port_, port_evt, &tspec) == -1) {
+            epoch.offline();
+            ret = ::port_get(port_, port_evt, &tspec);
+            epoch.online();
+            if (ret == -1) {
                 if (errno == EINTR) {
                     continue;
                 } else if (errno == ETIME) {
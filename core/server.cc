@@ -3,7 +3,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <cstdlib>
 #include <signal.h>
 
@@ -35,6 +37,21 @@ lookup_addr(const char* host, const char* service)
 Server::WriteBackMode
 Server::kDefaultWriteBackMode = Server::kWriteBackModePoll;
 
+size_t
+Server::kAcceptThreads = 1;
+
+size_t
+Server::kMaxAcceptBatch = 64;
+
+int
+Server::kAcceptBackoff = 100;
+
+int
+Server::kDeferAccept = 0;
+
+int
+Server::kFastOpen = 0;
+
 Server::Server()
     : fd_(-1), addr_size_(0), write_back_stage_(NULL)
 {
@@ -44,6 +61,8 @@ Server::Server()
         write_back_stage_ = new BlockOutStage();
     } else if (kDefaultWriteBackMode == kWriteBackModePoll) {
         write_back_stage_ = new PollOutStage();
+    } else if (kDefaultWriteBackMode == kWriteBackModeHybrid) {
+        write_back_stage_ = new HybridOutStage();
     }
 }
 
@@ -52,9 +71,9 @@ Server::~Server()
     delete poll_in_stage_;
     delete write_back_stage_;
 
-    if (fd_ > 0) {
-        ::shutdown(fd_, SHUT_RDWR);
-        ::close(fd_);
+    for (size_t i = 0; i < shard_fds_.size(); i++) {
+        ::shutdown(shard_fds_[i], SHUT_RDWR);
+        ::close(shard_fds_[i]);
     }
 }
 
@@ -70,24 +89,52 @@ Server::start_stages()
     Pipeline::instance().start_stages();
 }
 
-void
-Server::bind(const char* host, const char* service)
+static int
+bind_socket(struct addrinfo* info, bool reuse_port, size_t* addr_size)
 {
-    struct addrinfo* info = lookup_addr(host, service);
-    bool done = false;
+    int fd = -1;
     for (struct addrinfo* p = info; p != NULL; p = p->ai_next) {
-        if ((fd_ = ::socket(p->ai_family, p->ai_socktype, 0)) < 0) {
+        if ((fd = ::socket(p->ai_family, p->ai_socktype, 0)) < 0) {
             continue;
         }
-        if (::bind(fd_, p->ai_addr, p->ai_addrlen) < 0) {
-            close(fd_);
+        if (reuse_port) {
+#ifdef SO_REUSEPORT
+            int state = 1;
+            if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &state,
+                           sizeof(state)) < 0) {
+                LOG(WARNING, "Cannot set SO_REUSEPORT on fd %d", fd);
+            }
+#endif
+        }
+        if (::bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
             continue;
         }
-        done = true;
-        addr_size_ = p->ai_addrlen;
+        *addr_size = p->ai_addrlen;
         break;
     }
+    return fd;
+}
+
+void
+Server::bind(const char* host, const char* service)
+{
+    struct addrinfo* info = lookup_addr(host, service);
+    size_t nshards = Pipeline::instance().shard_count();
+    bool done = true;
+    for (size_t i = 0; i < nshards; i++) {
+        int fd = bind_socket(info, nshards > 1, &addr_size_);
+        if (fd < 0) {
+            done = false;
+            break;
+        }
+        shard_fds_.push_back(fd);
+    }
     ::freeaddrinfo(info);
+    if (!shard_fds_.empty()) {
+        fd_ = shard_fds_[0];
+    }
     if (!done) {
         std::string err = "Cannot bind port(service) ";
         err += service;
@@ -99,34 +146,135 @@ Server::bind(const char* host, const char* service)
     }
 }
 
+static void
+set_listen_options(int fd)
+{
+    if (Server::kDeferAccept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        int timeout = Server::kDeferAccept;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout,
+                       sizeof(timeout)) < 0) {
+            LOG(WARNING, "Cannot set TCP_DEFER_ACCEPT on fd %d: %s", fd,
+                strerror(errno));
+        }
+#else
+        LOG(WARNING, "TCP_DEFER_ACCEPT is not supported");
+#endif
+    }
+    if (Server::kFastOpen > 0) {
+#ifdef TCP_FASTOPEN
+        int qlen = Server::kFastOpen;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen,
+                       sizeof(qlen)) < 0) {
+            LOG(WARNING, "Cannot set TCP_FASTOPEN on fd %d: %s", fd,
+                strerror(errno));
+        }
+#else
+        LOG(WARNING, "TCP_FASTOPEN is not supported");
+#endif
+    }
+}
+
 void
 Server::listen(int queue_size)
 {
-    if (::listen(fd_, queue_size) < 0)
-        throw utils::SyscallException();
+    for (size_t i = 0; i < shard_fds_.size(); i++) {
+        set_listen_options(shard_fds_[i]);
+        if (::listen(shard_fds_[i], queue_size) < 0)
+            throw utils::SyscallException();
+        // accepting threads drain the socket until EAGAIN
+        utils::set_socket_blocking(shard_fds_[i], false);
+    }
 }
 
 void
 Server::main_loop()
+{
+    size_t nthreads = kAcceptThreads > 0 ? kAcceptThreads : 1;
+    for (size_t i = 0; i < shard_fds_.size(); i++) {
+        for (size_t j = 0; j < nthreads; j++) {
+            if (i == 0 && j == 0) {
+                continue; // the calling thread
+            }
+            utils::create_thread(
+                boost::bind(&Server::accept_loop, this, (int) i));
+        }
+    }
+    accept_loop(0);
+}
+
+int
+Server::accept_connection(int fd, InternetAddress& address)
+{
+    socklen_t socklen = address.max_address_length();
+#ifdef SOCK_NONBLOCK
+    return ::accept4(fd, address.get_address(), &socklen,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client_fd = ::accept(fd, address.get_address(), &socklen);
+    if (client_fd >= 0) {
+        // set non-blocking mode
+        utils::set_socket_blocking(client_fd, false);
+    }
+    return client_fd;
+#endif
+}
+
+void
+Server::accept_loop(int shard)
 {
     Pipeline& pipeline = Pipeline::instance();
     Stage* stage = pipeline.find_stage("poll_in");
+    int fd = shard_fds_[shard];
+    if (pipeline.is_sharded()) {
+        Pipeline::set_current_shard(shard);
+        utils::set_thread_affinity(shard);
+    }
+    Scheduler::ConnectionList conns;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    bool failing = false; // logged once until an accept() succeeds
     while (true) {
-        InternetAddress address;
-        socklen_t socklen = address.max_address_length();
-        int client_fd = ::accept(fd_, address.get_address(), &socklen);
-        if (client_fd < 0) {
-            LOG(WARNING, "Error when accepting socket: %s", strerror(errno));
+        bool backoff = false;
+        if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            LOG(WARNING, "Error when polling server socket: %s",
+                strerror(errno));
             continue;
         }
-        // set non-blocking mode
-        Connection* conn = pipeline.create_connection(client_fd);
-        conn->set_address(address);
-        utils::set_socket_blocking(conn->fd(), false);
+        while (conns.size() < kMaxAcceptBatch) {
+            InternetAddress address;
+            int client_fd = accept_connection(fd, address);
+            if (client_fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK
+                    && errno != EINTR && errno != ECONNABORTED) {
+                    // e.g. EMFILE, the socket stays readable and poll()
+                    // would return right away
+                    if (!failing) {
+                        LOG(WARNING, "Error when accepting socket: %s, "
+                            "pausing accept", strerror(errno));
+                    }
+                    failing = true;
+                    backoff = true;
+                }
+                break;
+            }
+            failing = false;
+            Connection* conn = pipeline.create_connection(client_fd);
+            conn->set_address(address);
+            conn->set_shard(shard);
 
-        LOG(DEBUG, "accepted connection from %s",
-            conn->address_string().c_str());
-        stage->sched_add(conn);
+            LOG(DEBUG, "accepted connection from %s",
+                conn->address_string().c_str());
+            conns.push_back(conn);
+        }
+        if (!conns.empty()) {
+            stage->sched_add_batch(conns);
+            conns.clear();
+        }
+        if (backoff) {
+            usleep(kAcceptBackoff * 1000);
+        }
     }
 }
 
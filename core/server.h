@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <vector>
 
 #include "core/stages.h"
 
@@ -14,21 +15,54 @@ namespace tube {
  * Server object that bind and listen on an address.  It's responsible to
  * accept new connection and add it into PollInStage, starting the connection's
  * normal lifecycle.
+ *
+ * Under sharded mode, server binds one SO_REUSEPORT socket for each pipeline
+ * shard, and every shard has its own accepting threads.  Therefore the kernel
+ * balances new connections across shards.
+ *
+ * Accepting threads drain all pending connections of a listening socket, and
+ * add them to PollInStage as one batch.
  */
 class Server
 {
     int fd_;
     size_t addr_size_;
+    std::vector<int> shard_fds_;
 
     PollInStage*       poll_in_stage_;
     Stage*             write_back_stage_;
 public:
     enum WriteBackMode {
         kWriteBackModeBlock,
-        kWriteBackModePoll
+        kWriteBackModePoll,
+        kWriteBackModeHybrid
     };
 
     static WriteBackMode kDefaultWriteBackMode;
+    /**
+     * Number of accepting threads per listening socket.
+     */
+    static size_t kAcceptThreads;
+    /**
+     * Maximum number of connections accepted before they are added to
+     * PollInStage.
+     */
+    static size_t kMaxAcceptBatch;
+    /**
+     * Pause in milliseconds of an accepting thread after accept() failed
+     * with an error other than an empty queue, e.g. out of file descriptors.
+     */
+    static int    kAcceptBackoff;
+    /**
+     * TCP_DEFER_ACCEPT timeout in seconds: connections are only accepted once
+     * data arrives.  0 means disabled.
+     */
+    static int    kDeferAccept;
+    /**
+     * TCP_FASTOPEN queue length.  0 means disabled.
+     */
+    static int    kFastOpen;
+
     Server();
     virtual ~Server();
 
@@ -46,13 +80,15 @@ public:
      */
     void bind(const char* host, const char* service);
     /**
-     * Listen the server socket.
+     * Listen the server socket.  TCP_DEFER_ACCEPT and TCP_FASTOPEN are set
+     * here if enabled, and unsupported options are ignored with a warning.
      * @param queue_size Queue size for listen() system call.
      */
     void listen(int queue_size);
     /**
      * Start the main loop.  The main loop keeps accept new connection and
-     * start the connection's normal lifecycle.
+     * start the connection's normal lifecycle.  It starts the other accepting
+     * threads, and accepts for the first shard on the calling thread.
      */
     void main_loop();
 
@@ -66,6 +102,9 @@ public:
      * for Pipeline object.
      */
     void start_stages();
+private:
+    void accept_loop(int shard);
+    int  accept_connection(int fd, InternetAddress& address);
 };
 
 }
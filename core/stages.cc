@@ -2,21 +2,28 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <algorithm>
 #include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "utils/exception.h"
 #include "utils/logger.h"
 #include "utils/misc.h"
+#include "utils/epoch.h"
+#include "utils/atomic.h"
 #include "core/stages.h"
 #include "core/pipeline.h"
 #include "core/controller.h"
+#include "core/wrapper.h"
 
 using namespace tube::utils;
 
 namespace tube {
 
 Stage::Stage(const std::string& name)
-    : pipeline_(Pipeline::instance()), thread_pool_size_(1)
+    : name_(name), pipeline_(Pipeline::instance()), thread_pool_size_(1),
+      next_shard_(0)
 {
     sched_ = NULL;
     LOG(DEBUG, "adding %s stage to pipeline", name.c_str());
@@ -32,6 +39,23 @@ Stage::sched_add(Connection* conn)
     return true;
 }
 
+void
+Stage::sched_add_batch(const Scheduler::ConnectionList& conns)
+{
+    for (size_t i = 0; i < conns.size(); i++) {
+        sched_add(conns[i]);
+    }
+}
+
+void
+Stage::sched_add_locked_batch(const Scheduler::ConnectionList& conns)
+{
+    sched_add_batch(conns);
+    for (size_t i = 0; i < conns.size(); i++) {
+        conns[i]->unlock();
+    }
+}
+
 void
 Stage::sched_remove(Connection* conn)
 {
@@ -58,33 +82,108 @@ Stage::main_loop()
             LOG(INFO, "server loads low, destroy auto-created thread.");
             return;
         }
-        if (process_task(conn) >= 0) {
-            conn->unlock();
-            pipeline_.reschedule_all();
+        execute_task(conn);
+        EpochManager::instance().quiescent();
+        Controller* controller = sched_->controller();
+        if (controller && controller->should_retire()) {
+            LOG(INFO, "retired an auto-created thread of %s stage.",
+                name_.c_str());
+            return;
         }
     }
 }
 
+void
+Stage::execute_task(Connection* conn)
+{
+    Controller* controller = sched_ ? sched_->controller() : NULL;
+    u64 start = controller ? utils::monotonic_usec() : 0;
+    int rs = process_task(conn);
+    if (controller) {
+        controller->record_task(utils::monotonic_usec() - start);
+    }
+    if (rs >= 0) {
+        conn->unlock();
+    }
+}
+
+void
+Stage::thread_main(int shard)
+{
+    EpochThread epoch_thread;
+    if (shard >= 0) {
+        Pipeline::set_current_shard(shard);
+        utils::set_thread_affinity(shard);
+    }
+    main_loop();
+}
+
 ThreadId
 Stage::start_thread()
 {
-    return utils::create_thread(boost::bind(&Stage::main_loop, this));
+    if (pipeline_.is_sharded()) {
+        int shard = (utils::atomic_add(&next_shard_, 1L) - 1)
+            % pipeline_.shard_count();
+        return utils::create_thread(
+            boost::bind(&Stage::thread_main, this, shard));
+    }
+    return utils::create_thread(boost::bind(&Stage::thread_main, this, -1));
 }
 
 void
 Stage::start_thread_pool()
 {
-    for (size_t i = 0; i < thread_pool_size_; i++) {
+    if (sched_ && !sched_->need_thread_pool()) {
+        return;
+    }
+    size_t nthreads = thread_pool_size_ * pipeline_.shard_count();
+    for (size_t i = 0; i < nthreads; i++) {
         start_thread();
     }
+    if (sched_ && sched_->controller()) {
+        sched_->controller()->start();
+    }
+}
+
+bool
+Stage::enable_auto_tuning(long target_latency)
+{
+    if (!sched_ || !sched_->need_thread_pool()) {
+        LOG(ERROR, "%s stage doesn't support auto tuning", name_.c_str());
+        return false;
+    }
+    Controller* controller = sched_->controller();
+    if (controller == NULL) {
+        // never destroyed, the checking thread keeps using it
+        controller = new Controller();
+        controller->set_stage(this);
+        sched_->set_controller(controller);
+    }
+    controller->set_target_latency(target_latency);
+    LOG(INFO, "auto-tuning for %s stage enabled, target latency %ldus",
+        name_.c_str(), target_latency);
+    return true;
 }
 
 int PollStage::kDefaultTimeout = Timer::kUnitGran;
 
+std::string PollStage::kPollerName;
+
 PollStage::PollStage(const std::string& name)
-    : Stage(name), timeout_(kDefaultTimeout), current_poller_(0),
-      poller_name_(PollerFactory::instance().default_poller_name())
+    : Stage(name), shard_pollers_(pipeline_.shard_count()),
+      timeout_(kDefaultTimeout), current_poller_(0),
+      poller_name_(kPollerName)
 {
+    if (poller_name_.empty()) {
+        poller_name_ = PollerFactory::instance().default_poller_name();
+    }
+}
+
+void
+PollStage::initialize()
+{
+    // fd limit is set by now
+    registered_.assign(utils::get_fdmap_max_size(), NULL);
 }
 
 void
@@ -92,38 +191,60 @@ PollStage::add_poll(Poller* poller)
 {
     utils::Lock lk(mutex_);
     pollers_.push_back(poller);
+    int shard = Pipeline::current_shard();
+    if (shard >= 0 && (size_t) shard < shard_pollers_.size()) {
+        shard_pollers_[shard].push_back(poller);
+    }
+}
+
+Poller&
+PollStage::pick_poller(Connection* conn)
+{
+    // mutex_ must be held
+    current_poller_++;
+    if (pipeline_.is_sharded()) {
+        PollerList& pollers = shard_pollers_[conn->shard()];
+        if (!pollers.empty()) {
+            return *pollers[current_poller_ % pollers.size()];
+        }
+    }
+    current_poller_ %= pollers_.size();
+    return *pollers_[current_poller_];
+}
+
+void
+PollStage::schedule_idle_timeout(Poller& poller, Connection* conn)
+{
+    // the old unit based timer never closed a connection within a unit
+    int timeout = std::max(conn->idle_timeout(), Timer::kUnitGran);
+    poller.timer().schedule_after(&conn->timer_node(), timeout * 1000ULL);
 }
 
 void
-PollStage::update_connection(Poller& poller, Connection* conn,
-                             Timer::Callback cb)
+PollStage::update_connection(Poller& poller, Connection* conn)
 {
-    Timer& timer = poller.timer();
-    Timer::Unit oldfuture = conn->timer_sched_time();
+    // pushing the deadline is cheap, but not worth the lock on every event
     if (conn->update_last_active()) {
         utils::Lock lk(mutex_);
-        timer.remove(oldfuture, conn);
-        timer.replace(conn->timer_sched_time(), conn, cb);
+        schedule_idle_timeout(poller, conn);
     }
 }
 
 void
 PollStage::trigger_timer_callback(Poller& poller)
 {
+    // expiring nothing is cheap, run it every round
     if (mutex_.try_lock()) {
-        Timer::Unit current_unit = Timer::current_timer_unit();
-        Timer& timer = poller.timer();
-        if (timer.last_executed_time() + Timer::timer_unit_from_time(timeout_)
-            <= current_unit) {
-            timer.process_callbacks();
-            timer.set_last_executed_time(current_unit);
-        }
+        poller.timer().process_callbacks();
         mutex_.unlock();
     }
 }
 
+bool
+PollInStage::kRunToCompletion = false;
+
 size_t
-PollInStage::kMaxRecycleCount = 50;
+PollInStage::kMaxInlineInputSize = 4 << 10;
 
 PollInStage::PollInStage()
     : PollStage("poll_in")
@@ -139,34 +260,47 @@ bool
 PollInStage::sched_add(Connection* conn)
 {
     utils::Lock lk(mutex_);
-    current_poller_ = (current_poller_ + 1) % pollers_.size();
+    return sched_add_nolock(conn);
+}
 
-    Poller& poller = *pollers_[current_poller_];
-    Timer::Callback callback = boost::bind(
-        &PollInStage::cleanup_idle_connection_callback, this,
-        boost::ref(poller), _1);
+void
+PollInStage::sched_add_batch(const ConnectionList& conns)
+{
+    utils::Lock lk(mutex_);
+    for (size_t i = 0; i < conns.size(); i++) {
+        sched_add_nolock(conns[i]);
+    }
+}
 
-    poller.timer().replace(conn->timer_sched_time(), conn, callback);
-    return poller.add_fd(conn->fd(), conn, kPollerEventRead | kPollerEventHup
-                         | kPollerEventError);
+bool
+PollInStage::sched_add_nolock(Connection* conn)
+{
+    Poller& poller = pick_poller(conn);
+    schedule_idle_timeout(poller, conn);
+    if (!poller.add_fd(conn->fd(), conn, kPollerEventRead | kPollerEventHup
+                       | kPollerEventError)) {
+        return false;
+    }
+    registered_poller(conn) = &poller;
+    poll_states_[conn->fd()] = kPollEnabled;
+    return true;
 }
 
 void
 PollInStage::sched_remove_nolock(Connection* conn, bool recycle)
 {
-    Timer::Unit oldfuture = conn->timer_sched_time();
-    for (size_t i = 0; i < pollers_.size(); i++) {
-        if (pollers_[i]->remove_fd(conn->fd())) {
-            pollers_[i]->timer().remove(oldfuture, conn);
-            if (recycle) {
-                pollers_[i]->expired_connections().push_back(conn);
-            }
-            return;
+    Poller*& poller = registered_poller(conn);
+    if (poller) {
+        poller->remove_fd(conn->fd());
+        poller->timer().cancel(&conn->timer_node());
+        if (recycle) {
+            poller->expired_connections().push_back(conn);
         }
+        poller = NULL;
+        return;
     }
     if (recycle) {
-        pollers_[current_poller_]->expired_connections().push_back(conn);
-        current_poller_ = (current_poller_ + 1) % pollers_.size();
+        pick_poller(conn).expired_connections().push_back(conn);
     }
 }
 
@@ -177,9 +311,68 @@ PollInStage::sched_remove(Connection* conn)
     sched_remove_nolock(conn, false);
 }
 
+void
+PollInStage::disable_poll(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    Poller* poller = registered_poller(conn);
+    u8& state = poll_states_[conn->fd()];
+    if (poller == NULL || state != kPollEnabled) {
+        return;
+    }
+    state = kPollDisabled;
+    // the write back stage might time the connection meanwhile, it's added
+    // back on enable_poll() with the new timestamp
+    poller->timer().cancel(&conn->timer_node());
+}
+
+void
+PollInStage::enable_poll(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    Poller* poller = registered_poller(conn);
+    if (poller == NULL) {
+        sched_add_nolock(conn);
+        return;
+    }
+    u8& state = poll_states_[conn->fd()];
+    if (state == kPollEnabled) {
+        return;
+    }
+    if (state == kPollParked
+        && !poller->change_fd(conn->fd(), conn, kPollerEventRead
+                              | kPollerEventHup | kPollerEventError)) {
+        registered_poller(conn) = NULL;
+        poller->timer().cancel(&conn->timer_node());
+        sched_add_nolock(conn);
+        return;
+    }
+    state = kPollEnabled;
+    schedule_idle_timeout(*poller, conn);
+}
+
+bool
+PollInStage::park_connection(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    Poller* poller = registered_poller(conn);
+    u8& state = poll_states_[conn->fd()];
+    if (poller == NULL || state == kPollEnabled) {
+        return false;
+    }
+    if (state == kPollDisabled) {
+        // no interest, and at most one more hang up or error event
+        poller->change_fd(conn->fd(), conn, kPollerEventOneShot);
+        state = kPollParked;
+    }
+    return true;
+}
+
 void
 PollInStage::initialize()
 {
+    PollStage::initialize();
+    poll_states_.assign(registered_.size(), kPollEnabled);
     parser_stage_ = Pipeline::instance().find_stage("parser");
     if (parser_stage_ == NULL)
         throw std::invalid_argument("cannot find parser stage");
@@ -204,14 +397,14 @@ PollInStage::cleanup_connection(Poller& poller, Connection* conn)
     assert(conn);
 
     if (conn->is_active()) {
-        Timer::Unit oldfuture = conn->timer_sched_time();
         conn->set_active(false);
         ::shutdown(conn->fd(), SHUT_RDWR);
 
         utils::Lock lk(mutex_);
         poller.remove_fd(conn->fd());
-        poller.timer().remove(oldfuture, conn);
+        poller.timer().cancel(&conn->timer_node());
         poller.expired_connections().push_back(conn);
+        registered_poller(conn) = NULL;
         // printf("%s %p poller: %d timer: %d\n", __FUNCTION__, conn,
         //        poller.size(), poller.timer().size());
     }
@@ -223,9 +416,14 @@ PollInStage::cleanup_idle_connection_callback(Poller& poller, void* ptr)
     Connection* conn = (Connection*) ptr;
     if (!conn->try_lock())
         return false;
-    ::shutdown(conn->fd(), SHUT_RDWR);
-    poller.remove_fd(conn->fd());
-    poller.expired_connections().push_back(conn);
+    // a later cleanup_connection() must not recycle it again
+    if (conn->is_active()) {
+        conn->set_active(false);
+        ::shutdown(conn->fd(), SHUT_RDWR);
+        poller.remove_fd(conn->fd());
+        poller.expired_connections().push_back(conn);
+        registered_poller(conn) = NULL;
+    }
     conn->unlock();
     return true; // returning tree, so timer will delete this callback
 }
@@ -234,20 +432,23 @@ int
 PollInStage::kMaxReadThreshold = 256 << 10;
 
 void
-PollInStage::read_connection(Poller& poller, Connection* conn)
+PollInStage::read_connection(Poller& poller, ConnectionList& ready,
+                             Connection* conn)
 {
     assert(conn);
 
     if (!conn->try_lock()) // avoid lock contention
         return;
+    if (poll_states_[conn->fd()] != kPollEnabled && park_connection(conn)) {
+        conn->unlock(); // disabled before the lock is released
+        return;
+    }
 
     // update the timer
-    update_connection(poller, conn, boost::bind(
-                          &PollInStage::cleanup_idle_connection_callback,
-                          this, boost::ref(poller), _1));
+    update_connection(poller, conn);
     int nread = 0;
     do {
-        int rs = conn->in_stream().read_into_buffer();
+        int rs = poller.read_input(conn->fd(), conn->in_stream());
         if (rs <= 0) {
             nread = rs;
             break;
@@ -256,48 +457,58 @@ PollInStage::read_connection(Poller& poller, Connection* conn)
     } while (nread < kMaxReadThreshold);
 
     if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        // send it to parser stage
-        parser_stage_->sched_add(conn);
-    } else {
-        // error happened, clean it up
-        cleanup_connection(poller, conn);
+        if (kRunToCompletion
+            && conn->in_stream().buffer().size() <= kMaxInlineInputSize
+            && parser_stage_->process_inline(conn)) {
+            return; // lock is released or handed over
+        }
+        // send it to parser stage with the whole poll round, still locked
+        ready.push_back(conn);
+        return;
     }
+    // error happened, clean it up
+    cleanup_connection(poller, conn);
     conn->unlock();
-    pipeline_.reschedule_all();
 }
 
 void
-PollInStage::handle_connection(Poller& poller, Connection* conn,
-                               PollerEvent evt)
+PollInStage::flush_ready_connections(ConnectionList& ready)
+{
+    if (ready.empty()) {
+        return;
+    }
+    // consumers take them without try_lock(), which would fail until we
+    // unlock them one by one
+    parser_stage_->sched_add_locked_batch(ready);
+    ready.clear();
+}
+
+void
+PollInStage::handle_connection(Poller& poller, ConnectionList& ready,
+                               Connection* conn, PollerEvent evt)
 {
     // fprintf(stderr, "%s %p\n", __FUNCTION__, conn);
+    if (poll_states_[conn->fd()] != kPollEnabled && park_connection(conn)) {
+        return; // handled after enable_poll()
+    }
     if ((evt & kPollerEventHup) || (evt & kPollerEventError)) {
         if (conn->try_lock()) {
             cleanup_connection(poller, conn);
             conn->unlock();
         }
     } else if (evt & kPollerEventRead) {
-        read_connection(poller, conn);
+        read_connection(poller, ready, conn);
     }
 }
 
 void
-PollInStage::post_handle_connection(Poller& poller)
+PollInStage::post_handle_connection(Poller& poller, ConnectionList& ready)
 {
+    // before timers, which might clean up the connections
+    flush_ready_connections(ready);
     trigger_timer_callback(poller);
-    if (mutex_.try_lock()) {
-        Poller::ExpiredConnectionList& expired = poller.expired_connections();
-        Poller::ExpiredConnectionList::iterator it = expired.begin();
-        size_t count = 0;
-        while (it != expired.end() && count < kMaxRecycleCount) {
-            Poller::ExpiredConnectionList::iterator cur = it;
-            Connection* conn = *cur;
-            ++it;
-            if (pipeline_.dispose_connection(conn)) {
-                expired.erase(cur);
-                count++;
-            }
-        }
+    if (!poller.expired_connections().empty() && mutex_.try_lock()) {
+        pipeline_.retire_connections(poller.expired_connections());
         mutex_.unlock();
     }
 }
@@ -306,13 +517,17 @@ void
 PollInStage::main_loop()
 {
     Poller* poller = PollerFactory::instance().create_poller(poller_name_);
+    ConnectionList ready;
     Poller::EventCallback evthdl =
         boost::bind(&PollInStage::handle_connection, this, boost::ref(*poller),
-                    _1, _2);
+                    boost::ref(ready), _1, _2);
     Poller::PollerCallback posthdl =
         boost::bind(&PollInStage::post_handle_connection, this,
-                    boost::ref(*poller));
+                    boost::ref(*poller), boost::ref(ready));
 
+    poller->timer().set_handler(
+        boost::bind(&PollInStage::cleanup_idle_connection_callback, this,
+                    boost::ref(*poller), _1));
     poller->set_post_handler(posthdl);
     poller->set_event_handler(evthdl);
     add_poll(poller);
@@ -324,7 +539,8 @@ PollInStage::main_loop()
 BlockOutStage::BlockOutStage()
     : Stage("write_back")
 {
-    sched_ = new QueueScheduler(true); // suppress lock
+    // suppress lock
+    sched_ = SchedulerFactory::instance().create_scheduler("write_back", true);
 }
 
 BlockOutStage::~BlockOutStage()
@@ -344,16 +560,34 @@ BlockOutStage::sched_add(Connection* conn)
 
 int
 BlockOutStage::process_task(Connection* conn)
+{
+    return finish_write(conn, conn->out_stream().write_into_output());
+}
+
+int
+BlockOutStage::finish_write(Connection* conn, int rs)
 {
     OutputStream& out = conn->out_stream();
-    int rs = out.write_into_output();
     bool has_error = (rs < 0);
 
-    if (!out.is_done() && rs > 0) {
+    if (conn->is_draining() && !has_error
+        && out.memory_usage() <= Response::kResumeMemorySizes) {
+        // the handler has more to write
+        conn->set_draining(false);
+        utils::set_socket_blocking(conn->fd(), false);
+        conn->resched_continuation();
+        return -1;
+    } else if (!out.is_done() && rs > 0) {
         Stage::sched_add(conn);
         return -1;
     } else {
         conn->clear_cork();
+        if (conn->has_continuation()) {
+            conn->set_draining(false);
+            utils::set_socket_blocking(conn->fd(), false);
+            conn->resched_continuation();
+            return -1;
+        }
         if (conn->is_close_after_finish() || has_error) {
             conn->active_close();
         } else {
@@ -364,34 +598,56 @@ BlockOutStage::process_task(Connection* conn)
     }
 }
 
-PollOutStage::PollOutStage()
-    : PollStage("write_back")
+PollOutStage::PollOutStage(const std::string& name)
+    : PollStage(name)
 {}
 
 PollOutStage::~PollOutStage()
 {}
 
+static const PollerEvent kWriteEvents = kPollerEventWrite | kPollerEventHup
+    | kPollerEventError | kPollerEventOneShot;
+
 bool
 PollOutStage::sched_add(Connection* conn)
 {
     utils::Lock lk(mutex_);
-    current_poller_ = (current_poller_ + 1) % pollers_.size();
-    Poller& poller = *pollers_[current_poller_];
     pipeline_.disable_poll(conn);
     conn->set_cork();
     conn->update_last_active(); // update the initial timestamp for timeout
-    return poller.add_fd(conn->fd(), conn, kPollerEventWrite | kPollerEventHup
-                         | kPollerEventError);
+    Poller*& poller = registered_poller(conn);
+    if (poller && poller->change_fd(conn->fd(), conn, kWriteEvents)) {
+        schedule_idle_timeout(*poller, conn);
+        return true; // re-armed
+    }
+    poller = &pick_poller(conn);
+    if (!poller->add_fd(conn->fd(), conn, kWriteEvents)) {
+        poller = NULL;
+        return false;
+    }
+    schedule_idle_timeout(*poller, conn);
+    return true;
+}
+
+void
+PollOutStage::sched_remove(Connection* conn)
+{
+    utils::Lock lk(mutex_);
+    Poller*& poller = registered_poller(conn);
+    if (poller) {
+        poller->remove_fd(conn->fd());
+        poller->timer().cancel(&conn->timer_node());
+        poller = NULL;
+    }
 }
 
 void
 PollOutStage::cleanup_connection(Poller& poller, Connection* conn)
 {
+    // one-shot, the fd is disarmed already
     utils::Lock lk(mutex_);
-    poller.remove_fd(conn->fd());
-    poller.timer().remove(conn->timer_sched_time(), conn);
+    poller.timer().cancel(&conn->timer_node());
     conn->unlock();
-    pipeline_.reschedule_all();
 }
 
 bool
@@ -400,7 +656,9 @@ PollOutStage::cleanup_idle_connection_callback(Poller& poller, void* ptr)
     Connection* conn = (Connection*) ptr;
     conn->clear_cork();
     conn->active_close();
+    // still armed, the connection isn't ours after unlocking it
     poller.remove_fd(conn->fd());
+    registered_poller(conn) = NULL;
     conn->unlock();
     return true;
 }
@@ -417,32 +675,49 @@ PollOutStage::handle_connection(Poller& poller, Connection* conn,
         conn->active_close();
         cleanup_connection(poller, conn);
     } else {
-        update_connection(poller, conn, boost::bind(
-                              &PollOutStage::cleanup_idle_connection_callback,
-                              this, boost::ref(poller), _1));
+        update_connection(poller, conn);
         OutputStream& out = conn->out_stream();
         int nwrite = 0;
         bool has_error = false;
         do {
-            int rs = out.write_into_output();
+            int rs = poller.write_output(conn->fd(), out);
             if (rs <= 0) {
                 nwrite = rs;
                 break;
             }
             nwrite += rs;
-        } while (nwrite < kMaxWriteThreshold);
+            // a draining handler resumes before the next write is submitted
+        } while (nwrite < kMaxWriteThreshold
+                 && !(conn->is_draining()
+                      && out.memory_usage() <= Response::kResumeMemorySizes));
 
         if (nwrite < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
             has_error = true;
         }
 
+        if (conn->is_draining() && !has_error
+            && out.memory_usage() <= Response::kResumeMemorySizes
+            && !poller.is_writing(conn->fd())) {
+            // below the low-water mark, let the handler write more
+            conn->set_draining(false);
+            {
+                utils::Lock lk(mutex_);
+                poller.timer().cancel(&conn->timer_node());
+            }
+            conn->resched_continuation();
+            return;
+        }
+
         if (out.is_done() || has_error) {
             conn->clear_cork();
+            {
+                // off this timer before poll in stage may schedule the node
+                utils::Lock lk(mutex_);
+                poller.timer().cancel(&conn->timer_node());
+            }
 
             if (conn->has_continuation()) {
-                utils::Lock lk(mutex_);
-                poller.remove_fd(conn->fd());
-                poller.timer().remove(conn->timer_sched_time(), conn);
+                conn->set_draining(false);
                 conn->resched_continuation();
                 return;
             }
@@ -453,11 +728,22 @@ PollOutStage::handle_connection(Poller& poller, Connection* conn,
             } else {
                 pipeline_.enable_poll(conn);
             }
+            conn->unlock();
+        } else if (!poller.change_fd(conn->fd(), conn, kWriteEvents)) {
+            // the one-shot registration can't wait for the rest
+            conn->clear_cork();
+            conn->active_close();
             cleanup_connection(poller, conn);
         }
     }
 }
 
+void
+PollOutStage::post_handle_connection(Poller& poller)
+{
+    trigger_timer_callback(poller);
+}
+
 void
 PollOutStage::main_loop()
 {
@@ -466,8 +752,11 @@ PollOutStage::main_loop()
         boost::bind(&PollOutStage::handle_connection, this, boost::ref(*poller),
                     _1, _2);
     Poller::PollerCallback posthdl =
-        boost::bind(&PollOutStage::trigger_timer_callback, this,
+        boost::bind(&PollOutStage::post_handle_connection, this,
                     boost::ref(*poller));
+    poller->timer().set_handler(
+        boost::bind(&PollOutStage::cleanup_idle_connection_callback, this,
+                    boost::ref(*poller), _1));
     poller->set_post_handler(posthdl);
     poller->set_event_handler(evthdl);
     add_poll(poller);
@@ -475,10 +764,77 @@ PollOutStage::main_loop()
     delete poller;
 }
 
+int HybridOutStage::kMaxBlockRtt = 1000;
+
+int HybridOutStage::kMaxBlockTime = 10;
+
+int HybridOutStage::kSlowPenalty = 5000;
+
+HybridOutStage::HybridOutStage()
+    : nr_blocked_(0), nr_polled_(0), nr_stalled_(0)
+{
+    poll_stage_ = new PollOutStage("write_back_poll");
+}
+
+HybridOutStage::~HybridOutStage()
+{
+    delete poll_stage_;
+}
+
+bool
+HybridOutStage::is_fast_client(Connection* conn)
+{
+    if (Timer::current_msec() < conn->slow_until()) {
+        return false;
+    }
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(conn->fd(), IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return false; // not TCP, we don't know
+    }
+    return info.tcpi_rtt <= (u32) kMaxBlockRtt && info.tcpi_retransmits == 0
+        && info.tcpi_unacked < info.tcpi_snd_cwnd;
+#else
+    return false;
+#endif
+}
+
+bool
+HybridOutStage::sched_add(Connection* conn)
+{
+    if (is_fast_client(conn)) {
+        atomic_add(&nr_blocked_, 1L);
+        return BlockOutStage::sched_add(conn);
+    }
+    atomic_add(&nr_polled_, 1L);
+    return poll_stage_->sched_add(conn);
+}
+
+int
+HybridOutStage::process_task(Connection* conn)
+{
+    OutputStream& out = conn->out_stream();
+    u64 start = Timer::current_msec();
+    int rs = out.write_into_output();
+    u64 now = Timer::current_msec();
+    // the send timeout expired, or the client is draining slowly
+    bool stalled = (rs < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        || (rs > 0 && now - start > (u64) kMaxBlockTime);
+    if (stalled && !out.is_done()) {
+        atomic_add(&nr_stalled_, 1L);
+        conn->set_slow_until(now + kSlowPenalty);
+        utils::set_socket_blocking(conn->fd(), false);
+        poll_stage_->sched_add(conn);
+        return kStageKeepLock;
+    }
+    return finish_write(conn, rs);
+}
+
 ParserStage::ParserStage()
     : Stage("parser")
 {
-    sched_ = new QueueScheduler();
+    sched_ = SchedulerFactory::instance().create_scheduler("parser");
 }
 
 ParserStage::~ParserStage()
@@ -486,4 +842,16 @@ ParserStage::~ParserStage()
     delete sched_;
 }
 
+void
+ParserStage::sched_add_batch(const Scheduler::ConnectionList& conns)
+{
+    sched_->add_task_batch(conns);
+}
+
+void
+ParserStage::sched_add_locked_batch(const Scheduler::ConnectionList& conns)
+{
+    sched_->add_locked_task_batch(conns);
+}
+
 }
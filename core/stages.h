@@ -27,11 +27,17 @@ namespace tube {
 class Stage
 {
 protected:
+    std::string name_;
     Scheduler* sched_;
     Pipeline&  pipeline_;
     size_t     thread_pool_size_;
+    volatile long next_shard_;
 protected:
     virtual int process_task(Connection* conn) { return 0; };
+    /**
+     * Entry of stage threads, shard is -1 if the pipeline isn't sharded.
+     */
+    void thread_main(int shard);
 public:
     static const int kStageReleaseLock = 0;
     static const int kStageKeepLock = -1;
@@ -53,6 +59,22 @@ public:
      * @param conn Connection object to be added.
      */
     virtual bool sched_add(Connection* conn);
+    /**
+     * Add several connections to stage's internal scheduler at once.  Default
+     * implementation calls sched_add() for each connection, stages which add
+     * connections to the scheduler as is could pass the batch to
+     * Scheduler::add_task_batch() instead.
+     * @param conns Connection objects to be added.
+     */
+    virtual void sched_add_batch(const Scheduler::ConnectionList& conns);
+    /**
+     * Add several connections locked by the caller, the locks are handed
+     * over.  Default implementation calls sched_add_batch() then unlocks
+     * them.
+     * @param conns Connection objects to be added.
+     */
+    virtual void sched_add_locked_batch(
+        const Scheduler::ConnectionList& conns);
     /**
      * Remove the connection from stage's interan scheduler.
      * @param conn Connection object to be removed.
@@ -67,19 +89,46 @@ public:
      * Main loop of thread routine.
      */
     virtual void main_loop();
+    /**
+     * Process a locked connection picked from the scheduler, and release the
+     * lock if process_task() tells so.
+     */
+    void execute_task(Connection* conn);
+    /**
+     * Process a locked connection on the calling thread rather than
+     * scheduling it on this stage.  Used for running small requests to
+     * completion on the poll_in thread.
+     * @return False if the stage doesn't support it, and the caller should
+     * schedule the connection as usual.  Otherwise the lock is either
+     * released or handed over to other stages.
+     */
+    virtual bool process_inline(Connection* conn) { return false; }
 
+    const std::string& name() const { return name_; }
     size_t     thread_pool_size() const { return thread_pool_size_; }
     Scheduler* scheduler() const { return sched_; }
     void       set_thread_pool_size(size_t size) { thread_pool_size_ = size; }
 
     /**
-     * Start a single thread
+     * Start a single thread.  Under sharded mode, the thread is bound to a
+     * shard in round-robin manner.
      */
     virtual utils::ThreadId start_thread();
     /**
-     * Start all threads in the thread pool.
+     * Start all threads in the thread pool.  Under sharded mode, thread pool
+     * size is per shard.  Stages using the shared executor don't have thread
+     * pools.
      */
     virtual void start_thread_pool();
+
+    /**
+     * Attach a Controller, which adds or retires threads to keep the stage's
+     * latency around the target.  Only stages with a scheduler and their own
+     * thread pool support it.  Should be called before start_thread_pool().
+     * @param target_latency Target latency in microseconds.
+     * @return False if the stage doesn't support it.
+     */
+    bool enable_auto_tuning(long target_latency);
 };
 
 class PollStage : public Stage
@@ -91,10 +140,28 @@ protected:
     virtual ~PollStage() {}
 
     void add_poll(Poller* poller);
+    Poller& pick_poller(Connection* conn);
+    /**
+     * Poller the connection is registered with, NULL if none.  mutex_ must be
+     * held.
+     */
+    Poller*& registered_poller(Connection* conn) {
+        return registered_[conn->fd()];
+    }
     void trigger_timer_callback(Poller& poller);
-    void update_connection(Poller& poller, Connection* conn,
-                           Timer::Callback cb);
+    void update_connection(Poller& poller, Connection* conn);
+    /**
+     * Schedule the idle timeout of the connection.  mutex_ must be held.
+     */
+    void schedule_idle_timeout(Poller& poller, Connection* conn);
 public:
+    /**
+     * Name of the IO poller, empty for the platform's default.
+     */
+    static std::string kPollerName;
+
+    virtual void initialize();
+
     int timeout() const { return timeout_; }
     /**
      * Set maximum blocking time for IO poller, this is also the time grand
@@ -104,11 +171,15 @@ public:
     void set_timeout(int timeout) { timeout_ = timeout; }
 
 protected:
-    utils::Mutex         mutex_;
-    std::vector<Poller*> pollers_;
-    int                  timeout_;
-    size_t               current_poller_;
-    std::string          poller_name_;
+    typedef std::vector<Poller*> PollerList;
+
+    utils::Mutex            mutex_;
+    PollerList              pollers_;
+    std::vector<PollerList> shard_pollers_;
+    PollerList              registered_; // indexed by fd
+    int                     timeout_;
+    size_t                  current_poller_;
+    std::string             poller_name_;
 };
 
 /**
@@ -118,34 +189,75 @@ protected:
  * IO poller on most OS have a timeout parameter, which specify the longest
  * blocking time for a poll() call.  In PollInStage, it can be tuned by calling
  * set_timeout() method.
+ *
+ * A connection stays registered with the same poller until it's cleaned up.
+ * Disabling the poll only marks it, without any system call.  If an event
+ * arrives while it's disabled, the fd is parked: re-registered as one-shot
+ * with no interest, and re-armed when the poll is enabled again.
  */
 class PollInStage : public PollStage
 {
+    typedef Scheduler::ConnectionList ConnectionList;
+
+    enum PollState {
+        kPollEnabled = 0,
+        kPollDisabled,
+        kPollParked
+    };
+
     Stage* parser_stage_;
+    std::vector<u8> poll_states_; // indexed by fd, guarded by mutex_
 public:
-    static size_t kMaxRecycleCount;
+    /**
+     * Run small requests to completion on the poll_in thread, instead of
+     * passing them through the parser and handler stages.
+     */
+    static bool   kRunToCompletion;
+    /**
+     * Largest input (in bytes) that is run to completion.
+     */
+    static size_t kMaxInlineInputSize;
     PollInStage();
     ~PollInStage();
 
     virtual bool sched_add(Connection* conn);
+    /**
+     * Add newly accepted connections to IO pollers, taking the lock once.
+     */
+    virtual void sched_add_batch(const ConnectionList& conns);
     virtual void sched_remove(Connection* conn);
 
+    /**
+     * Stop reading the connection, e.g. while it's written back.  The
+     * connection stays registered.
+     */
+    void disable_poll(Connection* conn);
+    /**
+     * Resume reading the connection, it's added if it's not registered.
+     */
+    void enable_poll(Connection* conn);
+
     virtual void initialize();
     virtual void main_loop();
 
     /**
      * Clean up unused connection.  It remove its file descriptor from IO poller
-     * and schedule it on the recycle stage for resource collection.
+     * and retires it on the pipeline for resource collection.
      */
     void cleanup_connection(Connection* conn);
 private:
     static int kMaxReadThreshold;
+    bool sched_add_nolock(Connection* conn);
     void sched_remove_nolock(Connection* conn, bool recycle);
+    bool park_connection(Connection* conn);
     void cleanup_connection(Poller& poller, Connection* conn);
-    void read_connection(Poller& poller, Connection* conn);
+    void read_connection(Poller& poller, ConnectionList& ready,
+                         Connection* conn);
+    void flush_ready_connections(ConnectionList& ready);
     bool cleanup_idle_connection_callback(Poller& poller, void* ptr);
-    void handle_connection(Poller& poller, Connection* conn, PollerEvent evt);
-    void post_handle_connection(Poller& poller);
+    void handle_connection(Poller& poller, ConnectionList& ready,
+                           Connection* conn, PollerEvent evt);
+    void post_handle_connection(Poller& poller, ConnectionList& ready);
 };
 
 /**
@@ -162,20 +274,32 @@ public:
 
     virtual bool sched_add(Connection* conn);
     virtual int  process_task(Connection* conn);
+protected:
+    /**
+     * Reschedule the connection if it has more to write, or finish the
+     * write back.
+     * @param rs Result of the last write.
+     */
+    int finish_write(Connection* conn, int rs);
 };
 
 /**
  * PollOutStage is an alternative to BlockOutStage by using IO polling.  Compare
  * to BlockOutStage, it's has very subtle system call overhead, but fair on slow
  * connections.
+ *
+ * A connection is registered as one-shot with the same poller on its first
+ * write back, and only re-armed after that.  The registration is removed when
+ * the connection is disposed.
  */
 class PollOutStage : public PollStage
 {
 public:
-    PollOutStage();
+    PollOutStage(const std::string& name = "write_back");
     virtual ~PollOutStage();
 
     virtual bool sched_add(Connection* conn);
+    virtual void sched_remove(Connection* conn);
     virtual void main_loop();
 private:
     static int kMaxWriteThreshold;
@@ -185,6 +309,55 @@ private:
     bool cleanup_idle_connection_callback(Poller& poller, void* ptr);
 };
 
+/**
+ * HybridOutStage picks blocking or polled writes for each connection.
+ *
+ * Clients which look fast from TCP_INFO, with a small RTT, no retransmission
+ * and room in the congestion window, are written back with blocking writes
+ * like BlockOutStage, which cost less system calls.  Other clients go to a
+ * PollOutStage, so they don't hold a thread.  A blocking write which stalls
+ * moves the rest of the response to polled writes, and the client is polled
+ * for kSlowPenalty milliseconds before it's classified again.
+ */
+class HybridOutStage : public BlockOutStage
+{
+public:
+    /**
+     * Largest RTT in microseconds for blocking writes.
+     */
+    static int kMaxBlockRtt;
+    /**
+     * Longest time in milliseconds a blocking write may take before the
+     * connection moves to polled writes.
+     */
+    static int kMaxBlockTime;
+    /**
+     * Time in milliseconds a stalled client stays on polled writes.
+     */
+    static int kSlowPenalty;
+
+    HybridOutStage();
+    virtual ~HybridOutStage();
+
+    virtual bool sched_add(Connection* conn);
+    virtual int  process_task(Connection* conn);
+
+    /**
+     * Number of write backs started with blocking and polled writes, and
+     * of connections moved from blocking to polled writes.
+     */
+    long nr_blocked() const { return nr_blocked_; }
+    long nr_polled() const { return nr_polled_; }
+    long nr_stalled() const { return nr_stalled_; }
+private:
+    PollOutStage* poll_stage_;
+    volatile long nr_blocked_;
+    volatile long nr_polled_;
+    volatile long nr_stalled_;
+
+    bool is_fast_client(Connection* conn);
+};
+
 /**
  * ParserStage is used to process buffer read from client.  Server wish to
  * write a protocol parser should inheritance this class.
@@ -194,6 +367,10 @@ class ParserStage : public Stage
 public:
     ParserStage();
     virtual ~ParserStage();
+
+    virtual void sched_add_batch(const Scheduler::ConnectionList& conns);
+    virtual void sched_add_locked_batch(
+        const Scheduler::ConnectionList& conns);
 };
 
 
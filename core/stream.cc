@@ -1,5 +1,10 @@
 #include "pch.h"
 
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include "core/stream.h"
 #include "core/filesender.h"
 #include "utils/exception.h"
@@ -20,48 +25,153 @@ InputStream::close()
 }
 
 OutputStream::OutputStream(int fd)
-    : fd_(fd), memory_usage_(0)
+    : fd_(fd), memory_usage_(0), nr_ungathered_(0)
 {
 }
 
 OutputStream::~OutputStream()
+{
+    reset(-1);
+}
+
+void
+OutputStream::reset(int fd)
 {
     for (std::list<Writeable*>::iterator it = writeables_.begin();
          it != writeables_.end(); ++it) {
         delete *it;
     }
     writeables_.clear();
+    memory_usage_ = 0;
+    nr_ungathered_ = 0;
+    fd_ = fd;
+}
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static ssize_t
+write_iovecs(int fd, struct iovec* vec, size_t nvec, bool more)
+{
+#ifdef MSG_MORE
+    if (more) {
+        // hold the tail in the socket until the rest, e.g. a sendfile(), is
+        // written
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = nvec;
+        ssize_t res = sendmsg(fd, &msg, MSG_MORE);
+        if (res >= 0 || errno != ENOTSOCK) {
+            return res;
+        }
+    }
+#endif
+    return writev(fd, vec, nvec);
+}
+
+void
+OutputStream::push_writeable(Writeable* writeable)
+{
+    writeables_.push_back(writeable);
+    memory_usage_ += writeable->memory_usage();
+    if (!writeable->in_memory()) {
+        nr_ungathered_++;
+    }
+}
+
+void
+OutputStream::pop_done_writeables()
+{
+    while (!writeables_.empty() && writeables_.front()->eof()) {
+        Writeable* writeable = writeables_.front();
+        memory_usage_ -= writeable->memory_usage();
+        if (!writeable->in_memory()) {
+            nr_ungathered_--;
+        }
+        delete writeable;
+        writeables_.pop_front();
+    }
 }
 
 ssize_t
 OutputStream::write_into_output()
 {
+    pop_done_writeables();
     if (writeables_.empty()) {
         return 0;
     }
-    Writeable* writeable = writeables_.front();
-    size_t mem_use = writeable->memory_usage();
-    ssize_t res = writeable->write_to_fd(fd_);
-    memory_usage_ -= mem_use - writeable->memory_usage();
-    if (writeable->eof()) {
-        writeables_.pop_front();
-        delete writeable;
+    // gather the writeables in memory, across responses, until one that
+    // isn't
+    struct iovec vec[Buffer::kMaxIovecs];
+    size_t nvec = 0;
+    std::list<Writeable*>::iterator it = writeables_.begin();
+    for (; it != writeables_.end() && nvec < Buffer::kMaxIovecs; ++it) {
+        size_t n = (*it)->fill_iovecs(vec + nvec, Buffer::kMaxIovecs - nvec);
+        if (n == 0 && !(*it)->eof()) {
+            break;
+        }
+        nvec += n;
+    }
+
+    if (nvec == 0) {
+        Writeable* writeable = writeables_.front();
+        size_t mem_use = writeable->memory_usage();
+        ssize_t res = writeable->write_to_fd(fd_);
+        memory_usage_ -= mem_use - writeable->memory_usage();
+        pop_done_writeables();
+        return res;
+    }
+
+    ssize_t res = write_iovecs(fd_, vec, nvec, it != writeables_.end());
+    if (res > 0) {
+        consume(res);
     }
     return res;
 }
 
+bool
+OutputStream::share_front(Buffer& buf, size_t max_pages)
+{
+    pop_done_writeables();
+    std::list<Writeable*>::iterator it = writeables_.begin();
+    for (; it != writeables_.end() && buf.page_count() < max_pages; ++it) {
+        if (!(*it)->in_memory()) {
+            if ((*it)->eof()) {
+                continue;
+            }
+            return true;
+        }
+        (*it)->copy_to(buf);
+    }
+    return false;
+}
+
+void
+OutputStream::consume(size_t size)
+{
+    while (size > 0) {
+        Writeable* writeable = writeables_.front();
+        size_t n = MIN(size, writeable->size());
+        size_t mem_use = writeable->memory_usage();
+        writeable->consume(n);
+        memory_usage_ -= mem_use - writeable->memory_usage();
+        size -= n;
+        pop_done_writeables();
+    }
+}
+
 void
 OutputStream::append_data(const byte* data, size_t size)
 {
     if (writeables_.empty()) {
-        writeables_.push_back(new Buffer());
+        push_writeable(new Buffer());
     }
     Writeable* writeable = writeables_.back();
     if (!writeable->append(data, size)) {
         // create a buffer object and push back into the list
         Writeable* buffer = new Buffer();
+        push_writeable(buffer);
         buffer->append(data, size);
-        writeables_.push_back(buffer);
     }
     memory_usage_ += size;
 }
@@ -70,7 +180,7 @@ off64_t
 OutputStream::append_file(int file_desc, off64_t offset, off64_t length)
 {
     Writeable* filesender = new FileSender(file_desc, offset, length);
-    writeables_.push_back(filesender);
+    push_writeable(filesender);
     return filesender->size();
 }
 
@@ -79,14 +189,14 @@ size_t
 OutputStream::append_buffer(const Buffer& buf)
 {
     Writeable* buffer = new Buffer(buf);
-    writeables_.push_back(buffer);
+    push_writeable(buffer);
     return buffer->size();
 }
 
 size_t
 OutputStream::append_writeable(Writeable* writeable)
 {
-    writeables_.push_back(writeable);
+    push_writeable(writeable);
     return writeable->size();
 }
 
@@ -31,6 +31,11 @@ public:
      * Clear the content of the stream.
      */
     void    close();
+    /**
+     * Clear the content and attach the stream to another file descriptor.
+     * Pages of the buffer are kept for reuse.
+     */
+    void    reset(int fd) { buffer_.clear(); fd_ = fd; }
 
 private:
     Buffer buffer_;
@@ -51,10 +56,24 @@ public:
     virtual ~OutputStream();
 
     /**
-     * Write data into file descriptor.
+     * Write data into file descriptor.  Writeables in memory are gathered
+     * into one system call, with MSG_MORE if a file follows them.
      * @return Number of bytes wrote.
      */
     ssize_t write_into_output();
+    /**
+     * Share the data of the writeables in memory at the front of the stream
+     * with a buffer, for writes which finish later, e.g. submitted to
+     * io_uring.  The buffer keeps the pages whatever happens to the stream
+     * meanwhile.
+     * @param max_pages Pages to stop sharing at.
+     * @return True if a writeable which isn't in memory follows.
+     */
+    bool    share_front(Buffer& buf, size_t max_pages);
+    /**
+     * Erase the first bytes, written from share_front().
+     */
+    void    consume(size_t size);
     /**
      * Append data at the back of the stream.
      * @param data Pointer points to data
@@ -82,10 +101,20 @@ public:
      */
     size_t  append_writeable(Writeable* ptr);
 
+    /**
+     * Free all writeables and attach the stream to another file descriptor.
+     */
+    void    reset(int fd);
+
     /**
      * @return True if stream is empty.
      */
     bool    is_done() const { return writeables_.empty(); }
+    /**
+     * @return True if all writeables are in memory, so the stream is written
+     * in gathered writes, which don't need TCP_CORK.
+     */
+    bool    in_memory() const { return nr_ungathered_ == 0; }
     /**
      * @return Memory usage of whole stream.
      */
@@ -95,6 +124,10 @@ private:
     std::list<Writeable*> writeables_;
     int                   fd_;
     size_t                memory_usage_;
+    size_t                nr_ungathered_; // writeables not in memory
+
+    void push_writeable(Writeable* writeable);
+    void pop_done_writeables();
 };
 
 }
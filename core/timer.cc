@@ -1,24 +1,11 @@
 #include "pch.h"
 
+#include <boost/bind.hpp>
+
 #include "core/timer.h"
 
 namespace tube {
 
-// class TimerLock
-// {
-//     utils::Mutex& mutex_;
-//     bool          nolock_;
-// public:
-//     TimerLock(utils::Mutex& mutex, bool nolock)
-//         : mutex_(mutex), nolock_(nolock) {
-//         if (!nolock_) mutex_.lock();
-//     }
-//
-//     ~TimerLock() {
-//         if (!nolock_) mutex_.unlock();
-//     }
-// };
-
 bool
 Timer::TimerKey::operator<(const TimerKey& rhs) const
 {
@@ -33,6 +20,7 @@ Timer::TimerKey::operator==(const TimerKey& rhs) const
 }
 
 int Timer::kUnitGran = 2; // 2 seconds
+int Timer::kRetryInterval = 1000; // 1 second
 
 Timer::Unit
 Timer::current_timer_unit()
@@ -41,86 +29,247 @@ Timer::current_timer_unit()
 }
 
 Timer::Timer()
-    : last_executed_(current_timer_unit())
+    : current_(current_msec()), size_(0)
+{
+    for (size_t i = 0; i < sizeof(wheel_) / sizeof(wheel_[0]); i++) {
+        wheel_[i].prev = wheel_[i].next = &wheel_[i];
+    }
+    keyed_handler_ = boost::bind(&Timer::invoke_keyed, this, _1);
+}
+
+Timer::~Timer()
+{
+    for (size_t i = 0; i < sizeof(wheel_) / sizeof(wheel_[0]); i++) {
+        TimerNode* head = &wheel_[i];
+        while (head->next != head) {
+            unlink(head->next);
+        }
+    }
+    for (KeyedMap::iterator it = keyed_.begin(); it != keyed_.end(); ++it) {
+        delete it->second;
+    }
+}
+
+void
+Timer::link(TimerNode* node)
 {
+    u64 expire = node->expire;
+    if (expire < current_) {
+        expire = current_; // overdue, expire on next tick
+    }
+    u64 delta = expire - current_;
+    TimerNode* head = NULL;
+    if (delta < (u64) kRootSize) {
+        head = &wheel_[expire & (kRootSize - 1)];
+    } else {
+        int level = 1;
+        while (level < kLevels - 1
+               && delta >= (1ULL << (kRootBits + level * kLevelBits))) {
+            level++;
+        }
+        u64 max_delta = 1ULL << (kRootBits + level * kLevelBits);
+        if (delta >= max_delta) {
+            // too far away, park it on the last slot it can reach, it will
+            // be cascaded into the same wheel again
+            expire = current_ + max_delta - 1;
+        }
+        int shift = kRootBits + (level - 1) * kLevelBits;
+        head = &wheel_[kRootSize + (level - 1) * kLevelSize
+                       + ((expire >> shift) & (kLevelSize - 1))];
+    }
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void
+Timer::unlink(TimerNode* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    node->timer = NULL;
+    size_--;
+}
+
+int
+Timer::cascade(int level)
+{
+    int idx = (current_ >> (kRootBits + (level - 1) * kLevelBits))
+        & (kLevelSize - 1);
+    TimerNode* head = &wheel_[kRootSize + (level - 1) * kLevelSize + idx];
+    TimerNode* node = head->next;
+    head->prev = head->next = head;
+    while (node != head) {
+        TimerNode* next = node->next;
+        link(node);
+        node = next;
+    }
+    return idx;
+}
+
+void
+Timer::schedule(TimerNode* node, u64 expire)
+{
+    if (node->timer == this) {
+        unlink(node);
+    } else if (node->timer) {
+        node->timer->cancel(node);
+    }
+    node->expire = expire;
+    node->timer = this;
+    link(node);
+    size_++;
 }
 
 bool
-Timer::set(Timer::Unit unit, Timer::Context ctx, const Timer::Callback& call)
+Timer::cancel(TimerNode* node)
 {
-    // TimerLock lk(mutex_, nolock_);
-    TimerKey key(unit, ctx);
-    if (rbtree_.find(key) != rbtree_.end()) {
+    if (node->timer != this) {
         return false;
     }
-    rbtree_.insert(std::make_pair(key, call));
+    unlink(node);
     return true;
 }
 
 void
-Timer::replace(Timer::Unit unit, Timer::Context ctx,
-               const Timer::Callback& call)
+Timer::expire(TimerNode* node)
+{
+    const Callback& call = node->call ? *node->call : handler_;
+    if (call.empty() || call(node->ctx)) {
+        // the node may be gone already
+        return;
+    }
+    if (!node->is_scheduled()) {
+        schedule_after(node, kRetryInterval);
+    }
+}
+
+void
+Timer::process_callbacks()
 {
-    // utils::Lock lk(mutex_);
-    rbtree_.insert(std::make_pair(TimerKey(unit, ctx), call));
+    u64 now = current_msec();
+    TimerNode pending;
+    while (current_ <= now) {
+        int idx = current_ & (kRootSize - 1);
+        if (idx == 0) {
+            for (int level = 1; level < kLevels && cascade(level) == 0;
+                 level++) {}
+        }
+        TimerNode* head = &wheel_[idx];
+        current_++;
+        if (head->next == head) {
+            continue;
+        }
+        // move the slot away, nodes re-scheduled by callbacks as overdue go
+        // to the next tick
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->prev = head->next = head;
+        while (pending.next != &pending) {
+            TimerNode* node = pending.next;
+            unlink(node);
+            expire(node);
+        }
+    }
 }
 
 bool
-Timer::remove(Timer::Unit unit, Timer::Context ctx)
+Timer::invoke_keyed(Context ptr)
 {
-    // TimerLock lk(mutex_, nolock_);
-    TimerTree::iterator it = rbtree_.find(TimerKey(unit, ctx));
-    if (it == rbtree_.end()) {
+    KeyedNode* node = (KeyedNode*) ptr;
+    if (!node->callback(node->key_ctx)) {
         return false;
     }
-    rbtree_.erase(it);
+    keyed_.erase(TimerKey(node->unit, node->key_ctx));
+    delete node;
     return true;
 }
 
+u64
+Timer::msec_from_unit(Unit unit)
+{
+    u64 now = current_msec();
+    Unit current_unit = current_timer_unit();
+    if (unit <= current_unit) {
+        return now;
+    }
+    return now + (u64) (unit - current_unit) * kUnitGran * 1000;
+}
+
+void
+Timer::add_keyed(Unit unit, Context ctx, const Callback& call)
+{
+    KeyedNode* node = new KeyedNode();
+    node->unit = unit;
+    node->key_ctx = ctx;
+    node->callback = call;
+    node->ctx = node;
+    node->call = &keyed_handler_;
+    keyed_.insert(std::make_pair(TimerKey(unit, ctx), node));
+    schedule(node, msec_from_unit(unit));
+}
+
 bool
-Timer::query(Unit unit, Context ctx, Callback& call)
+Timer::set(Timer::Unit unit, Timer::Context ctx, const Timer::Callback& call)
 {
-    // TimerLock lk(mutex_, nolock_);
-    TimerTree::iterator it = rbtree_.find(TimerKey(unit, ctx));
-    if (it == rbtree_.end()) {
+    if (keyed_.find(TimerKey(unit, ctx)) != keyed_.end()) {
         return false;
     }
-    call = it->second;
+    add_keyed(unit, ctx, call);
     return true;
 }
 
-bool
-Timer::invoke_callback(TimerTree::iterator it)
+void
+Timer::replace(Timer::Unit unit, Timer::Context ctx,
+               const Timer::Callback& call)
 {
-    return it->second(it->first.ctx);
+    KeyedMap::iterator it = keyed_.find(TimerKey(unit, ctx));
+    if (it == keyed_.end()) {
+        add_keyed(unit, ctx, call);
+        return;
+    }
+    it->second->callback = call;
 }
 
-void
-Timer::process_callbacks()
+bool
+Timer::remove(Timer::Unit unit, Timer::Context ctx)
 {
-    Unit current_unit = current_timer_unit();
-    std::vector<TimerTree::iterator> garbage;
-    // utils::Lock lk(mutex_);
-    // nolock_ = true;
-    for (TimerTree::iterator it = rbtree_.begin(); it != rbtree_.end(); ++it) {
-        if (it->first.unit > current_unit) {
-            break;
-        }
-        if (invoke_callback(it)) {
-            garbage.push_back(it);
-        }
+    KeyedMap::iterator it = keyed_.find(TimerKey(unit, ctx));
+    if (it == keyed_.end()) {
+        return false;
     }
-    for (size_t i = 0; i < garbage.size(); i++) {
-        rbtree_.erase(garbage[i]);
+    KeyedNode* node = it->second;
+    keyed_.erase(it);
+    cancel(node);
+    delete node;
+    return true;
+}
+
+bool
+Timer::query(Unit unit, Context ctx, Callback& call)
+{
+    KeyedMap::iterator it = keyed_.find(TimerKey(unit, ctx));
+    if (it == keyed_.end()) {
+        return false;
     }
-    // nolock_ = false;
+    call = it->second->callback;
+    return true;
 }
 
 void
 Timer::dump_all() const
 {
-    for (TimerTree::const_iterator it = rbtree_.begin(); it != rbtree_.end(); ++it) {
-        fprintf(stderr, "timer obj: %d %p\n", it->first.unit, it->first.ctx);
+    for (size_t i = 0; i < sizeof(wheel_) / sizeof(wheel_[0]); i++) {
+        const TimerNode* head = &wheel_[i];
+        for (const TimerNode* node = head->next; node != head;
+             node = node->next) {
+            fprintf(stderr, "timer obj: %llu %p\n",
+                    (unsigned long long) node->expire, node->ctx);
+        }
     }
 }
 
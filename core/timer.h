@@ -11,9 +11,39 @@
 
 namespace tube {
 
+class Timer;
+
+/**
+ * Intrusive timer entry, embedded in the object being timed, so scheduling it
+ * doesn't allocate.  A node is on at most one Timer at a time.
+ */
+struct TimerNode
+{
+    TimerNode* prev;
+    TimerNode* next;
+    Timer*     timer;  // the Timer it's scheduled on, NULL if not scheduled
+    u64        expire; // in milliseconds, see Timer::current_msec()
+    void*      ctx;    // passed to the callback
+    // callback of this node, NULL for the handler of the Timer
+    const boost::function<bool (void*)>* call;
+
+    TimerNode() : prev(NULL), next(NULL), timer(NULL), expire(0), ctx(NULL),
+                  call(NULL) {}
+
+    bool is_scheduled() const { return timer != NULL; }
+};
+
 /**
- * Timer object are used for schedule a callback at a certain time.  Timer have
- * a different granularity than second, which is defined as Time::Unit.
+ * Timer object are used for schedule a callback at a certain time.
+ *
+ * It's a hierarchical timing wheel with millisecond resolution.  Scheduling,
+ * re-scheduling and canceling a TimerNode are O(1).  Nodes expiring within
+ * 256ms are kept on the finest wheel, later ones on coarser wheels, and
+ * cascaded to finer wheels as the time goes by.
+ *
+ * The older interface keyed by (Time::Unit, Context) is kept for code which
+ * doesn't embed a TimerNode, it allocates a node for each callback.  Time::Unit
+ * has a different granularity than second.
  *
  * Timer is not thread safe.
  */
@@ -22,14 +52,44 @@ class Timer
 public:
     typedef time_t Unit;
     typedef void* Context;
+    /**
+     * Returning false means the callback should be retried later.
+     */
     typedef boost::function<bool (Context)> Callback;
 
     /**
      * Granularity of the timer.
      */
     static int kUnitGran;
+    /**
+     * Delay in milliseconds before retrying a callback which returned false.
+     */
+    static int kRetryInterval;
 
     Timer();
+    ~Timer();
+
+    /**
+     * Set the callback for nodes which don't have their own.
+     */
+    void set_handler(const Callback& call) { handler_ = call; }
+    /**
+     * Schedule the node, or re-schedule it if it's scheduled already.
+     * @param node The node, it's removed from another Timer first.
+     * @param expire Time in milliseconds, see current_msec().
+     */
+    void schedule(TimerNode* node, u64 expire);
+    /**
+     * Schedule the node after some time from now.
+     */
+    void schedule_after(TimerNode* node, u64 msec) {
+        schedule(node, current_msec() + msec);
+    }
+    /**
+     * Cancel the node.
+     * @return True if the node was scheduled on this Timer.
+     */
+    bool cancel(TimerNode* node);
 
     /**
      * Set a callback that will be executed at time unit.
@@ -75,23 +135,34 @@ public:
      * Transform system time to Time::Unit.
      */
     static Unit timer_unit_from_time(time_t t) { return t / kUnitGran; }
-
-    /**
-     * A timestamp that mark the last time processing callbacks.
-     */
-    Unit last_executed_time() { return last_executed_; }
     /**
-     * Set the timestamp for the last time processing callbacks.
+     * Current time in milliseconds, from a monotonic clock.
      */
-    void set_last_executed_time(Unit last_executed) {
-        last_executed_ = last_executed;
-    }
+    static u64  current_msec() { return utils::monotonic_usec() / 1000; }
 
-    size_t size() const { return rbtree_.size(); }
+    size_t size() const { return size_; }
 
     void dump_all() const;
 
 private:
+    static const int kLevels = 5;
+    static const int kRootBits = 8;  // 256 slots of 1ms
+    static const int kLevelBits = 6; // 64 slots of each coarser wheel
+    static const int kRootSize = 1 << kRootBits;
+    static const int kLevelSize = 1 << kLevelBits;
+
+    // list heads, the root wheel followed by the coarser ones
+    TimerNode wheel_[kRootSize + (kLevels - 1) * kLevelSize];
+    u64       current_; // next millisecond to process
+    size_t    size_;
+    Callback  handler_;
+
+    // nodes of the keyed interface, ctx of the node points to itself
+    struct KeyedNode : public TimerNode {
+        Unit     unit;
+        Context  key_ctx;
+        Callback callback;
+    };
     struct TimerKey {
         Unit unit;
         Context ctx;
@@ -100,14 +171,18 @@ private:
         TimerKey(Unit timerunit, Context context)
             : unit(timerunit), ctx(context) {}
     };
-    typedef std::map<TimerKey, Callback> TimerTree;
-
-    TimerTree    rbtree_;
-    Unit         last_executed_;
-    // utils::Mutex mutex_;
-    // bool         nolock_;
-
-    bool invoke_callback(TimerTree::iterator it);
+    typedef std::map<TimerKey, KeyedNode*> KeyedMap;
+
+    KeyedMap keyed_;
+    Callback keyed_handler_;
+
+    void link(TimerNode* node);
+    void unlink(TimerNode* node);
+    int  cascade(int level);
+    void expire(TimerNode* node);
+    bool invoke_keyed(Context ptr);
+    void add_keyed(Unit unit, Context ctx, const Callback& call);
+    static u64 msec_from_unit(Unit unit);
 };
 
 }
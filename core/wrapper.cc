@@ -1,6 +1,7 @@
 #include "pch.h"
 
 #include <cstdio>
+#include <cerrno>
 
 #include "core/stages.h"
 #include "core/wrapper.h"
@@ -44,15 +45,22 @@ Request::read_data(byte* ptr, size_t sz)
 
 size_t Response::kMaxMemorySizes = (4 << 20);
 
+size_t Response::kResumeMemorySizes = (1 << 20);
+
 Response::Response(Connection* conn)
-    : Wrapper(conn), max_mem_(kMaxMemorySizes), inactive_(false)
+    : Wrapper(conn), max_mem_(kMaxMemorySizes), inactive_(false),
+      suspendable_(false)
 {
     out_stage_ = Pipeline::instance().write_back_stage();
 }
 
 Response::~Response()
 {
-    if (response_code() == Stage::kStageKeepLock
+    if (conn_->is_draining()) {
+        // the handler has returned, write back may resume it now
+        conn_->set_cork();
+        out_stage_->sched_add(conn_);
+    } else if (response_code() == Stage::kStageKeepLock
         && conn_->get_continuation() == NULL) {
         conn_->set_cork();
         out_stage_->sched_add(conn_); // silently flush
@@ -73,12 +81,19 @@ ssize_t
 Response::write_data(const byte* ptr, size_t sz)
 {
     OutputStream& out = conn_->out_stream();
-    ssize_t ret;
     out.append_data(ptr, sz);
 
-    if (out.memory_usage() > max_mem_) {
-        ret = flush_data();
-        if (ret <= 0) return ret;
+    if (out.memory_usage() > max_mem_ && !suspendable_) {
+        ssize_t ret = flush_data();
+        if (ret <= 0) {
+            return ret;
+        }
+    } else if (out.memory_usage() > max_mem_) {
+        // a full socket buffer isn't an error, the caller will suspend
+        ssize_t ret = try_flush_data();
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return ret;
+        }
     }
     return sz;
 }
@@ -121,23 +136,57 @@ Response::flush_data()
     return nwrite;
 }
 
+ssize_t
+Response::try_flush_data()
+{
+    OutputStream& out = conn_->out_stream();
+    ssize_t nwrite = 0;
+    while (!out.is_done()) {
+        ssize_t rs = out.write_into_output();
+        if (rs < 0) {
+            if (nwrite == 0) {
+                nwrite = rs;
+            }
+            break;
+        } else if (rs == 0) {
+            break;
+        }
+        nwrite += rs;
+    }
+    return nwrite;
+}
+
 void
 Response::close()
 {
     inactive_ = true;
 }
 
+bool
+Response::is_congested() const
+{
+    return conn_->out_stream().memory_usage() > max_mem_;
+}
+
 void
 Response::suspend_continuation(void* continuation)
 {
     conn_->set_continuation(continuation);
 }
 
+void
+Response::suspend_until_drained(void* continuation)
+{
+    conn_->set_continuation(continuation);
+    conn_->set_draining(true);
+}
+
 void*
 Response::restore_continuation()
 {
     void* res = conn_->get_continuation();
     conn_->reset_continuation();
+    conn_->set_draining(false);
     return res;
 }
 
@@ -56,10 +56,21 @@ class Response : public Wrapper
 protected:
     size_t      max_mem_;
     bool        inactive_;
+    bool        suspendable_;
     Stage*      out_stage_;
     size_t      total_mem_;
 public:
+    /**
+     * High-water mark of the output stream in bytes.  Above it,
+     * write_data() flushes in blocking mode, or without blocking if
+     * enable_suspend() is called, and is_congested() is true.
+     */
     static size_t kMaxMemorySizes;
+    /**
+     * Low-water mark of the output stream in bytes, a handler suspended by
+     * suspend_until_drained() is resumed below it.
+     */
+    static size_t kResumeMemorySizes;
 
     Response(Connection* conn);
     virtual ~Response();
@@ -74,6 +85,12 @@ public:
      */
     int     response_code() const;
 
+    /**
+     * Append data to the output stream.  If the stream is above the
+     * high-water mark, it's flushed in blocking mode until the io timeout.
+     * After enable_suspend(), it only writes what the socket takes instead.
+     * @return sz, or -1 on error.
+     */
     virtual ssize_t write_data(const byte* ptr, size_t sz);
     virtual ssize_t write_string(const std::string& str);
     virtual ssize_t write_string(const char* str);
@@ -83,6 +100,12 @@ public:
      * @return Number of byte flushed. -1 means error.
      */
     virtual ssize_t flush_data();
+    /**
+     * Flush data without blocking, stops when the socket buffer is full.
+     * @return Number of byte flushed. -1 means error or nothing could be
+     * written.
+     */
+    virtual ssize_t try_flush_data();
 
     bool    active() const { return !inactive_; }
     /**
@@ -90,7 +113,26 @@ public:
      */
     void    close();
 
+    /**
+     * @return True if the output stream is above the high-water mark.
+     */
+    bool    is_congested() const;
+    /**
+     * Stop write_data() from blocking on a full output stream.  The handler
+     * must check is_congested() and suspend_until_drained() then, otherwise
+     * the stream grows without bound.
+     */
+    void    enable_suspend() { suspendable_ = true; }
+
     void  suspend_continuation(void* continuation);
+    /**
+     * Suspend the handler until the write back stage drains the output
+     * stream below the low-water mark, then the connection's continuation
+     * is rescheduled.  The connection is handed to the write back stage
+     * when this response is destroyed, so the handler must return
+     * response_code() right after.
+     */
+    void  suspend_until_drained(void* continuation);
     void* restore_continuation();
 };
 
@@ -101,6 +101,16 @@ void         tube_http_response_write_file(tube_http_response_t* response,
                                            int file_desc,
                                            off64_t offset, off64_t length);
 void         tube_http_response_flush_data(tube_http_response_t* response);
+
+/* write_data doesn't block after this, the handler must suspend on
+ * congestion and continue writing when it's called again */
+void         tube_http_response_enable_suspend(tube_http_response_t* response);
+int          tube_http_response_is_congested(tube_http_response_t* response);
+void         tube_http_response_suspend_until_drained(
+    tube_http_response_t* response, void* continuation);
+/* NULL if the handler isn't resumed */
+void*        tube_http_response_restore_continuation(
+    tube_http_response_t* response);
 void         tube_http_response_close(tube_http_response_t* response);
 void         tube_http_response_respond(tube_http_response_t* response,
                                         int status_code,
@@ -224,6 +224,37 @@ tube_http_response_flush_data(tube_http_response_t* response)
     HTTP_RESPONSE(response)->flush_data();
 }
 
+EXPORT_API void
+tube_http_response_enable_suspend(tube_http_response_t* response)
+{
+    HTTP_RESPONSE(response)->enable_suspend();
+}
+
+EXPORT_API int
+tube_http_response_is_congested(tube_http_response_t* response)
+{
+    return HTTP_RESPONSE(response)->is_congested();
+}
+
+EXPORT_API void
+tube_http_response_suspend_until_drained(tube_http_response_t* response,
+                                         void* continuation)
+{
+    HTTP_RESPONSE(response)->suspend_until_drained(continuation);
+}
+
+EXPORT_API void*
+tube_http_response_restore_continuation(tube_http_response_t* response)
+{
+    void* res = HTTP_RESPONSE(response)->restore_continuation();
+    if (res) {
+        // the headers are written before suspending
+        HTTP_RESPONSE(response)->force_responded();
+        HTTP_RESPONSE(response)->disable_prepare_buffer();
+    }
+    return res;
+}
+
 EXPORT_API void
 tube_http_response_close(tube_http_response_t* response)
 {
@@ -7,8 +7,11 @@
 #include "core/pipeline.h"
 #include "core/stages.h"
 #include "core/server.h"
+#include "core/executor.h"
+#include "core/page_allocator.h"
 #include "utils/logger.h"
 #include "utils/misc.h"
+#include "utils/atomic.h"
 
 namespace tube {
 
@@ -129,18 +132,48 @@ public:
     }
 };
 
+static int
+parse_priority(const std::string& value)
+{
+    if (utils::ignore_compare(value, "urgent")) {
+        return Connection::kPriorityUrgent;
+    } else if (utils::ignore_compare(value, "bulk")) {
+        return Connection::kPriorityBulk;
+    } else if (!utils::ignore_compare(value, "normal")) {
+        LOG(ERROR, "invalid priority %s, fallback to normal", value.c_str());
+    }
+    return Connection::kPriorityNormal;
+}
+
 UrlRuleItem::UrlRuleItem(const std::string& type, const Node& subdoc)
+    : priority(Connection::kPriorityNormal), max_pending(0), npending(0),
+      nshed(0)
 {
+    const Node* priority_node = subdoc.FindValue("priority");
+    if (priority_node) {
+        std::string value;
+        *priority_node >> value;
+        priority = parse_priority(value);
+    }
+    const Node* max_pending_node = subdoc.FindValue("max_pending");
+    if (max_pending_node) {
+        std::string value;
+        *max_pending_node >> value;
+        max_pending = utils::parse_int(value);
+        if (max_pending < 0) {
+            LOG(ERROR, "invalid max_pending, fallback to unlimited");
+            max_pending = 0;
+        }
+    }
     if (type == "prefix") {
-        std::string prefix;
-        subdoc["prefix"] >> prefix;
-        matcher = new PrefixUrlRuleItemMatcher(prefix);
+        subdoc["prefix"] >> pattern;
+        matcher = new PrefixUrlRuleItemMatcher(pattern);
     } else if (type == "regex") {
-        std::string regex;
-        subdoc["regex"] >> regex;
-        matcher = new RegexUrlRuleItemMatcher(regex);
+        subdoc["regex"] >> pattern;
+        matcher = new RegexUrlRuleItemMatcher(pattern);
     } else {
         matcher = NULL;
+        pattern = "*";
     }
 }
 
@@ -195,6 +228,18 @@ UrlRuleConfig::match_uri(HttpRequestData& req_ref) const
     return NULL;
 }
 
+void
+UrlRuleConfig::log_stats(const std::string& host) const
+{
+    for (size_t i = 0; i < rules_.size(); i++) {
+        const UrlRuleItem& rule = rules_[i];
+        LOG(INFO, "url rule %s on %s: pending %ld shed %ld",
+            rule.pattern.c_str(), host.c_str(),
+            utils::atomic_load(&rule.npending),
+            utils::atomic_load(&rule.nshed));
+    }
+}
+
 VHostConfig::VHostConfig()
 {}
 
@@ -234,6 +279,15 @@ VHostConfig::match_uri(const std::string& host, HttpRequestData& req_ref) const
     return it->second.match_uri(req_ref);
 }
 
+void
+VHostConfig::log_stats() const
+{
+    for (HostMap::const_iterator it = host_map_.begin();
+         it != host_map_.end(); ++it) {
+        it->second.log_stats(it->first);
+    }
+}
+
 ThreadPoolConfig::ThreadPoolConfig()
     : pipeline_(Pipeline::instance())
 {}
@@ -271,12 +325,75 @@ ThreadPoolConfig::load_thread_pool_config(const Node& subdoc)
 }
 
 ServerConfig::ServerConfig()
-    : pipeline_(Pipeline::instance()), listen_queue_size_(128)
+    : pipeline_(Pipeline::instance()), listen_queue_size_(128),
+      stats_interval_(0)
 {}
 
 ServerConfig::~ServerConfig()
 {}
 
+void
+ServerConfig::load_scheduler_config(const Node& subdoc)
+{
+    SchedulerFactory& factory = SchedulerFactory::instance();
+    for (YAML::Iterator it = subdoc.begin(); it != subdoc.end(); ++it) {
+        std::string stage, type;
+        it.first() >> stage;
+        it.second() >> type;
+        if (!factory.set_stage_scheduler(stage, type)) {
+            LOG(ERROR, "invalid scheduler %s for stage %s", type.c_str(),
+                stage.c_str());
+        }
+    }
+}
+
+void
+ServerConfig::load_auto_tuning_config(const Node& subdoc)
+{
+    for (YAML::Iterator it = subdoc.begin(); it != subdoc.end(); ++it) {
+        std::string key, value;
+        it.first() >> key;
+        it.second() >> value;
+        Stage* stage = pipeline_.find_stage(key);
+        if (stage == NULL) {
+            LOG(ERROR, "cannot find stage %s for auto tuning", key.c_str());
+            continue;
+        }
+        // target latency in milliseconds
+        int target = utils::parse_int(value);
+        if (target <= 0) {
+            LOG(ERROR, "invalid target latency %s for stage %s",
+                value.c_str(), key.c_str());
+            continue;
+        }
+        stage->enable_auto_tuning(target * 1000L);
+    }
+}
+
+void
+ServerConfig::load_admission_config(const Node& subdoc)
+{
+    for (YAML::Iterator it = subdoc.begin(); it != subdoc.end(); ++it) {
+        std::string key, value;
+        it.first() >> key;
+        it.second() >> value;
+        int val = utils::parse_int(value);
+        if (val < 0) {
+            LOG(ERROR, "invalid admission control option %s", key.c_str());
+            continue;
+        }
+        if (key == "max_queue_length") {
+            HttpParserStage::kMaxQueueLength = val;
+        } else if (key == "max_queue_delay") {
+            HttpParserStage::kMaxQueueDelay = val;
+        } else if (key == "retry_after") {
+            HttpParserStage::kRetryAfter = val;
+        } else {
+            LOG(ERROR, "unknown admission control option %s", key.c_str());
+        }
+    }
+}
+
 void
 ServerConfig::load_static_config()
 {
@@ -290,21 +407,120 @@ ServerConfig::load_static_config()
             if (key == "idle_timeout") {
                 it.second() >> value;
                 HttpConnectionFactory::kDefaultTimeout = atoi(value.c_str());
+            } else if (key == "connection_pool_size") {
+                it.second() >> value;
+                if (utils::parse_int(value) >= 0) {
+                    PooledConnectionFactory::kDefaultPoolSize =
+                        utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid connection_pool_size");
+                }
+            } else if (key == "buffer_hugepages") {
+                it.second() >> value;
+                PageAllocator::kUseHugePages = utils::parse_bool(value);
             } else if (key == "enable_cork") {
                 it.second() >> value;
                 HttpConnectionFactory::kCorkEnabled = utils::parse_bool(value);
+            } else if (key == "poller") {
+                it.second() >> value;
+                if (PollerFactory::instance().has_poller(value)) {
+                    PollStage::kPollerName = value;
+                } else {
+                    LOG(ERROR, "invalid poller");
+                }
             } else if (key == "write_back_mode") {
                 it.second() >> value;
                 if (utils::ignore_compare(value, "block")) {
                     Server::kDefaultWriteBackMode = Server::kWriteBackModeBlock;
                 } else if (utils::ignore_compare(value, "poll")) {
                     Server::kDefaultWriteBackMode = Server::kWriteBackModePoll;
+                } else if (utils::ignore_compare(value, "hybrid")) {
+                    Server::kDefaultWriteBackMode =
+                        Server::kWriteBackModeHybrid;
                 } else {
                     LOG(ERROR, "invalid write_back_mode");
                 }
+            } else if (key == "hybrid_max_rtt") {
+                it.second() >> value;
+                if (utils::parse_int(value) > 0) {
+                    HybridOutStage::kMaxBlockRtt = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid hybrid_max_rtt");
+                }
+            } else if (key == "hybrid_max_block_time") {
+                it.second() >> value;
+                if (utils::parse_int(value) > 0) {
+                    HybridOutStage::kMaxBlockTime = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid hybrid_max_block_time");
+                }
             } else if (key == "handler_auto_tuning") {
                 it.second() >> value;
                 HttpHandlerStage::kAutoTuning = utils::parse_bool(value);
+            } else if (key == "auto_tuning_max_threads") {
+                it.second() >> value;
+                if (utils::parse_int(value) > 0) {
+                    Controller::kDefaultMaxThreads = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid auto_tuning_max_threads");
+                }
+            } else if (key == "run_to_completion") {
+                it.second() >> value;
+                PollInStage::kRunToCompletion = utils::parse_bool(value);
+            } else if (key == "run_to_completion_max_size") {
+                it.second() >> value;
+                if (utils::parse_int(value) > 0) {
+                    PollInStage::kMaxInlineInputSize = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid run_to_completion_max_size");
+                }
+            } else if (key == "scheduler") {
+                load_scheduler_config(it.second());
+            } else if (key == "admission_control") {
+                load_admission_config(it.second());
+            } else if (key == "executor_threads") {
+                it.second() >> value;
+                if (utils::ignore_compare(value, "auto")) {
+                    Executor::kDefaultThreadPoolSize = 0;
+                } else if (utils::parse_int(value) > 0) {
+                    Executor::kDefaultThreadPoolSize = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid executor_threads");
+                }
+            } else if (key == "accept_threads") {
+                it.second() >> value;
+                if (utils::parse_int(value) > 0) {
+                    Server::kAcceptThreads = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid accept_threads");
+                }
+            } else if (key == "defer_accept") {
+                it.second() >> value;
+                if (utils::parse_int(value) >= 0) {
+                    Server::kDeferAccept = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid defer_accept");
+                }
+            } else if (key == "fast_open") {
+                it.second() >> value;
+                if (utils::parse_int(value) >= 0) {
+                    Server::kFastOpen = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid fast_open");
+                }
+            } else if (key == "shards") {
+                it.second() >> value;
+                int nshards = 0;
+                if (utils::ignore_compare(value, "auto")) {
+                    nshards = sysconf(_SC_NPROCESSORS_ONLN);
+                } else {
+                    nshards = utils::parse_int(value);
+                }
+                if (nshards <= 0) {
+                    LOG(ERROR, "invalid shards, fallback to non-sharded.");
+                    nshards = 1;
+                }
+                pipeline_.set_shard_count(nshards);
             }
         }
     }
@@ -334,6 +550,8 @@ ServerConfig::load_config()
                 host_cfg.load_vhost_rules(it.second());
             } else if (key == "thread_pool") {
                 thread_pool_cfg.load_thread_pool_config(it.second());
+            } else if (key == "auto_tuning") {
+                load_auto_tuning_config(it.second());
             } else if (key == "listen_queue_size") {
                 it.second() >> value;
                 listen_queue_size_ = atoi(value.c_str());
@@ -342,6 +560,13 @@ ServerConfig::load_config()
                         "default.");
                     listen_queue_size_ = 128;
                 }
+            } else if (key == "stats_interval") {
+                it.second() >> value;
+                if (utils::parse_int(value) >= 0) {
+                    stats_interval_ = utils::parse_int(value);
+                } else {
+                    LOG(ERROR, "invalid stats_interval");
+                }
             }
         }
     }
@@ -44,6 +44,13 @@ struct UrlRuleItem
     typedef std::list<BaseHttpHandler*> HandlerChain;
     HandlerChain handlers;
     UrlRuleItemMatcher* matcher;
+    std::string pattern; // prefix or regex, for logging
+    int priority; // Connection::Priority of matched requests
+
+    // admission control
+    long                   max_pending; // 0 means unlimited
+    mutable volatile long  npending;    // admitted but not finished
+    mutable volatile long  nshed;       // rejected by admission control
 
     UrlRuleItem(const std::string& type, const Node& subdoc);
     virtual ~UrlRuleItem();
@@ -58,6 +65,7 @@ public:
     void load_url_rule(const Node& subdoc);
 
     const UrlRuleItem* match_uri(HttpRequestData& req_ref) const;
+    void log_stats(const std::string& host) const;
 
 private:
     std::vector<UrlRuleItem> rules_;
@@ -78,6 +86,10 @@ public:
     void load_vhost_rules(const Node& subdoc);
     const UrlRuleItem* match_uri(const std::string& host,
                                  HttpRequestData& req_ref) const;
+    /**
+     * Log the admission control counters of every url rule.
+     */
+    void log_stats() const;
 };
 
 class ThreadPoolConfig
@@ -115,12 +127,21 @@ public:
     std::string address() const { return address_; }
     std::string port() const { return port_; }
     int listen_queue_size() const { return listen_queue_size_; }
+    /**
+     * Interval of logging server statistics in seconds, 0 means never.
+     */
+    int stats_interval() const { return stats_interval_; }
 
 private:
+    void load_scheduler_config(const Node& subdoc);
+    void load_auto_tuning_config(const Node& subdoc);
+    void load_admission_config(const Node& subdoc);
+
     std::string config_filename_;
     std::string address_;
     std::string port_; // port can be a service, keep it as a string
     int         listen_queue_size_;
+    int         stats_interval_;
 };
 
 }
@@ -41,7 +41,7 @@ on_header_line_complete(http_parser* parser)
 
 HttpRequestData::HttpRequestData()
     : method(0), content_length(0), transfer_encoding(0), version_major(0),
-      version_minor(0), keep_alive(false)
+      version_minor(0), keep_alive(false), admitted(false), url_rule(NULL)
 {
     clear();
 }
@@ -92,10 +92,34 @@ HttpRequestData::clear()
     query_string.clear();
     fragment.clear();
     chunk_buffer.clear();
+    admitted = false;
 }
 
 HttpConnection::HttpConnection(int fd)
-    : Connection(fd), bytes_should_skip_(0)
+    : Connection(fd), bytes_should_skip_(0), enqueue_time_(0)
+{
+    init_parser();
+    set_io_timeout(500); // max block time
+}
+
+void
+HttpConnection::reset(int fd)
+{
+    Connection::reset(fd);
+    while (!requests_.empty()) {
+        pop_request();
+    }
+    tmp_request_.clear();
+    last_header_key_.clear();
+    last_header_value_.clear();
+    bytes_should_skip_ = 0;
+    enqueue_time_ = 0;
+    init_parser();
+    set_io_timeout(500);
+}
+
+void
+HttpConnection::init_parser()
 {
     http_parser_init(&parser_, HTTP_REQUEST);
     parser_.data = this;
@@ -108,8 +132,6 @@ HttpConnection::HttpConnection(int fd)
     parser_.on_query_string = on_query_string;
     parser_.on_fragment = on_fragment;
     parser_.on_chunk_data = on_chunk_data;
-
-    set_io_timeout(500); // max block time
 }
 
 const size_t HttpConnection::kMaxBodySize = 16 << 10;
@@ -137,10 +159,9 @@ HttpConnection::do_parse()
     }
 
     size_t nconsumed = 0;
-    for (Buffer::PageIterator it = buf.page_begin(); it != buf.page_end();
-         ++it) {
+    for (size_t i = 0; i < buf.page_count(); i++) {
         size_t len = 0;
-        const char* ptr = (const char*) buf.get_page_segment(*it, &len);
+        const char* ptr = (const char*) buf.page_segment(i, &len);
         //LOG(DEBUG, "parsing %.*s", len, ptr);
         nconsumed += http_parser_execute(&parser_, ptr, len);
         if (!requests_.empty() && requests_.back().content_length > 0) {
@@ -260,6 +281,23 @@ HttpConnection::finish_parse()
     last_header_value_.clear();
 }
 
+HttpConnection::~HttpConnection()
+{
+    while (!requests_.empty()) {
+        pop_request();
+    }
+}
+
+void
+HttpConnection::pop_request()
+{
+    HttpRequestData& req = requests_.front();
+    if (req.admitted && req.url_rule) {
+        utils::atomic_sub(&req.url_rule->npending, 1L);
+    }
+    requests_.pop_front();
+}
+
 void
 HttpConnection::resched_continuation()
 {
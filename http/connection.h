@@ -38,6 +38,7 @@ struct HttpRequestData
     short version_major;
     short version_minor;
     bool  keep_alive;
+    bool  admitted; // counted in pending requests of url_rule
 
     const UrlRuleItem* url_rule;
 
@@ -58,13 +59,19 @@ class HttpConnection : public Connection
     u64             bytes_should_skip_;
 
     void*           continuation_data_;
+    u64             enqueue_time_;
 
 public:
 
     static const size_t kMaxBodySize;
 
     HttpConnection(int fd);
-    virtual ~HttpConnection() {}
+    virtual ~HttpConnection();
+
+    /**
+     * Reset the parser and drop all requests for reuse.
+     */
+    virtual void reset(int fd);
 
     void set_bytes_should_skip(u64 val) { bytes_should_skip_ = val; }
     u64  bytes_should_skip() const { return bytes_should_skip_; }
@@ -85,8 +92,21 @@ public:
     bool is_ready() const;
 
     std::list<HttpRequestData>& get_request_data_list() { return requests_; }
+    /**
+     * Remove the front request after it's finished.
+     */
+    void pop_request();
+
+    /**
+     * Time when the connection is added to the handler stage, used for
+     * measuring queueing delay. 0 means not measured.
+     */
+    u64  enqueue_time() const { return enqueue_time_; }
+    void set_enqueue_time(u64 usec) { enqueue_time_ = usec; }
 
     virtual void resched_continuation();
+private:
+    void init_parser();
 };
 
 }
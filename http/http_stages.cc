@@ -16,66 +16,177 @@ bool HttpConnectionFactory::kCorkEnabled = true;
 Connection*
 HttpConnectionFactory::create_connection(int fd)
 {
-    Connection* conn = new HttpConnection(fd);
+    Connection* conn = PooledConnectionFactory::create_connection(fd);
     conn->set_idle_timeout(kDefaultTimeout);
     conn->set_cork_enabled(kCorkEnabled);
     return conn;
 }
 
-void
-HttpConnectionFactory::destroy_connection(Connection* conn)
+Connection*
+HttpConnectionFactory::allocate_connection(int fd)
 {
-    delete conn;
+    return new HttpConnection(fd);
 }
 
+size_t HttpParserStage::kMaxQueueLength = 0;
+int HttpParserStage::kMaxQueueDelay = 0;
+int HttpParserStage::kRetryAfter = 1;
+volatile long HttpParserStage::nr_shed_ = 0;
+
 HttpParserStage::HttpParserStage()
 {
     // replace the connection factory
-    pipeline_.set_connection_factory(new HttpConnectionFactory());
+    factory_ = new HttpConnectionFactory();
+    pipeline_.set_connection_factory(factory_);
 }
 
 void
 HttpParserStage::initialize()
 {
-    handler_stage_ = pipeline_.find_stage("http_handler");
+    handler_stage_ = (HttpHandlerStage*) pipeline_.find_stage("http_handler");
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "HTTP/1.1 503 Service Unavailable\r\n"
+             "Retry-After: %d\r\nContent-Length: 0\r\n", kRetryAfter);
+    shed_response_ = std::string(buf) + "\r\n";
+    shed_close_response_ = std::string(buf) + "Connection: close\r\n\r\n";
 }
 
 HttpParserStage::~HttpParserStage()
 {}
 
-void
-HttpParserStage::increase_load(long load)
-{
-    Scheduler* scheduler = handler_stage_->scheduler();
-    if (scheduler != NULL && scheduler->controller()) {
-        scheduler->controller()->increase_load(load);
-    }
-}
-
-int
-HttpParserStage::process_task(Connection* conn)
+bool
+HttpParserStage::parse_requests(Connection* conn)
 {
-    Request req(conn);
     HttpConnection* http_connection = (HttpConnection*) conn;
-    size_t orig_size = http_connection->get_request_data_list().size();
-    size_t delta = 0;
 
     if (!http_connection->do_parse()) {
         // FIXME: if the protocol client sent is not HTTP, is it OK to close
         // the connection right away?
         LOG(WARNING, "corrupted protocol from %s. closing...",
             conn->address_string().c_str());
-        increase_load(-1 * http_connection->get_request_data_list().size());
         conn->active_close();
     }
-    if (http_connection->is_ready()) {
-        delta = http_connection->get_request_data_list().size() - orig_size;
-        // notify the controller increase the current load
-        increase_load(delta);
+    return http_connection->is_ready();
+}
+
+bool
+HttpParserStage::is_overloaded() const
+{
+    Scheduler* sched = handler_stage_->scheduler();
+    size_t queue_length = sched ? sched->size_nolock() : 0;
+    if (queue_length == 0) {
+        return false; // the delay might be out of date
+    }
+    if (kMaxQueueLength > 0 && queue_length >= kMaxQueueLength) {
+        return true;
+    }
+    if (kMaxQueueDelay > 0
+        && handler_stage_->queue_delay() > kMaxQueueDelay * 1000L) {
+        return true;
+    }
+    return false;
+}
+
+bool
+HttpParserStage::admit_requests(HttpConnection* conn)
+{
+    std::list<HttpRequestData>& requests = conn->get_request_data_list();
+    std::list<HttpRequestData>::iterator it;
+    bool has_admitted = false;
+    bool overloaded = false;
+    for (it = requests.begin(); it != requests.end(); ++it) {
+        const UrlRuleItem* rule = it->url_rule;
+        if (it->admitted) {
+            has_admitted = true;
+        } else if (rule && rule->max_pending > 0
+                   && utils::atomic_load(&rule->npending)
+                   >= rule->max_pending) {
+            overloaded = true;
+        }
+    }
+    // responses must be in order, don't shed behind admitted requests
+    if (!has_admitted && (overloaded || is_overloaded())) {
+        return false;
+    }
+    for (it = requests.begin(); it != requests.end(); ++it) {
+        if (!it->admitted) {
+            it->admitted = true;
+            if (it->url_rule) {
+                utils::atomic_add(&it->url_rule->npending, 1L);
+            }
+        }
+    }
+    return true;
+}
+
+int
+HttpParserStage::shed_requests(HttpConnection* conn)
+{
+    std::list<HttpRequestData>& requests = conn->get_request_data_list();
+    Response response(conn);
+    while (!requests.empty()) {
+        HttpRequestData& req = requests.front();
+        if (req.url_rule) {
+            utils::atomic_add(&req.url_rule->nshed, 1L);
+        }
+        long nr_shed = utils::atomic_add(&nr_shed_, 1L);
+        if ((nr_shed & 1023) == 1) {
+            LOG(WARNING, "http_handler overloaded, %ld requests shed",
+                nr_shed);
+        }
+        LOG(DEBUG, "shed %s from %s", req.complete_uri.c_str(),
+            conn->address_string().c_str());
+        if (!req.keep_alive) {
+            response.write_string(shed_close_response_);
+            conn->set_close_after_finish(true);
+            requests.clear(); // nothing else can be responded
+            break;
+        }
+        response.write_string(shed_response_);
+        if (req.content_length > 0) {
+            // the body is still in the input, it must not be parsed as the
+            // next request
+            conn->set_bytes_should_skip(req.content_length);
+        }
+        requests.pop_front();
+    }
+    return response.response_code();
+}
+
+int
+HttpParserStage::process_task(Connection* conn)
+{
+    HttpConnection* http_connection = (HttpConnection*) conn;
+    if (parse_requests(conn)) {
+        if (!admit_requests(http_connection)) {
+            return shed_requests(http_connection);
+        }
         // add it into the next stage
         handler_stage_->sched_add(conn);
     }
-    return 0; // release the lock whatever happened
+    return 0; // release the lock
+}
+
+bool
+HttpParserStage::process_inline(Connection* conn)
+{
+    HttpConnection* http_connection = (HttpConnection*) conn;
+    if (!parse_requests(conn)) {
+        conn->unlock(); // wait for more input
+        return true;
+    }
+    if (!admit_requests(http_connection)) {
+        if (shed_requests(http_connection) >= 0) {
+            conn->unlock();
+        }
+        return true;
+    }
+    if (!handler_stage_->process_inline(conn)) {
+        handler_stage_->sched_add(conn);
+        conn->unlock();
+    }
+    return true;
 }
 
 int
@@ -85,30 +196,48 @@ bool
 HttpHandlerStage::kAutoTuning = false;
 
 HttpHandlerStage::HttpHandlerStage()
-    : Stage("http_handler")
+    : Stage("http_handler"), queue_delay_(0)
 {
-    sched_ = new QueueScheduler();
+    sched_ = SchedulerFactory::instance().create_scheduler("http_handler");
     if (kAutoTuning) {
-        sched_->set_controller(new Controller());
-        sched_->controller()->set_stage(this);
-        LOG(INFO, "auto-tuning for handler stage enabled.");
+        enable_auto_tuning(Controller::kDefaultTargetLatency);
     }
 }
 
 HttpHandlerStage::~HttpHandlerStage()
 {
-    delete sched_->controller();
 }
 
-void
-HttpHandlerStage::sched_remove(Connection* conn)
+bool
+HttpHandlerStage::sched_add(Connection* conn)
 {
     HttpConnection* http_connection = (HttpConnection*) conn;
-    if (sched_->controller()) {
-        sched_->controller()->increase_load(
-            -1 * http_connection->get_request_data_list().size());
+    // scheduled by the request handled next, pipelined ones follow later
+    std::list<HttpRequestData>& requests =
+        http_connection->get_request_data_list();
+    if (!requests.empty() && requests.front().url_rule) {
+        conn->set_priority(requests.front().url_rule->priority);
+    } else {
+        conn->set_priority(Connection::kPriorityNormal);
+    }
+    if (HttpParserStage::kMaxQueueDelay > 0
+        && http_connection->enqueue_time() == 0) {
+        http_connection->set_enqueue_time(utils::monotonic_usec());
+    }
+    return Stage::sched_add(conn);
+}
+
+void
+HttpHandlerStage::update_queue_delay(HttpConnection* conn)
+{
+    u64 enqueue_time = conn->enqueue_time();
+    if (enqueue_time == 0) {
+        return;
     }
-    Stage::sched_remove(conn);
+    conn->set_enqueue_time(0);
+    long delay = utils::monotonic_usec() - enqueue_time;
+    // exponential moving average, races between threads are harmless
+    queue_delay_ = (queue_delay_ * 7 + delay) / 8;
 }
 
 void
@@ -161,14 +290,32 @@ done:
     response.reset();
 }
 
+bool
+HttpHandlerStage::try_write_response(Connection* conn, HttpResponse& response)
+{
+    if (response.response_code() != kStageKeepLock
+        || conn->has_continuation()) {
+        return false;
+    }
+    conn->set_cork();
+    response.try_flush_data();
+    if (!conn->out_stream().is_done()) {
+        return false; // socket buffer is full, leave it to write_back
+    }
+    conn->clear_cork();
+    if (conn->is_close_after_finish()) {
+        conn->active_close();
+    }
+    return true;
+}
+
 int
-HttpHandlerStage::process_task(Connection* conn)
+HttpHandlerStage::process_requests(Connection* conn)
 {
     HttpConnection* http_connection = (HttpConnection*) conn;
     std::list<HttpRequestData>& client_requests =
         http_connection->get_request_data_list();
     HttpResponse response(http_connection);
-    size_t orig_size = client_requests.size();
 
     for (int i = 0; i < kMaxContinuesRequestNumber; i++) {
         if (client_requests.empty())
@@ -178,7 +325,7 @@ HttpHandlerStage::process_task(Connection* conn)
         if (conn->has_continuation()) {
             goto done;
         }
-        client_requests.pop_front();
+        http_connection->pop_request();
         if (!request.keep_alive()) {
             LOG(DEBUG, "active close after transfer finish");
             conn->set_close_after_finish(true);
@@ -190,18 +337,33 @@ HttpHandlerStage::process_task(Connection* conn)
         sched_add(conn);
     }
 done:
-    if (sched_->controller()) {
-        sched_->controller()->decrease_load(orig_size - client_requests.size());
-    }
+    // the socket is almost always writable, skip the write_back stage
+    try_write_response(conn, response);
     return response.response_code();
 }
 
+int
+HttpHandlerStage::process_task(Connection* conn)
+{
+    update_queue_delay((HttpConnection*) conn);
+    return process_requests(conn);
+}
+
+bool
+HttpHandlerStage::process_inline(Connection* conn)
+{
+    update_queue_delay((HttpConnection*) conn);
+    if (process_requests(conn) >= 0) {
+        conn->unlock();
+    }
+    return true;
+}
+
 void
 HttpHandlerStage::resched_continuation(HttpConnection* conn)
 {
     sched_add(conn);
-    conn->unlock(); // unlock for scheduling
-    pipeline_.reschedule_all();
+    conn->unlock(); // unlock for scheduling, wakes up the waiting stages
 }
 
 }
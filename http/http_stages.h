@@ -8,26 +8,76 @@
 
 namespace tube {
 
-class HttpConnectionFactory : public ConnectionFactory
+class HttpConnectionFactory : public PooledConnectionFactory
 {
 public:
     static int kDefaultTimeout;
     static bool kCorkEnabled;
     virtual Connection* create_connection(int fd);
-    virtual void        destroy_connection(Connection* conn);
+protected:
+    virtual Connection* allocate_connection(int fd);
 };
 
+class HttpHandlerStage;
+
+/**
+ * HttpParserStage parses requests and passes them to HttpHandlerStage.
+ *
+ * It also performs admission control.  When the handler stage is overloaded
+ * (its queue is too long, or connections wait too long in it) or a url rule
+ * has too many pending requests, new requests are responded with a
+ * precomposed 503 response right away, without entering the handler stage.
+ */
 class HttpParserStage : public ParserStage
 {
-    Stage* handler_stage_;
+    HttpHandlerStage*      handler_stage_;
+    HttpConnectionFactory* factory_;
+    std::string            shed_response_;
+    std::string            shed_close_response_;
+
+    static volatile long nr_shed_;
 public:
+    /**
+     * Maximum number of connections in the handler queue.  0 means
+     * unlimited.
+     */
+    static size_t kMaxQueueLength;
+    /**
+     * Maximum queueing delay of the handler stage in milliseconds.  0 means
+     * unlimited.
+     */
+    static int    kMaxQueueDelay;
+    /**
+     * Value of Retry-After header in 503 responses, in seconds.
+     */
+    static int    kRetryAfter;
+
+    /**
+     * @return Number of requests rejected by admission control.
+     */
+    static long nr_shed() { return nr_shed_; }
+
     HttpParserStage();
     virtual ~HttpParserStage();
 
+    /**
+     * The connection factory installed into the pipeline by this stage.
+     */
+    HttpConnectionFactory* connection_factory() const { return factory_; }
+
     virtual void initialize();
+    /**
+     * Parse the input and run the handler stage inline if a request is
+     * ready.
+     */
+    virtual bool process_inline(Connection* conn);
 protected:
     int process_task(Connection* conn);
-    void increase_load(long load);
+private:
+    bool parse_requests(Connection* conn);
+    bool is_overloaded() const;
+    bool admit_requests(HttpConnection* conn);
+    int  shed_requests(HttpConnection* conn);
 };
 
 class HttpHandlerStage : public Stage
@@ -41,10 +91,32 @@ public:
 
     void    resched_continuation(HttpConnection* conn);
 
-    virtual void sched_remove(Connection* conn);
+    /**
+     * Stamps the connection for measuring the queueing delay, if it's used
+     * by admission control.
+     */
+    virtual bool sched_add(Connection* conn);
+    /**
+     * @return Moving average of queueing delay in microseconds.
+     */
+    long    queue_delay() const { return queue_delay_; }
+
+    /**
+     * Handle the requests in the poll in thread.
+     */
+    virtual bool process_inline(Connection* conn);
 protected:
+    /**
+     * Handle the requests and try writing the response directly.  Only
+     * what doesn't fit in the socket buffer goes to the write_back stage.
+     */
     int process_task(Connection* conn);
 private:
+    volatile long queue_delay_;
+
+    void update_queue_delay(HttpConnection* conn);
+    int  process_requests(Connection* conn);
+    bool try_write_response(Connection* conn, HttpResponse& response);
     void trigger_handler(HttpConnection* conn, HttpRequest& request,
                          HttpResponse& response);
     void log_respond(Connection* conn, HttpRequest& request,
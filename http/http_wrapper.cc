@@ -376,6 +376,7 @@ HttpResponse::reset()
     has_content_length_ = true;
     use_prepare_buffer_ = true;
     is_responded_ = false;
+    suspendable_ = false; // every handler opts in by itself
 }
 
 static const size_t kMaxNumberLength = 32;
@@ -1,13 +1,13 @@
 #include "pch.h"
 
 #include <unistd.h>
-#include <signal.h>
 
 #include "http/http_wrapper.h"
 #include "http/configuration.h"
 #include "http/http_stages.h"
 #include "http/module.h"
 
+#include "core/page_allocator.h"
 #include "core/server.h"
 #include "core/stages.h"
 #include "core/wrapper.h"
@@ -31,6 +31,18 @@ public:
         delete parser_stage_;
         delete handler_stage_;
     }
+
+    void log_stats() {
+        HttpConnectionFactory* factory = parser_stage_->connection_factory();
+        LOG(INFO, "connection pool hits: %ld misses: %ld",
+            factory->nr_hits(), factory->nr_misses());
+        LOG(INFO, "requests shed: %ld", HttpParserStage::nr_shed());
+        PageAllocator& allocator = PageAllocator::instance();
+        LOG(INFO, "buffer pages allocated: %ld freed: %ld refilled: %ld",
+            allocator.nr_system_allocs(), allocator.nr_system_frees(),
+            allocator.nr_depot_refills());
+        VHostConfig::instance().log_stats();
+    }
 };
 
 }
@@ -116,16 +128,18 @@ webserver_init(int argc, char* argv[])
 }
 
 static void
-on_quit_signal(int sig)
+stats_loop(tube::WebServer* server, int interval)
 {
-    exit(0);
+    while (true) {
+        sleep(interval);
+        server->log_stats();
+    }
 }
 
 int
 main(int argc, char* argv[])
 {
     tube::utils::block_sigpipe();
-    ::signal(SIGINT, on_quit_signal);
     webserver_init(argc, argv);
     tube::ServerConfig& cfg = tube::ServerConfig::instance();
     tube::WebServer server;
@@ -135,6 +149,10 @@ main(int argc, char* argv[])
         server.listen(cfg.listen_queue_size());
         server.initialize_stages();
         server.start_stages();
+        if (cfg.stats_interval() > 0) {
+            tube::utils::create_thread(
+                boost::bind(&stats_loop, &server, cfg.stats_interval()));
+        }
 
         server.main_loop();
     } catch (tube::utils::SyscallException ex) {
@@ -1,6 +1,7 @@
 #include "pch.h"
 
 #include <sstream>
+#include <algorithm>
 #include <dirent.h>
 #include <sys/types.h>
 #include <cstdlib>
@@ -274,6 +275,40 @@ StaticHttpHandler::is_request_compression(HttpRequest& request)
 
 static int kDeflateWindowBits = -MAX_WBITS;
 
+// rest of an in-memory body, written once the output stream drains
+struct StaticBodyContinuation
+{
+    byte*  data;
+    size_t offset;
+    size_t end;
+};
+
+static const size_t kBodyChunkSize = (256 << 10);
+
+bool
+StaticHttpHandler::write_body(HttpResponse& response, byte* data,
+                              size_t offset, size_t end)
+{
+    response.enable_suspend();
+    while (offset < end) {
+        size_t len = std::min(end - offset, kBodyChunkSize);
+        if (response.write_data(data + offset, len) < 0) {
+            response.close();
+            return false;
+        }
+        offset += len;
+        if (offset < end && response.is_congested()) {
+            StaticBodyContinuation* cont = new StaticBodyContinuation();
+            cont->data = data;
+            cont->offset = offset;
+            cont->end = end;
+            response.suspend_until_drained(cont);
+            return true;
+        }
+    }
+    return false;
+}
+
 bool
 StaticHttpHandler::write_data_compression(HttpResponse& response,
                                           HttpResponseStatus& status,
@@ -306,7 +341,9 @@ StaticHttpHandler::write_data_compression(HttpResponse& response,
     response.add_header("Content-Encoding", "gzip");
     response.respond(status);
     response.write_data(gzhdr, 10);
-    response.write_data(out, size - strm.avail_out);
+    if (write_body(response, out, 0, size - strm.avail_out)) {
+        out = NULL; // owned by the continuation
+    }
 
     deflateEnd(&strm);
     delete [] out;
@@ -344,6 +381,7 @@ StaticHttpHandler::respond_file_content(const std::string& path,
     std::string range_str;
     HttpResponseStatus ret_status = HttpResponseStatus::kHttpResponseOK;
     off64_t offset = 0, length = -1;
+    bool suspended = false;
 
     if (request.method() != HTTP_HEAD) {
         cached_entry = io_cache_.access_cache(path, stat.st_mtime,
@@ -398,7 +436,8 @@ StaticHttpHandler::respond_file_content(const std::string& path,
     response.respond(ret_status);
     if (request.method() != HTTP_HEAD) {
         if (cached_entry) {
-            response.write_data(cached_entry + offset, length);
+            suspended = write_body(response, cached_entry, offset,
+                                   offset + length);
         } else {
             response.write_file(file_desc, offset, length);
         }
@@ -407,7 +446,9 @@ done:
     if (cached_entry) {
         ::close(file_desc);
     }
-    delete [] cached_entry;
+    if (!suspended) {
+        delete [] cached_entry;
+    }
 }
 
 class HttpResponseStream
@@ -564,6 +605,19 @@ default_resp:
 void
 StaticHttpHandler::handle_request(HttpRequest& request, HttpResponse& response)
 {
+    StaticBodyContinuation* cont =
+        (StaticBodyContinuation*) response.restore_continuation();
+    if (cont) {
+        // resumed by write back, the headers are written already
+        response.force_responded();
+        response.disable_prepare_buffer();
+        if (!write_body(response, cont->data, cont->offset, cont->end)) {
+            delete [] cont->data;
+        }
+        delete cont;
+        return;
+    }
+
     std::string filename = HttpRequest::url_decode(request.path());
     filename = remove_path_dots(filename);
 
@@ -44,6 +44,9 @@ public:
                                 HttpResponse& response);
 private:
     bool is_request_compression(HttpRequest& request);
+    // @return True if suspended, the continuation owns data then
+    bool write_body(HttpResponse& response, byte* data, size_t offset,
+                    size_t end);
     bool write_data_compression(HttpResponse& response,
                                 HttpResponseStatus& status,
                                 byte* ptr, size_t size);
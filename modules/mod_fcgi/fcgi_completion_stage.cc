@@ -134,11 +134,9 @@ FcgiCompletionStage::run_parser(FcgiCompletionContinuation* cont)
         break;
     case Record::kFcgiStdout:
     case Record::kFcgiStderr:
-        for (Buffer::PageIterator it = cont->task_buffer.page_begin();
-             it != cont->task_buffer.page_end(); ++it) {
+        for (size_t i = 0; i < cont->task_buffer.page_count(); i++) {
             size_t len = 0;
-            const byte* ptr =
-                (const byte*) cont->task_buffer.get_page_segment(*it, &len);
+            const byte* ptr = cont->task_buffer.page_segment(i, &len);
             if (n_left < len) len = n_left;
             // feed the string into content parser
             int rs = 0;
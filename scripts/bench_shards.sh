@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Measure requests per second of sharded mode from 1 to MAX_SHARDS shards.
+# Requires wrk.  Usage: bench_shards.sh [doc_root] [max_shards]
+
+SERVER=build/tube-server
+DOC_ROOT=${1:-data/style}
+MAX_SHARDS=${2:-16}
+PORT=8089
+CONF=`mktemp /tmp/tube-shards-XXXXXX.yaml`
+
+for ((n=1;n<=$MAX_SHARDS;n*=2)); do
+    cat > $CONF <<EOF
+address: 127.0.0.1
+port: $PORT
+shards: $n
+thread_pool:
+    poll_in: 1
+    write_back: 1
+    parser: 1
+    http_handler: 1
+listen_queue_size: 1024
+handlers:
+  - name: default
+    module: static
+    doc_root: $DOC_ROOT
+host:
+  - domain: default
+    url-rules:
+      - type: none
+        chain:
+          - default
+EOF
+    $SERVER -c $CONF &
+    PID=$!
+    sleep 1
+    RPS=`wrk -t $n -c $((n * 64)) -d 10s http://127.0.0.1:$PORT/plain.css \
+        | grep Requests/sec | awk '{print $2}'`
+    echo "shards: $n requests/sec: $RPS"
+    kill $PID
+    wait $PID 2>/dev/null
+done
+rm -f $CONF
@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "utils/atomic.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Connection setup benchmark.  Every client thread opens a new connection for
+// each request, sends the request, waits for the first bytes of the response
+// and closes the connection, so the server's accept path dominates.  Works
+// against tube-server as well as test/pingpong_server.
+//
+// With more than one request per connection, requests are sent one after
+// another on a kept-alive connection instead, which measures the per-request
+// cost of the poll and write back stages.
+//
+// Usage: bench_accept [host] [port] [clients] [seconds] [requests]
+
+static const char kRequest[] =
+    "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+static const char kKeepAliveRequest[] =
+    "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+
+static struct addrinfo* server_addr = NULL;
+static volatile long nr_requests = 0;
+static volatile long nr_errors = 0;
+static volatile long total_usec = 0;
+static volatile bool stopped = false;
+static int nr_conn_requests = 1;
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool
+send_request(int fd, const char* req, size_t len)
+{
+    char buf[4096];
+    return ::write(fd, req, len) == (ssize_t) len
+        && ::read(fd, buf, sizeof(buf)) > 0;
+}
+
+// returns the number of requests done
+static int
+do_requests()
+{
+    int fd = ::socket(server_addr->ai_family, server_addr->ai_socktype, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    int state = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &state, sizeof(state));
+    int ndone = 0;
+    if (::connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == 0) {
+        if (nr_conn_requests == 1) {
+            ndone = send_request(fd, kRequest, sizeof(kRequest) - 1);
+        } else {
+            while (ndone < nr_conn_requests && !stopped
+                   && send_request(fd, kKeepAliveRequest,
+                                   sizeof(kKeepAliveRequest) - 1)) {
+                ndone++;
+            }
+        }
+    }
+    ::close(fd);
+    return ndone;
+}
+
+static void
+client_routine()
+{
+    while (!stopped) {
+        u64 start = utils::monotonic_usec();
+        int ndone = do_requests();
+        if (ndone == 0) {
+            utils::atomic_add(&nr_errors, 1L);
+            continue;
+        }
+        utils::atomic_add(&total_usec, (long) (utils::monotonic_usec() - start));
+        utils::atomic_add(&nr_requests, (long) ndone);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char* host = argc > 1 ? argv[1] : "127.0.0.1";
+    const char* port = argc > 2 ? argv[2] : "7000";
+    int nclients = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 3;
+    nr_conn_requests = argc > 5 ? std::max(atoi(argv[5]), 1) : 1;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (::getaddrinfo(host, port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "cannot resolve %s:%s\n", host, port);
+        return 1;
+    }
+
+    double start = now();
+    for (int i = 0; i < nclients; i++) {
+        utils::create_thread(&client_routine);
+    }
+    sleep(seconds);
+    long requests = utils::atomic_load(&nr_requests);
+    long usec = utils::atomic_load(&total_usec);
+    double elapsed = now() - start;
+    stopped = true;
+    printf("clients: %d requests/sec: %.0f avg latency: %.0fus "
+           "errors: %ld\n", nclients, requests / elapsed,
+           requests > 0 ? (double) usec / requests : 0.0,
+           utils::atomic_load(&nr_errors));
+    fflush(stdout);
+    // client threads are still running, don't free the address
+    _exit(0);
+}
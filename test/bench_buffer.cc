@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "core/buffer.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Benchmark for writing large dynamic responses out of a Buffer.  A response
+// is built from small appends, like a directory listing, or from 8K records,
+// like FastCGI output, and written into a socket drained by another thread.
+// Reports write_to_fd() calls, i.e. writev() syscalls, per response and the
+// throughput.
+//
+// Usage: bench_buffer [response size in KB] [rounds]
+
+static int sockets[2];
+
+static void
+drain_routine()
+{
+    static char buf[256 << 10];
+    while (read(sockets[1], buf, sizeof(buf)) > 0) {}
+}
+
+static void
+build_listing(Buffer& buf, size_t size)
+{
+    char line[128];
+    for (int i = 0; buf.size() < size; i++) {
+        int len = snprintf(line, sizeof(line),
+                           "<a href=\"file-%08d.txt\">file-%08d.txt</a>"
+                           " 17-Oct-2011 10:24 %d\n", i, i, i * 37 % 100000);
+        buf.append((const byte*) line, len);
+    }
+}
+
+static void
+build_fcgi(Buffer& buf, size_t size)
+{
+    static byte record[8192];
+    Buffer task;
+    while (buf.size() < size) {
+        task.append(record, sizeof(record));
+        task.copy_front(buf, task.size());
+        task.pop(task.size());
+    }
+}
+
+static void
+bench(const char* name, void (*build)(Buffer&, size_t), size_t size,
+      int rounds)
+{
+    u64 nbytes = 0, ncalls = 0, elapsed = 0;
+    for (int i = 0; i < rounds; i++) {
+        Buffer buf;
+        build(buf, size);
+        u64 start = utils::monotonic_usec();
+        while (buf.size() > 0) {
+            ssize_t n = buf.write_to_fd(sockets[0]);
+            if (n < 0) {
+                perror("write_to_fd");
+                exit(1);
+            }
+            nbytes += n;
+            ncalls++;
+        }
+        elapsed += utils::monotonic_usec() - start;
+    }
+    printf("%-8s size: %6luK writes/response: %7.1f MB/s: %8.1f\n", name,
+           size >> 10, (double) ncalls / rounds,
+           nbytes / (elapsed ? elapsed : 1) * 1e6 / (1 << 20));
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? atoi(argv[1]) : 1024) << 10;
+    int rounds = argc > 2 ? atoi(argv[2]) : 50;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    int sndbuf = 4 << 20;
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    utils::create_thread(drain_routine);
+    bench("listing", build_listing, size, rounds);
+    bench("fcgi", build_fcgi, size, rounds);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include "utils/fdmap.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Microbenchmark for FDMap.  Descriptors 0..n-1 are inserted, looked up and
+// erased in a shuffled order, each operation is timed over the whole set.
+//
+// Usage: bench_fdmap [rounds]
+
+typedef utils::FDMap<void*> Map;
+
+static double
+nsec_per_op(u64 start, size_t nops)
+{
+    return (utils::monotonic_usec() - start) * 1000.0 / nops;
+}
+
+static void
+bench(size_t nfds, int rounds)
+{
+    std::vector<int> fds(nfds);
+    for (size_t i = 0; i < nfds; i++) {
+        fds[i] = i;
+    }
+    std::random_shuffle(fds.begin(), fds.end());
+
+    double t_ctor = 0, t_insert = 0, t_find = 0, t_erase = 0;
+    size_t nops = nfds * rounds;
+    long found = 0;
+    for (int r = 0; r < rounds; r++) {
+        u64 start = utils::monotonic_usec();
+        Map* map = new Map();
+        t_ctor += utils::monotonic_usec() - start;
+
+        start = utils::monotonic_usec();
+        for (size_t i = 0; i < nfds; i++) {
+            map->insert(fds[i], &fds[i]);
+        }
+        t_insert += nsec_per_op(start, nfds);
+
+        start = utils::monotonic_usec();
+        for (size_t i = nfds; i > 0; i--) {
+            found += (map->find(fds[i - 1]) != map->end());
+        }
+        t_find += nsec_per_op(start, nfds);
+
+        start = utils::monotonic_usec();
+        for (size_t i = 0; i < nfds; i++) {
+            map->erase(fds[i]);
+        }
+        t_erase += nsec_per_op(start, nfds);
+        delete map;
+    }
+    if ((size_t) found != nops) {
+        fprintf(stderr, "lookup failed: %ld of %lu\n", found, nops);
+        exit(1);
+    }
+    printf("fds: %7lu ctor: %8.1fus insert: %6.1fns find: %6.1fns "
+           "erase: %6.1fns\n", nfds, t_ctor / rounds, t_insert / rounds,
+           t_find / rounds, t_erase / rounds);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? std::max(atoi(argv[1]), 1) : 5;
+    bench(10000, rounds);
+    bench(100000, rounds);
+    bench(1000000, rounds);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "core/pipeline.h"
+#include "utils/atomic.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Contention benchmark for schedulers.  Producers keep adding connections
+// while consumers pick, lock and release them, as the parser and handler
+// stages do.  Each scheduler runs twice: first rescheduling the whole
+// scheduler after every unlock (the old broadcast), then only waking it up
+// when a connection it waits for is unlocked.  With a batch size larger than
+// one, producers lock connections and hand them over with
+// add_locked_task_batch(), as the poll_in stage does for every poll round.
+//
+// Usage: bench_scheduler [producers] [consumers] [seconds] [batch]
+
+static const size_t kNumConnections = 512;
+
+static Connection* conns[kNumConnections];
+static volatile long nr_picks = 0;
+static volatile bool stopped = false;
+static size_t batch_size = 1;
+
+static void
+producer_routine(Scheduler* sched, unsigned int seed)
+{
+    Scheduler::ConnectionList batch;
+    while (!stopped) {
+        seed = seed * 1103515245 + 12345;
+        Connection* conn = conns[(seed >> 8) % kNumConnections];
+        if (batch_size <= 1) {
+            sched->add_task(conn);
+            continue;
+        }
+        if (!conn->try_lock()) {
+            continue;
+        }
+        batch.push_back(conn);
+        if (batch.size() >= batch_size) {
+            sched->add_locked_task_batch(batch);
+            batch.clear();
+        }
+    }
+    if (!batch.empty()) {
+        sched->add_locked_task_batch(batch); // the next run needs them
+    }
+}
+
+static void
+consumer_routine(Scheduler* sched, bool broadcast)
+{
+    while (true) {
+        Connection* conn = sched->pick_task();
+        if (conn == NULL)
+            return;
+        utils::atomic_add(&nr_picks, 1L);
+        conn->unlock();
+        if (broadcast) {
+            sched->reschedule();
+        }
+    }
+}
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+run_bench(const char* name, Scheduler* sched, bool broadcast, int nproducer,
+          int nconsumer, int seconds)
+{
+    stopped = false;
+    nr_picks = 0;
+    if (!broadcast) {
+        SchedulerFactory::instance().register_waiter(sched);
+    }
+    for (int i = 0; i < nconsumer; i++) {
+        utils::create_thread(boost::bind(&consumer_routine, sched, broadcast));
+    }
+    double start = now();
+    for (int i = 0; i < nproducer; i++) {
+        utils::create_thread(boost::bind(&producer_routine, sched, i + 1));
+    }
+    sleep(seconds);
+    long picks = utils::atomic_load(&nr_picks);
+    double elapsed = now() - start;
+    stopped = true;
+    printf("%-10s %-9s producers: %d consumers: %d batch: %lu "
+           "picks/sec: %.0f wakeups: %ld futile: %ld\n", name,
+           broadcast ? "broadcast" : "targeted", nproducer, nconsumer,
+           batch_size, picks / elapsed, sched->nr_wakeups(),
+           sched->nr_futile_wakeups());
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nproducer = argc > 1 ? atoi(argv[1]) : 4;
+    int nconsumer = argc > 2 ? atoi(argv[2]) : 4;
+    int seconds = argc > 3 ? atoi(argv[3]) : 3;
+    batch_size = argc > 4 ? atoi(argv[4]) : 1;
+
+    // fake file descriptors, they are only used as index
+    for (size_t i = 0; i < kNumConnections; i++) {
+        conns[i] = new Connection(i + 3);
+    }
+
+    // schedulers are leaked, consumer threads are still waiting on them
+    for (int broadcast = 1; broadcast >= 0; broadcast--) {
+        run_bench("queue", new QueueScheduler(), broadcast, nproducer,
+                  nconsumer, seconds);
+        sleep(1);
+        run_bench("lockfree", new LockFreeScheduler(), broadcast, nproducer,
+                  nconsumer, seconds);
+        sleep(1);
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "core/pipeline.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Counts the system calls of writing responses back, the way the write back
+// stages do: cork the connection, write the output stream until it's done
+// and uncork.  The calls are counted by wrapping them in this program.  A
+// small response is a header and a body buffer, a file response is a header
+// followed by a file.
+//
+// Usage: bench_syscalls [responses] [file size in KB]
+
+static long nr_setsockopt = 0;
+static long nr_writes = 0;
+static long nr_sendfiles = 0;
+
+template <typename T> static T
+next_symbol(T, const char* name)
+{
+    return (T) dlsym(RTLD_NEXT, name);
+}
+
+extern "C" int
+setsockopt(int fd, int level, int name, const void* val, socklen_t len)
+    __THROW
+{
+    static int (*next)(int, int, int, const void*, socklen_t) =
+        next_symbol(&setsockopt, "setsockopt");
+    if (level == IPPROTO_TCP && name == TCP_CORK) {
+        nr_setsockopt++;
+    }
+    return next(fd, level, name, val, len);
+}
+
+extern "C" ssize_t
+writev(int fd, const struct iovec* vec, int nvec)
+{
+    static ssize_t (*next)(int, const struct iovec*, int) =
+        next_symbol(&writev, "writev");
+    nr_writes++;
+    return next(fd, vec, nvec);
+}
+
+extern "C" ssize_t
+sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+    static ssize_t (*next)(int, const struct msghdr*, int) =
+        next_symbol(&sendmsg, "sendmsg");
+    nr_writes++;
+    return next(fd, msg, flags);
+}
+
+extern "C" ssize_t
+sendfile64(int out_fd, int in_fd, off64_t* offset, size_t count) __THROW
+{
+    static ssize_t (*next)(int, int, off64_t*, size_t) =
+        next_symbol(&sendfile64, "sendfile64");
+    nr_sendfiles++;
+    return next(out_fd, in_fd, offset, count);
+}
+
+static int client_fd = -1;
+
+static void
+drain_routine()
+{
+    static char buf[256 << 10];
+    while (read(client_fd, buf, sizeof(buf)) > 0) {}
+}
+
+static int
+connect_loopback()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bind(listen_fd, (struct sockaddr*) &addr, len) < 0
+        || listen(listen_fd, 1) < 0
+        || getsockname(listen_fd, (struct sockaddr*) &addr, &len) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client_fd, (struct sockaddr*) &addr, len) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    return fd;
+}
+
+static void
+bench(const char* name, Connection& conn, int file_fd, size_t file_size,
+      int rounds)
+{
+    static const char kHeader[] =
+        "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n";
+    std::string content(512, 'x');
+    Buffer body;
+    body.append((const byte*) content.data(), content.size());
+
+    nr_setsockopt = nr_writes = nr_sendfiles = 0;
+    u64 start = utils::monotonic_usec();
+    for (int i = 0; i < rounds; i++) {
+        OutputStream& out = conn.out_stream();
+        out.append_data((const byte*) kHeader, sizeof(kHeader) - 1);
+        if (file_fd >= 0) {
+            out.append_file(dup(file_fd), 0, file_size);
+        } else {
+            out.append_buffer(body);
+        }
+        // both the handler and the write back stage cork the connection
+        conn.set_cork();
+        conn.set_cork();
+        while (!out.is_done()) {
+            if (out.write_into_output() < 0) {
+                perror("write_into_output");
+                exit(1);
+            }
+        }
+        conn.clear_cork();
+    }
+    u64 elapsed = utils::monotonic_usec() - start;
+    printf("%-6s setsockopt: %4.2f writes: %4.2f sendfiles: %5.2f"
+           " usec/response: %6.2f\n", name,
+           (double) nr_setsockopt / rounds, (double) nr_writes / rounds,
+           (double) nr_sendfiles / rounds, (double) elapsed / rounds);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    size_t file_size = (argc > 2 ? atoi(argv[2]) : 16) << 10;
+
+    char path[] = "/tmp/bench_syscalls.XXXXXX";
+    int file_fd = mkstemp(path);
+    std::string content(file_size, 'y');
+    if (file_fd < 0
+        || write(file_fd, content.data(), file_size) != (ssize_t) file_size) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+
+    Connection conn(connect_loopback());
+    utils::set_socket_blocking(conn.fd(), true);
+    utils::create_thread(drain_routine);
+    bench("small", conn, -1, 0, rounds);
+    bench("file", conn, file_fd, file_size, rounds / 10);
+    return 0;
+}
@@ -38,10 +38,9 @@ public:
         std::string tmp_str;
         size_t total_size = 0;
 
-        for (Buffer::PageIterator it = buf.page_begin(); it != buf.page_end();
-             ++it) {
+        for (size_t i = 0; i < buf.page_count(); i++) {
             size_t len;
-            char* ptr = (char*) buf.get_page_segment(*it, &len);
+            char* ptr = (char*) buf.page_segment(i, &len);
             if (ptr == NULL) break;
             char* chrpos = strchr(ptr, '\n');
             if (chrpos == NULL) {
@@ -1,7 +1,10 @@
 #include <string>
 #include <iostream>
 #include <cassert>
+#include <cstdio>
 #include <signal.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
 
 #include "utils/logger.h"
 #include "utils/misc.h"
@@ -18,10 +21,8 @@ public:
         Buffer& buf = conn->in_stream().buffer();
         Response res(conn);
         size_t len = 0;
-        while (true) {
-            byte* data = buf.get_page_segment(buf.first_page(), &len);
-            if (len == 0)
-                break;
+        while (buf.size() > 0) {
+            byte* data = buf.page_segment(0, &len);
             if (res.write_data(data, len) <= 0) {
                 res.close();
             }
@@ -33,15 +34,20 @@ public:
 
 class PingPongServer : public Server
 {
-    PingPongParser* parser_stage_;
+    PingPongParser*          parser_stage_;
+    PooledConnectionFactory* factory_;
 public:
     PingPongServer() {
         utils::set_fdtable_size(20000);
         utils::logger.set_level(DEBUG);
 
         parser_stage_ = new PingPongParser();
+        factory_ = new PooledConnectionFactory();
+        Pipeline::instance().set_connection_factory(factory_);
     }
 
+    PooledConnectionFactory* factory() const { return factory_; }
+
     virtual ~PingPongServer() {
         delete parser_stage_;
     }
@@ -50,20 +56,32 @@ public:
 static PingPongServer server;
 
 static void
-on_quit_signal(int sig)
+quit_routine(sigset_t sigset)
 {
-    exit(0);
+    // the counters are dumped from a normal thread, not a signal handler
+    int sig;
+    sigwait(&sigset, &sig);
+    fprintf(stderr, "poller control calls: %ld\n", Poller::nr_control_calls());
+    fprintf(stderr, "connection pool hits: %ld misses: %ld\n",
+            server.factory()->nr_hits(), server.factory()->nr_misses());
+    _exit(0);
 }
 
 int
 main(int argc, char *argv[])
 {
+    // blocked in every thread started from now on, quit_routine takes it
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    utils::create_thread(boost::bind(&quit_routine, sigset));
+
     server.bind("0.0.0.0", "7000");
     server.initialize_stages();
     server.start_stages();
     server.listen(128);
 
-    ::signal(SIGINT, on_quit_signal);
     server.main_loop();
     return 0;
 }
@@ -1,3 +1,6 @@
+#include <cassert>
+#include <cstring>
+
 #include "core/buffer.h"
 
 using namespace tube;
@@ -17,9 +20,52 @@ test_cow()
     other.write_to_fd(2);
 }
 
+static bool
+front_equals(const Buffer& buf, const byte* data, size_t size)
+{
+    byte tmp[32768];
+    return buf.copy_front(tmp, size) && memcmp(tmp, data, size) == 0;
+}
+
+void
+test_share()
+{
+    byte data[20000];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (byte) i;
+    }
+    Buffer buf;
+    buf.append(data, sizeof(data));
+
+    // the copy shares the pages, and writing to either doesn't change the
+    // other one
+    Buffer copy(buf);
+    copy.append(data, 100);
+    buf.pop(1000);
+    assert(front_equals(buf, data + 1000, sizeof(data) - 1000));
+    assert(copy.size() == sizeof(data) + 100);
+    assert(front_equals(copy, data, sizeof(data)));
+
+    Buffer front;
+    front.append(data, 10);
+    buf.copy_front(front, 5000);
+    front.append(data, 10);
+    assert(front.size() == 5020);
+    assert(front_equals(front, data, 10));
+    copy.clear();
+    assert(front_equals(buf, data + 1000, sizeof(data) - 1000));
+
+    Buffer whole;
+    whole.append(buf);
+    whole.append(whole);
+    assert(whole.size() == 2 * buf.size());
+    assert(front_equals(whole, data + 1000, sizeof(data) - 1000));
+}
+
 int
 main(int argc, char *argv[])
 {
     test_cow();
+    test_share();
     return 0;
 }
@@ -0,0 +1,210 @@
+#include <cassert>
+#include <cstdio>
+#include <set>
+#include <vector>
+#include <pthread.h>
+#include <boost/bind.hpp>
+
+#include "utils/mempool.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Threads allocate and free through their magazines of a shared pool.
+// Magazines are refilled and spilled by half, and released when their
+// thread exits, so every object is free in the pool after the threads are
+// gone, and is handed out once.
+
+typedef utils::MemoryPool<utils::ThreadSafePool> Pool;
+
+static const size_t kMagazineSize = utils::ThreadSafePool::kMagazineSize;
+static const size_t kObjectSize = 64;
+
+static size_t
+nr_free(Pool& pool)
+{
+    utils::Lock lk(pool.pool_mutex());
+    return pool.nr_free();
+}
+
+static void
+run_thread(boost::function<void ()> func)
+{
+    utils::ThreadId tid = utils::create_thread(func);
+    assert(tid != (utils::ThreadId) -1);
+    pthread_join(tid, NULL);
+}
+
+static void
+alloc_routine(Pool* pool, std::vector<void*>* objs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        objs->push_back(pool->alloc_object());
+    }
+}
+
+static void
+free_routine(Pool* pool, std::vector<void*>* objs)
+{
+    for (size_t i = 0; i < objs->size(); i++) {
+        pool->free_object((*objs)[i]);
+    }
+}
+
+static bool
+is_all_free(Pool& pool)
+{
+    // every free object is handed out exactly once
+    size_t capacity = pool.capacity();
+    if (nr_free(pool) != capacity) {
+        return false;
+    }
+    std::vector<void*> objs;
+    run_thread(boost::bind(&alloc_routine, &pool, &objs, capacity));
+    bool res = pool.capacity() == capacity
+        && std::set<void*>(objs.begin(), objs.end()).size() == capacity;
+    run_thread(boost::bind(&free_routine, &pool, &objs));
+    return res;
+}
+
+static void
+spill_refill_routine(Pool* pool)
+{
+    std::vector<void*> objs;
+    std::set<void*> distinct;
+    // an empty magazine takes half of its size from the pool
+    objs.push_back(pool->alloc_object());
+    size_t capacity = pool->capacity();
+    assert(nr_free(*pool) == capacity - kMagazineSize / 2);
+    for (size_t i = 1; i < kMagazineSize / 2; i++) {
+        objs.push_back(pool->alloc_object());
+    }
+    assert(nr_free(*pool) == capacity - kMagazineSize / 2);
+    objs.push_back(pool->alloc_object());
+    assert(nr_free(*pool) == capacity - kMagazineSize);
+    while (objs.size() <= kMagazineSize) {
+        objs.push_back(pool->alloc_object());
+    }
+    assert(nr_free(*pool) == capacity - kMagazineSize * 3 / 2);
+    for (size_t i = 0; i < objs.size(); i++) {
+        assert(objs[i] && pool->is_inside_pool(objs[i]));
+        distinct.insert(objs[i]);
+    }
+    assert(distinct.size() == objs.size());
+
+    // a full magazine gives half of it back
+    size_t cached = kMagazineSize / 2 - 1;
+    size_t i = 0;
+    for (; cached < kMagazineSize; i++, cached++) {
+        pool->free_object(objs[i]);
+    }
+    assert(nr_free(*pool) == capacity - kMagazineSize * 3 / 2);
+    pool->free_object(objs[i++]);
+    assert(nr_free(*pool) == capacity - kMagazineSize);
+    for (; i < objs.size(); i++) {
+        pool->free_object(objs[i]);
+    }
+    assert(nr_free(*pool) == capacity - kMagazineSize);
+}
+
+void
+test_spill_refill()
+{
+    Pool pool(16 << 10);
+    pool.initialize(kObjectSize);
+    run_thread(boost::bind(&spill_refill_routine, &pool));
+    // the magazine is released when its thread exits
+    assert(is_all_free(pool));
+}
+
+void
+test_cross_thread()
+{
+    Pool pool(16 << 10);
+    pool.initialize(kObjectSize);
+    std::vector<void*> objs;
+    run_thread(boost::bind(&alloc_routine, &pool, &objs, 10000));
+    assert(std::set<void*>(objs.begin(), objs.end()).size() == objs.size());
+    assert(nr_free(pool) == pool.capacity() - objs.size());
+    run_thread(boost::bind(&free_routine, &pool, &objs));
+    assert(is_all_free(pool));
+}
+
+static const int kThreads = 4;
+static const int kRounds = 200000;
+
+struct Exchange
+{
+    utils::Mutex       mutex;
+    std::vector<long*> objs;
+};
+
+static void
+stress_routine(Pool* pool, Exchange* exchange, long id)
+{
+    std::vector<long*> own;
+    unsigned int seed = id;
+    for (long i = 0; i < kRounds; i++) {
+        seed = seed * 1103515245 + 12345;
+        long* obj = (long*) pool->alloc_object();
+        assert(obj);
+        obj[0] = id;
+        obj[1] = i;
+        if ((seed >> 8) & 1) {
+            own.push_back(obj);
+        } else {
+            utils::Lock lk(exchange->mutex);
+            exchange->objs.push_back(obj);
+        }
+        long* other = NULL;
+        if ((seed >> 9) & 1) {
+            utils::Lock lk(exchange->mutex);
+            if (!exchange->objs.empty()) {
+                other = exchange->objs.back();
+                exchange->objs.pop_back();
+            }
+        } else if (!own.empty()) {
+            other = own.back();
+            own.pop_back();
+            // nobody else got it while it was allocated
+            assert(other[0] == id);
+        }
+        if (other) {
+            pool->free_object(other);
+        }
+    }
+    for (size_t i = 0; i < own.size(); i++) {
+        assert(own[i][0] == id);
+        pool->free_object(own[i]);
+    }
+}
+
+void
+test_stress()
+{
+    Pool pool(16 << 10);
+    pool.initialize(kObjectSize);
+    Exchange exchange;
+    std::vector<utils::ThreadId> tids;
+    for (long i = 0; i < kThreads; i++) {
+        tids.push_back(utils::create_thread(
+                           boost::bind(&stress_routine, &pool, &exchange,
+                                       i + 1)));
+    }
+    for (size_t i = 0; i < tids.size(); i++) {
+        pthread_join(tids[i], NULL);
+    }
+    std::vector<void*> rest(exchange.objs.begin(), exchange.objs.end());
+    run_thread(boost::bind(&free_routine, &pool, &rest));
+    assert(is_all_free(pool));
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_spill_refill();
+    test_cross_thread();
+    test_stress();
+    fprintf(stderr, "passed\n");
+    return 0;
+}
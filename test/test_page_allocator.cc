@@ -0,0 +1,174 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+#include <boost/bind.hpp>
+
+#include "core/buffer.h"
+#include "core/page_allocator.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Threads cache free pages of each class, spill half of a full cache to the
+// depot of the class, and refill an empty one from it.  A thread's cache goes
+// to the depots when it exits, and pages beyond the depot limit go back to
+// the system.  Every test uses a size class of its own.
+
+static const size_t kCacheBytes = 256 << 10;
+
+static void
+run_thread(boost::function<void ()> func)
+{
+    utils::ThreadId tid = utils::create_thread(func);
+    assert(tid != (utils::ThreadId) -1);
+    pthread_join(tid, NULL);
+}
+
+static void
+alloc_routine(std::vector<byte*>* pages, size_t size, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        pages->push_back(PageAllocator::instance().alloc_page(size));
+    }
+}
+
+static void
+free_routine(std::vector<byte*>* pages, size_t size)
+{
+    for (size_t i = 0; i < pages->size(); i++) {
+        PageAllocator::instance().free_page((*pages)[i], size);
+    }
+}
+
+static void
+spill_routine(size_t size)
+{
+    PageAllocator& allocator = PageAllocator::instance();
+    size_t limit = kCacheBytes / size;
+    std::vector<byte*> pages;
+    alloc_routine(&pages, size, limit + 1);
+    assert(std::set<byte*>(pages.begin(), pages.end()).size() == limit + 1);
+    for (size_t i = 0; i < limit; i++) {
+        allocator.free_page(pages[i], size);
+    }
+    assert(allocator.nr_depot_pages(size) == 0);
+    // a full cache gives half of it to the depot
+    allocator.free_page(pages[limit], size);
+    assert(allocator.nr_depot_pages(size) == limit / 2);
+}
+
+static void
+refill_routine(size_t size, std::vector<byte*>* pages)
+{
+    PageAllocator& allocator = PageAllocator::instance();
+    size_t limit = kCacheBytes / size;
+    size_t ndepot = allocator.nr_depot_pages(size);
+    // an empty cache takes half of its size from the depot
+    pages->push_back(allocator.alloc_page(size));
+    assert(allocator.nr_depot_pages(size) == ndepot - limit / 2);
+    alloc_routine(pages, size, limit / 2 - 1);
+    assert(allocator.nr_depot_pages(size) == ndepot - limit / 2);
+    pages->push_back(allocator.alloc_page(size));
+    assert(allocator.nr_depot_pages(size) == ndepot - limit);
+}
+
+void
+test_spill_refill()
+{
+    PageAllocator& allocator = PageAllocator::instance();
+    size_t size = 16 << 10;
+    size_t limit = kCacheBytes / size;
+    long nallocs = allocator.nr_system_allocs();
+    long nfrees = allocator.nr_system_frees();
+    long nrefills = allocator.nr_depot_refills();
+
+    run_thread(boost::bind(&spill_routine, size));
+    // the rest of the cache is released when its thread exits
+    assert(allocator.nr_depot_pages(size) == limit + 1);
+    assert(allocator.nr_system_allocs() == nallocs + (long) (limit + 1));
+
+    std::vector<byte*> pages;
+    run_thread(boost::bind(&refill_routine, size, &pages));
+    assert(allocator.nr_depot_refills() == nrefills + (long) limit);
+    assert(allocator.nr_depot_pages(size) == limit + 1 - pages.size());
+    // pages allocated by another thread
+    run_thread(boost::bind(&free_routine, &pages, size));
+    assert(allocator.nr_depot_pages(size) == limit + 1);
+    assert(allocator.nr_system_allocs() == nallocs + (long) (limit + 1));
+    assert(allocator.nr_system_frees() == nfrees);
+
+    // and all of them are handed out once
+    pages.clear();
+    run_thread(boost::bind(&alloc_routine, &pages, size, limit + 1));
+    assert(std::set<byte*>(pages.begin(), pages.end()).size() == limit + 1);
+    assert(allocator.nr_system_allocs() == nallocs + (long) (limit + 1));
+    run_thread(boost::bind(&free_routine, &pages, size));
+}
+
+void
+test_depot_limit()
+{
+    PageAllocator& allocator = PageAllocator::instance();
+    size_t size = 32 << 10;
+    size_t limit = kCacheBytes / size;
+    size_t depot_bytes = PageAllocator::kDepotBytes;
+    PageAllocator::kDepotBytes = size * limit / 2;
+    long nfrees = allocator.nr_system_frees();
+
+    run_thread(boost::bind(&spill_routine, size));
+    // the depot is full, what the thread still caches is freed
+    assert(allocator.nr_depot_pages(size) == limit / 2);
+    assert(allocator.nr_system_frees() == nfrees + (long) (limit / 2 + 1));
+
+    PageAllocator::kDepotBytes = depot_bytes;
+}
+
+static void
+buffer_routine()
+{
+    std::string header(100, 'h');
+    std::string body(40 << 10, 'b');
+    Buffer buf;
+    buf.append((const byte*) header.data(), header.size());
+    buf.append((const byte*) body.data(), body.size());
+    assert(buf.page_count() == 2);
+
+    int fds[2];
+    int ret = pipe(fds);
+    assert(ret == 0);
+    ssize_t nwritten = write(fds[1], header.data(), header.size());
+    assert(nwritten == (ssize_t) header.size());
+    Buffer in;
+    ssize_t nread = in.read_from_fd(fds[0]);
+    assert(nread == (ssize_t) header.size());
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void
+test_buffer_pages()
+{
+    // headers take small pages, the body a large one
+    PageAllocator& allocator = PageAllocator::instance();
+    size_t nsmall = allocator.nr_depot_pages(Buffer::kSmallPageSize);
+    size_t nlarge = allocator.nr_depot_pages(Buffer::kLargePageSize);
+    run_thread(&buffer_routine);
+    assert(allocator.nr_depot_pages(Buffer::kSmallPageSize) == nsmall + 2);
+    assert(allocator.nr_depot_pages(Buffer::kLargePageSize) == nlarge + 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    PageAllocator::kThreadCacheBytes = kCacheBytes;
+    test_spill_refill();
+    test_depot_limit();
+    test_buffer_pages();
+    fprintf(stderr, "passed\n");
+    return 0;
+}
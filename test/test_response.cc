@@ -0,0 +1,94 @@
+#include "pch.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "core/pipeline.h"
+#include "core/wrapper.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// A response streamed to a client which never reads must not grow the
+// output stream beyond the high-water mark.  By default write_data() blocks
+// until the io timeout, a suspendable handler gets is_congested() instead.
+
+static const size_t kChunkSize = (256 << 10);
+static const size_t kTotalSize = (32 << 20);
+
+static byte chunk[kChunkSize];
+
+static Connection*
+create_stalled_connection(int fds[2])
+{
+    int ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    assert(ret == 0);
+    utils::set_socket_blocking(fds[0], false);
+    Connection* conn = new Connection(fds[0]);
+    conn->set_io_timeout(100);
+    return conn;
+}
+
+void
+test_blocking_bounded()
+{
+    int fds[2];
+    Connection* conn = create_stalled_connection(fds);
+    bool timed_out = false;
+    {
+        Response response(conn);
+        for (size_t total = 0; total < kTotalSize; total += kChunkSize) {
+            if (response.write_data(chunk, kChunkSize) < 0) {
+                timed_out = true;
+                break;
+            }
+            assert(conn->out_stream().memory_usage()
+                   <= Response::kMaxMemorySizes);
+        }
+        response.close();
+    }
+    assert(timed_out);
+    close(fds[1]);
+}
+
+void
+test_suspend_bounded()
+{
+    int fds[2];
+    Connection* conn = create_stalled_connection(fds);
+    int marker = 0;
+    {
+        Response response(conn);
+        response.enable_suspend();
+        size_t total = 0;
+        while (!response.is_congested()) {
+            ssize_t nwritten = response.write_data(chunk, kChunkSize);
+            assert(nwritten == (ssize_t) kChunkSize);
+            total += kChunkSize;
+            assert(total < kTotalSize);
+        }
+        assert(conn->out_stream().memory_usage()
+               <= Response::kMaxMemorySizes + kChunkSize);
+
+        response.suspend_until_drained(&marker);
+        assert(conn->is_draining());
+        void* cont = response.restore_continuation();
+        assert(cont == &marker);
+        assert(!conn->is_draining());
+        response.close();
+    }
+    close(fds[1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+    memset(chunk, 'x', sizeof(chunk));
+    test_blocking_bounded();
+    test_suspend_bounded();
+    fprintf(stderr, "passed\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "pch.h"
+
+#include <cassert>
+#include <cstdio>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#include "core/pipeline.h"
+#include "utils/atomic.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// Every connection added to the scheduler must be picked once, however its
+// lock is contended.  Owner threads keep locking and unlocking connections
+// like other stages do, so consumers defer them.  Deferred connections are
+// put back by the wakeups of unlock() only, then also by a rescheduler
+// thread racing with the consumers which defer them.  Connections added
+// locked, as the poll_in stage does, are taken by consumers without locking.
+
+static const int kConnections = 64;
+static const int kRounds = 500;
+
+static Connection* conns[kConnections];
+static volatile long picked[kConnections];
+static volatile long current_run = 0;
+
+static void
+consumer_routine(Scheduler* sched)
+{
+    while (true) {
+        Connection* conn = sched->pick_task();
+        if (conn == NULL)
+            return;
+        utils::atomic_add(&picked[conn->fd() - 3], 1L);
+        conn->unlock();
+    }
+}
+
+static void
+owner_routine(unsigned int seed, long run)
+{
+    while (current_run == run) {
+        seed = seed * 1103515245 + 12345;
+        Connection* conn = conns[(seed >> 8) % kConnections];
+        if (conn->try_lock()) {
+            for (int i = 0; i < 100; i++) {
+                utils::cpu_relax();
+            }
+            conn->unlock();
+        }
+    }
+}
+
+static void
+rescheduler_routine(Scheduler* sched, long run)
+{
+    while (current_run == run) {
+        sched->reschedule();
+    }
+}
+
+static bool
+wait_for_picks(long expected)
+{
+    // a stranded connection is never picked
+    for (int i = 0; i < 2000; i++) {
+        bool done = true;
+        for (int j = 0; j < kConnections; j++) {
+            if (utils::atomic_load(&picked[j]) < expected) {
+                done = false;
+                break;
+            }
+        }
+        if (done) {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+void
+test_deferred(Scheduler* sched, bool broadcast)
+{
+    long run = utils::atomic_add(&current_run, 1L);
+    for (int i = 0; i < kConnections; i++) {
+        picked[i] = 0;
+    }
+    SchedulerFactory::instance().register_waiter(sched);
+    for (int i = 0; i < 4; i++) {
+        utils::create_thread(boost::bind(&consumer_routine, sched));
+        utils::create_thread(boost::bind(&owner_routine, i + 1, run));
+    }
+    if (broadcast) {
+        utils::create_thread(boost::bind(&rescheduler_routine, sched, run));
+    }
+
+    for (int round = 1; round <= kRounds; round++) {
+        for (int i = 0; i < kConnections; i++) {
+            sched->add_task(conns[i]);
+        }
+        bool picked_all = wait_for_picks(round);
+        assert(picked_all);
+    }
+    utils::atomic_add(&current_run, 1L);
+    for (int i = 0; i < kConnections; i++) {
+        assert(picked[i] == kRounds);
+    }
+}
+
+void
+test_handed_over(Scheduler* sched)
+{
+    long run = utils::atomic_add(&current_run, 1L);
+    for (int i = 0; i < kConnections; i++) {
+        picked[i] = 0;
+    }
+    SchedulerFactory::instance().register_waiter(sched);
+    for (int i = 0; i < 4; i++) {
+        utils::create_thread(boost::bind(&consumer_routine, sched));
+        utils::create_thread(boost::bind(&owner_routine, i + 1, run));
+    }
+
+    Scheduler::ConnectionList batch;
+    for (int round = 1; round <= kRounds; round++) {
+        for (int i = 0; i < kConnections; i++) {
+            if (conns[i]->try_lock()) {
+                batch.push_back(conns[i]);
+            } else {
+                sched->add_task(conns[i]); // owned by others
+            }
+        }
+        sched->add_locked_task_batch(batch);
+        batch.clear();
+        bool picked_all = wait_for_picks(round);
+        assert(picked_all);
+    }
+    utils::atomic_add(&current_run, 1L);
+    for (int i = 0; i < kConnections; i++) {
+        assert(picked[i] == kRounds);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    // fake file descriptors, they are only used as index
+    for (int i = 0; i < kConnections; i++) {
+        conns[i] = new Connection(i + 3);
+    }
+    // schedulers are leaked, consumer threads are still waiting on them
+    test_deferred(new LockFreeScheduler(), false);
+    test_deferred(new LockFreeScheduler(), true);
+    test_handed_over(new QueueScheduler());
+    test_handed_over(new LockFreeScheduler());
+    fprintf(stderr, "passed\n");
+    return 0;
+}
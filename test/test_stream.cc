@@ -0,0 +1,262 @@
+#include "pch.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "core/stream.h"
+#include "utils/misc.h"
+
+using namespace tube;
+
+// OutputStream gathers the writeables in memory into one writev(), consumes
+// what was written across writeables, and keeps the memory usage of the
+// rest.  A file following them is held back with MSG_MORE, which falls back
+// to writev() on descriptors that aren't sockets.
+
+static int nr_more_sends = 0;
+
+extern "C" ssize_t
+sendmsg(int fd, const struct msghdr* msg, int flags)
+{
+    typedef ssize_t (*SendmsgFunc)(int, const struct msghdr*, int);
+    static SendmsgFunc real_sendmsg = NULL;
+    if (real_sendmsg == NULL) {
+        real_sendmsg = (SendmsgFunc) dlsym(RTLD_NEXT, "sendmsg");
+    }
+#ifdef MSG_MORE
+    if (flags & MSG_MORE) {
+        nr_more_sends++;
+    }
+#endif
+    return real_sendmsg(fd, msg, flags);
+}
+
+static std::string
+make_data(size_t size, int seed)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (char) ((i * 7 + seed) % 251);
+    }
+    return data;
+}
+
+static void
+append_buffer(OutputStream& out, const std::string& data)
+{
+    Buffer buf;
+    buf.append((const byte*) data.data(), data.size());
+    out.append_buffer(buf);
+}
+
+static std::string
+read_all(int fd, size_t size)
+{
+    std::string res;
+    char buf[4096];
+    while (res.size() < size) {
+        ssize_t nread = ::read(fd, buf, sizeof(buf));
+        if (nread <= 0) {
+            break;
+        }
+        res.append(buf, nread);
+    }
+    return res;
+}
+
+static int
+make_file(const std::string& data)
+{
+    char path[] = "/tmp/test_stream_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+    ssize_t nwritten = ::write(fd, data.data(), data.size());
+    assert(nwritten == (ssize_t) data.size());
+    return fd;
+}
+
+void
+test_partial_write()
+{
+    // a full pipe stops the writev() in the middle of the second buffer
+    int fds[2];
+    int ret = pipe(fds);
+    assert(ret == 0);
+    utils::set_socket_blocking(fds[1], false);
+    std::string data[3];
+    std::string expected;
+    OutputStream out(fds[1]);
+    for (int i = 0; i < 3; i++) {
+        data[i] = make_data(40000, i);
+        expected += data[i];
+        append_buffer(out, data[i]);
+    }
+    assert(out.memory_usage() == expected.size());
+
+    ssize_t nwritten = out.write_into_output();
+    assert(nwritten > 40000 && nwritten < 80000);
+    size_t left = expected.size() - nwritten;
+    assert(out.memory_usage() == left);
+    assert(!out.is_done());
+    nwritten = out.write_into_output();
+    assert(nwritten < 0 && errno == EAGAIN);
+    assert(out.memory_usage() == left);
+
+    std::string res;
+    while (!out.is_done()) {
+        res += read_all(fds[0], 1);
+        left = out.memory_usage();
+        nwritten = out.write_into_output();
+        if (nwritten > 0) {
+            assert(out.memory_usage() == left - nwritten);
+        }
+    }
+    res += read_all(fds[0], expected.size() - res.size());
+    assert(res == expected);
+    assert(out.memory_usage() == 0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void
+connect_loopback(int fds[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int ret = bind(listen_fd, (struct sockaddr*) &addr, len);
+    assert(ret == 0);
+    ret = listen(listen_fd, 1);
+    assert(ret == 0);
+    ret = getsockname(listen_fd, (struct sockaddr*) &addr, &len);
+    assert(ret == 0);
+    fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+    ret = connect(fds[1], (struct sockaddr*) &addr, len);
+    assert(ret == 0);
+    fds[0] = accept(listen_fd, NULL, NULL);
+    assert(fds[0] >= 0);
+    close(listen_fd);
+}
+
+static std::string
+write_with_file(int fd, const std::string& header, const std::string& body,
+                const std::string& trailer)
+{
+    // the header goes out with MSG_MORE, the file isn't gathered, and the
+    // trailer is written on its own
+    OutputStream out(fd);
+    append_buffer(out, header);
+    out.append_file(make_file(body), 0, -1);
+    append_buffer(out, trailer);
+    assert(out.memory_usage() == header.size() + trailer.size());
+    assert(!out.in_memory());
+
+    int nr_more = nr_more_sends;
+    ssize_t nwritten = out.write_into_output();
+    assert(nwritten == (ssize_t) header.size());
+    assert(out.memory_usage() == trailer.size());
+#ifdef MSG_MORE
+    assert(nr_more_sends == nr_more + 1);
+#endif
+    size_t nfile = 0;
+    while (nfile < body.size()) {
+        nwritten = out.write_into_output();
+        assert(nwritten > 0);
+        nfile += nwritten;
+    }
+    assert(nfile == body.size());
+    assert(out.memory_usage() == trailer.size());
+    nr_more = nr_more_sends;
+    nwritten = out.write_into_output();
+    assert(nwritten == (ssize_t) trailer.size());
+    assert(nr_more_sends == nr_more);
+    assert(out.is_done() && out.memory_usage() == 0);
+    return header + body + trailer;
+}
+
+void
+test_more_before_file()
+{
+    int fds[2];
+    connect_loopback(fds);
+    std::string expected = write_with_file(fds[0], make_data(100, 1),
+                                           make_data(20000, 2),
+                                           make_data(50, 3));
+    assert(read_all(fds[1], expected.size()) == expected);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void
+test_not_socket()
+{
+    // sendmsg() fails with ENOTSOCK on a file, writev() writes it
+    std::string empty;
+    int fd = make_file(empty);
+    std::string expected = write_with_file(fd, make_data(100, 4),
+                                           make_data(20000, 5),
+                                           make_data(50, 6));
+    off_t off = lseek(fd, 0, SEEK_SET);
+    assert(off == 0);
+    assert(read_all(fd, expected.size()) == expected);
+    close(fd);
+}
+
+void
+test_max_iovecs()
+{
+    // pages beyond kMaxIovecs are left to the next write
+    size_t npages = Buffer::kMaxIovecs + 100;
+    std::string page = make_data(Buffer::kMinShareSize, 7);
+    Buffer buf;
+    for (size_t i = 0; i < npages; i++) {
+        Buffer piece;
+        piece.append((const byte*) page.data(), page.size());
+        buf.append(piece);
+    }
+    assert(buf.page_count() == npages);
+
+    std::string empty;
+    int fd = make_file(empty);
+    OutputStream out(fd);
+    out.append_buffer(buf);
+    ssize_t nwritten = out.write_into_output();
+    assert(nwritten == (ssize_t) (Buffer::kMaxIovecs * page.size()));
+    assert(out.memory_usage() == 100 * page.size());
+    nwritten = out.write_into_output();
+    assert(nwritten == (ssize_t) (100 * page.size()));
+    assert(out.is_done() && out.memory_usage() == 0);
+
+    off_t off = lseek(fd, 0, SEEK_SET);
+    assert(off == 0);
+    std::string res = read_all(fd, npages * page.size());
+    assert(res.size() == npages * page.size());
+    for (size_t i = 0; i < npages; i++) {
+        assert(res.compare(i * page.size(), page.size(), page) == 0);
+    }
+    close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_partial_write();
+    test_more_before_file();
+    test_not_socket();
+    test_max_iovecs();
+    fprintf(stderr, "passed\n");
+    return 0;
+}
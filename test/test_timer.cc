@@ -0,0 +1,105 @@
+#include "pch.h"
+
+#include <cassert>
+#include <cstdio>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#include "core/timer.h"
+
+using namespace tube;
+
+static const int kNodes = 1000;
+
+struct Item
+{
+    TimerNode node;
+    u64       fired;
+};
+
+static bool
+fire(void* ptr)
+{
+    ((Item*) ptr)->fired = Timer::current_msec();
+    return true;
+}
+
+static void
+run_until_empty(Timer& timer)
+{
+    while (timer.size() > 0) {
+        timer.process_callbacks();
+        usleep(1000);
+    }
+}
+
+void
+test_wheel()
+{
+    Timer timer;
+    timer.set_handler(boost::bind(fire, _1));
+    Item items[kNodes];
+    u64 start = Timer::current_msec();
+    for (int i = 0; i < kNodes; i++) {
+        items[i].node.ctx = &items[i];
+        items[i].fired = 0;
+        // spread over the root wheel and the first coarse wheel
+        timer.schedule(&items[i].node, start + (i * 7) % 700);
+    }
+    for (int i = 0; i < kNodes; i += 2) {
+        timer.cancel(&items[i].node);
+    }
+    // re-arm some, they are moved rather than added twice
+    for (int i = 1; i < kNodes; i += 4) {
+        timer.schedule(&items[i].node, start + 300);
+    }
+    assert(timer.size() == (size_t) kNodes / 2);
+    run_until_empty(timer);
+    for (int i = 0; i < kNodes; i++) {
+        u64 expire = (i % 4 == 1) ? start + 300 : start + (i * 7) % 700;
+        if (i % 2 == 0) {
+            assert(items[i].fired == 0);
+        } else {
+            assert(items[i].fired >= expire);
+        }
+        assert(!items[i].node.is_scheduled());
+    }
+}
+
+static int nr_keyed_calls = 0;
+
+static bool
+keyed_callback(void* ptr)
+{
+    nr_keyed_calls++;
+    return true;
+}
+
+void
+test_keyed()
+{
+    Timer timer;
+    Timer::Unit now = Timer::current_timer_unit();
+    Timer::Callback cb = boost::bind(keyed_callback, _1);
+    bool res = timer.set(now, &timer, cb);
+    assert(res);
+    res = timer.set(now, &timer, cb);
+    assert(!res);
+    res = timer.set(now + 1, &timer, cb);
+    assert(res);
+    assert(timer.query(now + 1, &timer, cb));
+    res = timer.remove(now + 1, &timer);
+    assert(res);
+    assert(!timer.query(now + 1, &timer, cb));
+    run_until_empty(timer);
+    assert(nr_keyed_calls == 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    test_wheel();
+    test_keyed();
+    fprintf(stderr, "passed\n");
+    return 0;
+}
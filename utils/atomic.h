@@ -0,0 +1,89 @@
+// -*- mode: c++ -*-
+
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include <sched.h>
+
+namespace tube {
+namespace utils {
+
+// Thin wrappers around GCC's __sync builtins.  All of them imply a full
+// memory barrier, which is stronger than necessary but keeps the code
+// portable across the compilers we support.
+
+#define CACHE_LINE_SIZE 64
+
+inline void
+memory_barrier()
+{
+    __sync_synchronize();
+}
+
+template <typename T> inline T
+atomic_load(volatile T* ptr)
+{
+    T val = *ptr;
+    __sync_synchronize();
+    return val;
+}
+
+template <typename T> inline void
+atomic_store(volatile T* ptr, T val)
+{
+    __sync_synchronize();
+    *ptr = val;
+    __sync_synchronize();
+}
+
+template <typename T> inline bool
+atomic_cas(volatile T* ptr, T oldval, T newval)
+{
+    return __sync_bool_compare_and_swap(ptr, oldval, newval);
+}
+
+template <typename T> inline T
+atomic_add(volatile T* ptr, T val)
+{
+    return __sync_add_and_fetch(ptr, val);
+}
+
+template <typename T> inline T
+atomic_sub(volatile T* ptr, T val)
+{
+    return __sync_sub_and_fetch(ptr, val);
+}
+
+template <typename T> inline T
+atomic_or(volatile T* ptr, T val)
+{
+    return __sync_or_and_fetch(ptr, val);
+}
+
+/**
+ * Store val and return the previous value.
+ */
+template <typename T> inline T
+atomic_swap(volatile T* ptr, T val)
+{
+    T old = *ptr;
+    while (!__sync_bool_compare_and_swap(ptr, old, val)) {
+        old = *ptr;
+    }
+    return old;
+}
+
+inline void
+cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    sched_yield();
+#endif
+}
+
+}
+}
+
+#endif /* _ATOMIC_H_ */
@@ -0,0 +1,91 @@
+#include "pch.h"
+
+#include <algorithm>
+
+#include "utils/epoch.h"
+#include "utils/atomic.h"
+
+namespace tube {
+namespace utils {
+
+static __thread void* epoch_record_ = NULL;
+
+void
+EpochManager::register_thread()
+{
+    if (epoch_record_ != NULL) {
+        return;
+    }
+    Record* rec = new Record();
+    rec->epoch = atomic_load(&epoch_);
+    Lock lk(mutex_);
+    records_.push_back(rec);
+    epoch_record_ = rec;
+}
+
+void
+EpochManager::unregister_thread()
+{
+    Record* rec = (Record*) epoch_record_;
+    if (rec == NULL) {
+        return;
+    }
+    {
+        Lock lk(mutex_);
+        records_.erase(std::find(records_.begin(), records_.end(), rec));
+    }
+    delete rec;
+    epoch_record_ = NULL;
+}
+
+bool
+EpochManager::is_registered() const
+{
+    return epoch_record_ != NULL;
+}
+
+void
+EpochManager::quiescent()
+{
+    Record* rec = (Record*) epoch_record_;
+    if (rec) {
+        atomic_store(&rec->epoch, atomic_load(&epoch_));
+    }
+}
+
+void
+EpochManager::offline()
+{
+    Record* rec = (Record*) epoch_record_;
+    if (rec) {
+        atomic_store(&rec->epoch, kOffline);
+    }
+}
+
+void
+EpochManager::online()
+{
+    // same as quiescent(), the full barrier orders it before any access to
+    // shared objects
+    quiescent();
+}
+
+u64
+EpochManager::retire_epoch()
+{
+    return atomic_add(&epoch_, 1ULL) - 1;
+}
+
+u64
+EpochManager::safe_epoch()
+{
+    u64 safe = atomic_load(&epoch_);
+    Lock lk(mutex_);
+    for (size_t i = 0; i < records_.size(); i++) {
+        safe = std::min(safe, (u64) atomic_load(&records_[i]->epoch));
+    }
+    return safe;
+}
+
+}
+}
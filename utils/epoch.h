@@ -0,0 +1,89 @@
+// -*- mode: c++ -*-
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include <vector>
+
+#include "utils/misc.h"
+#include "utils/lock.h"
+
+namespace tube {
+namespace utils {
+
+/**
+ * Quiescent-state based epoch tracking for deferred reclamation.
+ *
+ * Threads which touch shared objects register themselves, and announce a
+ * quiescent point whenever they hold no reference to such objects, e.g.
+ * between two tasks.  Before blocking, they go offline, so that idle threads
+ * don't hold back reclamation.
+ *
+ * An object is retired with retire_epoch() once it's unreachable for new
+ * users.  It can be freed as soon as safe_epoch() is larger than its retire
+ * epoch, because every registered thread has passed a quiescent point since
+ * then.
+ */
+class EpochManager : public Noncopyable
+{
+    struct Record {
+        volatile u64 epoch; // kOffline when the thread is offline
+    };
+
+    static const u64 kOffline = ~0ULL;
+
+    Mutex                mutex_;
+    std::vector<Record*> records_;
+    volatile u64         epoch_;
+
+    EpochManager() : epoch_(1) {}
+public:
+    static EpochManager& instance() {
+        // never destroyed, threads still use it at exit
+        static EpochManager* ins = new EpochManager();
+        return *ins;
+    }
+
+    /**
+     * Register current thread, it starts online.
+     */
+    void register_thread();
+    void unregister_thread();
+    bool is_registered() const;
+
+    /**
+     * Announce current thread holds no reference to retired objects.
+     */
+    void quiescent();
+    /**
+     * Current thread is about to block, it holds no reference until
+     * online() is called.
+     */
+    void offline();
+    void online();
+
+    /**
+     * Advance the global epoch.
+     * @return The epoch of objects retired now.
+     */
+    u64  retire_epoch();
+    /**
+     * @return Objects retired before this epoch can be freed.
+     */
+    u64  safe_epoch();
+};
+
+/**
+ * Register the calling thread on the EpochManager for the scope.
+ */
+class EpochThread : public Noncopyable
+{
+public:
+    EpochThread() { EpochManager::instance().register_thread(); }
+    ~EpochThread() { EpochManager::instance().unregister_thread(); }
+};
+
+}
+}
+
+#endif /* _EPOCH_H_ */
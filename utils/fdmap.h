@@ -5,10 +5,11 @@
 
 #include <sys/time.h>
 #include <sys/resource.h>
-#include <boost/shared_array.hpp>
-#include <list>
+#include <vector>
 #include <cassert>
 
+#include "utils/misc.h"
+
 namespace tube {
 namespace utils {
 
@@ -29,22 +30,26 @@ get_fdmap_max_size()
     }
 }
 
+/**
+ * Map from file descriptor to T.
+ *
+ * Values are kept densely in insertion order until erased, the last value
+ * fills the hole of an erased one.  A two-level radix table maps each fd to
+ * its position, its pages are allocated on the first insert into them.  So
+ * memory is proportional to the live descriptors rather than RLIMIT_NOFILE,
+ * and insert, find and erase are O(1).
+ *
+ * Iterators are invalidated by insert() and erase().
+ */
 template <typename T>
 class FDMap
 {
 public:
-    typedef typename std::list<T> ItemList;
+    typedef typename std::vector<T> ItemList;
     typedef typename ItemList::iterator iterator;
     typedef typename ItemList::const_iterator const_iterator;
 
-    FDMap() {
-        max_size_ = get_fdmap_max_size();
-        table_ = boost::shared_array<iterator>(new iterator[max_size_]);
-        for (size_t i = 0; i < max_size_; i++) {
-            table_[i] = items_.end(); // all set to invalid iterator
-        }
-    }
-    virtual ~FDMap() {}
+    FDMap() {}
 
     iterator begin() { return items_.begin(); }
     iterator end() { return items_.end(); }
@@ -52,36 +57,71 @@ public:
     const_iterator end() const { return items_.end(); }
     size_t size() const { return items_.size(); }
 
-    iterator find(size_t idx) const {
-        assert(idx < max_size_);
-        return table_[idx];
+    iterator find(size_t idx) {
+        u32 pos = position(idx);
+        return pos == 0 ? end() : items_.begin() + (pos - 1);
+    }
+
+    const_iterator find(size_t idx) const {
+        u32 pos = position(idx);
+        return pos == 0 ? end() : items_.begin() + (pos - 1);
     }
 
     bool erase(size_t idx) {
-        assert(idx < max_size_);
-        if (table_[idx] == end()) {
+        u32 pos = position(idx);
+        if (pos == 0) {
             return false;
-        } else {
-            items_.erase(table_[idx]);
-            table_[idx] = end();
-            return true;
         }
+        size_t last = items_.size() - 1;
+        if (pos - 1 != last) {
+            items_[pos - 1] = items_[last];
+            fds_[pos - 1] = fds_[last];
+            slot(fds_[pos - 1]) = pos;
+        }
+        items_.pop_back();
+        fds_.pop_back();
+        slot(idx) = 0;
+        return true;
     }
 
     bool insert(size_t idx, const T& value) {
-        assert(idx < max_size_);
-        if (table_[idx] == end()) {
-            table_[idx] = items_.insert(items_.end(), value);
-            return true;
-        } else {
+        u32& pos = slot(idx);
+        if (pos != 0) {
             return false;
         }
+        items_.push_back(value);
+        fds_.push_back(idx);
+        pos = items_.size();
+        return true;
     }
 private:
-    size_t max_size_;
+    static const size_t kPageBits = 12;
+    static const size_t kPageSize = 1 << kPageBits;
+
+    typedef std::vector<u32> Page; // positions plus one, 0 for none
 
-    ItemList                      items_;
-    boost::shared_array<iterator> table_;
+    ItemList          items_;
+    std::vector<int>  fds_;   // fd of each item
+    std::vector<Page> pages_; // empty until used
+
+    u32 position(size_t idx) const {
+        size_t page = idx >> kPageBits;
+        if (page >= pages_.size() || pages_[page].empty()) {
+            return 0;
+        }
+        return pages_[page][idx & (kPageSize - 1)];
+    }
+
+    u32& slot(size_t idx) {
+        size_t page = idx >> kPageBits;
+        if (page >= pages_.size()) {
+            pages_.resize(page + 1);
+        }
+        if (pages_[page].empty()) {
+            pages_[page].assign(kPageSize, 0);
+        }
+        return pages_[page][idx & (kPageSize - 1)];
+    }
 };
 
 }
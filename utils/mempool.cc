@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <sys/mman.h>
 #include <cstdio>
+#include <algorithm>
 
 #include "utils/mempool.h"
 
@@ -17,63 +18,175 @@ static const long kChunkMask = 0x3FFF;
 static const long kBlockMask = 0x000F;
 
 MemoryPoolBase::MemoryPoolBase(size_t blk_size)
-    : blk_size_(0), free_stack_(NULL), free_stack_size_(0)
+    : chunk_size_(align_size(blk_size, kChunkMask)), obj_size_(0),
+      free_list_(NULL), nfree_(0), capacity_(0)
 {
-    blk_size_ = blk_size = align_size(blk_size, kChunkMask);
-    blk_ptr_ = (u8*) mmap(NULL, blk_size_, PROT_READ | PROT_WRITE,
-                          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    if (blk_ptr_ == NULL || (long) blk_ptr_ < 0) {
-        blk_size_ = 0;
-    }
 }
 
 void
 MemoryPoolBase::initialize(size_t obj_size)
 {
-    obj_size_ = obj_size = align_size(obj_size, kBlockMask);
-    if (blk_ptr_ == NULL) {
-        return;
-    }
-    // push all free objects on the freestack
-    free_stack_size_ = blk_size_ / obj_size;
-    PtrType cur_ptr = blk_ptr_;
-    free_stack_ = new PtrType[free_stack_size_];
-    for (size_t i = 0; i < free_stack_size_; i++) {
-        free_stack_[i] = cur_ptr;
-        cur_ptr += obj_size;
+    // objects on the free list hold the link
+    obj_size_ = align_size(std::max(obj_size, sizeof(FreeObject)),
+                           kBlockMask);
+    if (chunk_size_ < obj_size_) {
+        chunk_size_ = align_size(obj_size_, kChunkMask);
     }
 }
 
 MemoryPoolBase::~MemoryPoolBase()
 {
-    if (blk_ptr_ != NULL) {
-        munmap(blk_ptr_, blk_size_);
-        delete [] free_stack_;
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        munmap(chunks_[i], chunk_size_);
+    }
+    for (size_t i = 0; i < fallbacks_.size(); i++) {
+        free(fallbacks_[i]);
     }
 }
 
 bool
 MemoryPoolBase::is_inside_pool(void* ptr) const
 {
-    if (ptr < blk_ptr_ || ptr >= blk_ptr_ + blk_size_)
-        return false;
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        if (ptr >= chunks_[i] && ptr < chunks_[i] + chunk_size_)
+            return true;
+    }
+    return false;
+}
+
+bool
+MemoryPoolBase::grow()
+{
+    u8* chunk = (u8*) mmap(NULL, chunk_size_, PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (chunk == MAP_FAILED) {
+        void* ptr = malloc(obj_size_);
+        if (ptr == NULL) {
+            return false;
+        }
+        fallbacks_.push_back(ptr);
+        free_object(ptr);
+        capacity_++;
+        return true;
+    }
+    chunks_.push_back(chunk);
+    // in address order, so that the first objects allocated are adjacent
+    size_t nobjs = chunk_size_ / obj_size_;
+    for (size_t i = nobjs; i > 0; i--) {
+        free_object(chunk + (i - 1) * obj_size_);
+    }
+    capacity_ += nobjs;
     return true;
 }
 
 void*
 MemoryPoolBase::alloc_object()
 {
-    void* ptr = NULL;
-    if (free_stack_size_ > 0) {
-        ptr = free_stack_[--free_stack_size_];
+    if (free_list_ == NULL && !grow()) {
+        return NULL;
     }
-    return ptr;
+    FreeObject* obj = free_list_;
+    free_list_ = obj->next;
+    nfree_--;
+    return obj;
 }
 
 void
 MemoryPoolBase::free_object(void* ptr)
 {
-    free_stack_[free_stack_size_++] = (u8*) ptr;
+    FreeObject* obj = (FreeObject*) ptr;
+    obj->next = free_list_;
+    free_list_ = obj;
+    nfree_++;
+}
+
+size_t
+MemoryPoolBase::alloc_batch(void** objs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if ((objs[i] = alloc_object()) == NULL) {
+            return i;
+        }
+    }
+    return n;
+}
+
+void
+MemoryPoolBase::free_batch(void** objs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free_object(objs[i]);
+    }
+}
+
+ThreadSafePool::ThreadSafePool()
+{
+    pthread_key_create(&key_, release_magazine);
+}
+
+ThreadSafePool::~ThreadSafePool()
+{
+    // magazines of running threads are leaked, their objects are unmapped
+    // with the pool anyway
+    pthread_key_delete(key_);
+}
+
+ThreadSafePool::Magazine*
+ThreadSafePool::magazine(MemoryPoolBase& pool)
+{
+    Magazine* mag = (Magazine*) pthread_getspecific(key_);
+    if (mag == NULL) {
+        mag = new Magazine();
+        mag->owner = this;
+        mag->pool = &pool;
+        mag->size = 0;
+        pthread_setspecific(key_, mag);
+    }
+    return mag;
+}
+
+void
+ThreadSafePool::release_magazine(void* ptr)
+{
+    Magazine* mag = (Magazine*) ptr;
+    {
+        Lock lk(mag->owner->mutex_);
+        mag->pool->free_batch(mag->objs, mag->size);
+    }
+    delete mag;
+}
+
+void*
+ThreadSafePool::cached_alloc(MemoryPoolBase& pool)
+{
+    Magazine* mag = magazine(pool);
+    if (mag->size == 0) {
+        Lock lk(mutex_);
+        mag->size = pool.alloc_batch(mag->objs, kMagazineSize / 2);
+    }
+    if (mag->size == 0) {
+        return NULL;
+    }
+    return mag->objs[--mag->size];
+}
+
+void
+ThreadSafePool::cached_free(MemoryPoolBase& pool, void* ptr)
+{
+    Magazine* mag = magazine(pool);
+    if (mag->size == kMagazineSize) {
+        // the older half goes back
+        size_t n = kMagazineSize / 2;
+        {
+            Lock lk(mutex_);
+            pool.free_batch(mag->objs, n);
+        }
+        mag->size -= n;
+        for (size_t i = 0; i < mag->size; i++) {
+            mag->objs[i] = mag->objs[i + n];
+        }
+    }
+    mag->objs[mag->size++] = ptr;
 }
 
 }
@@ -3,6 +3,8 @@
 #ifndef _MEMPOOL_H_
 #define _MEMPOOL_H_
 
+#include <vector>
+
 #include "pch.h"
 #include "utils/misc.h"
 #include "utils/lock.h"
@@ -10,34 +12,33 @@
 namespace tube {
 namespace utils {
 
-class NoThreadSafePool
-{
-public:
-    void lock_pool() {}
-    bool try_lock_pool() { return true; }
-    void unlock_pool() {}
-};
-
-class ThreadSafePool
-{
-    Mutex mutex_;
-public:
-    void lock_pool() { mutex_.lock(); }
-    bool try_lock_pool() { return mutex_.try_lock(); }
-    void unlock_pool() { mutex_.unlock(); }
-};
-
+/**
+ * Slab of fixed size objects.
+ *
+ * Memory is mapped in chunks of the block size, the first one on the first
+ * allocation and another whenever all objects are in use, so the pool never
+ * runs out.  Only when mapping a chunk fails objects are malloc()ed one by
+ * one, they're counted as fallbacks and stay in the pool once freed.  Nothing
+ * is returned to the system before the pool is destroyed.
+ *
+ * Not thread safe, see the lock policies of MemoryPool.
+ */
 class MemoryPoolBase : public Noncopyable
 {
-protected:
-    u8* blk_ptr_;
-    size_t blk_size_;
+    struct FreeObject {
+        FreeObject* next;
+    };
 
-    typedef u8* PtrType;
-    PtrType* free_stack_;
-    size_t   free_stack_size_;
+    size_t      chunk_size_;
+    size_t      obj_size_;
+    FreeObject* free_list_;
+    size_t      nfree_;
+    size_t      capacity_;
 
-    size_t   obj_size_;
+    std::vector<u8*>   chunks_;
+    std::vector<void*> fallbacks_;
+
+    bool grow();
 public:
     MemoryPoolBase(size_t blk_size);
     virtual ~MemoryPoolBase();
@@ -47,35 +48,102 @@ public:
     bool is_inside_pool(void* ptr) const;
     size_t object_size() const { return obj_size_; }
 
+    /**
+     * Number of chunks mapped.
+     */
+    size_t nr_chunks() const { return chunks_.size(); }
+    /**
+     * Number of objects owned by the pool, in use or not.
+     */
+    size_t capacity() const { return capacity_; }
+    /**
+     * Number of free objects, excluding those cached by threads.
+     */
+    size_t nr_free() const { return nfree_; }
+    /**
+     * Number of objects malloc()ed because a chunk couldn't be mapped.
+     */
+    size_t nr_fallbacks() const { return fallbacks_.size(); }
+
     void* alloc_object();
     void  free_object(void* ptr);
+
+    /**
+     * Allocate n objects into objs.
+     * @return Number of objects allocated, less than n only when out of
+     * memory.
+     */
+    size_t alloc_batch(void** objs, size_t n);
+    void   free_batch(void** objs, size_t n);
+};
+
+/**
+ * Lock policy for pools used by one thread at a time, e.g. under the lock of
+ * their owner.
+ */
+class NoThreadSafePool
+{
+protected:
+    void* cached_alloc(MemoryPoolBase& pool) {
+        return pool.MemoryPoolBase::alloc_object();
+    }
+    void  cached_free(MemoryPoolBase& pool, void* ptr) {
+        pool.MemoryPoolBase::free_object(ptr);
+    }
+};
+
+/**
+ * Lock policy for pools shared by threads.
+ *
+ * Every thread keeps a magazine of free objects, allocating and freeing
+ * don't lock as long as it isn't empty or full.  An empty magazine is
+ * refilled by half from the pool under the lock, and half of a full one goes
+ * back to the pool.  Magazines go back to the pool when their thread exits.
+ */
+class ThreadSafePool
+{
+public:
+    /**
+     * Maximum number of free objects cached by each thread.
+     */
+    static const size_t kMagazineSize = 64;
+
+    ThreadSafePool();
+    ~ThreadSafePool();
+
+    /**
+     * Lock of the pool, for reading its counters.
+     */
+    Mutex& pool_mutex() { return mutex_; }
+protected:
+    void* cached_alloc(MemoryPoolBase& pool);
+    void  cached_free(MemoryPoolBase& pool, void* ptr);
+private:
+    struct Magazine {
+        ThreadSafePool* owner;
+        MemoryPoolBase* pool;
+        size_t          size;
+        void*           objs[kMagazineSize];
+    };
+
+    Mutex         mutex_;
+    pthread_key_t key_;
+
+    Magazine* magazine(MemoryPoolBase& pool);
+    static void release_magazine(void* ptr);
 };
 
 template <class LockPolicy>
 class MemoryPool : public MemoryPoolBase, public LockPolicy
 {
 public:
+    /**
+     * @param blk_size Size of each chunk mapped.
+     */
     MemoryPool(size_t blk_size) : MemoryPoolBase(blk_size) {}
 
-    void* alloc_object() {
-        this->lock_pool();
-        void* ptr = MemoryPoolBase::alloc_object();
-        this->unlock_pool();
-        if (ptr == NULL) {
-            ptr = malloc(obj_size_);
-        }
-        return ptr;
-    }
-
-    void free_object(void* ptr) {
-        if (is_inside_pool(ptr)) {
-            this->lock_pool();
-            MemoryPoolBase::free_object(ptr);
-            this->unlock_pool();
-        } else {
-            free(ptr);
-        }
-    }
+    void* alloc_object() { return this->cached_alloc(*this); }
+    void  free_object(void* ptr) { this->cached_free(*this, ptr); }
 };
 
 }
@@ -31,6 +31,12 @@ typedef boost::noncopyable Noncopyable;
 
 ThreadId create_thread(boost::function<void ()> func);
 ThreadId thread_id();
+void     set_thread_affinity(int cpu);
+
+/**
+ * @return Microseconds from a monotonic clock.
+ */
+u64      monotonic_usec();
 
 void set_socket_blocking(int fd, bool block);
 void set_fdtable_size(size_t sz);